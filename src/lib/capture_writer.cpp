@@ -0,0 +1,508 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the capture writer, that stores the intercepted traffic to a pcapng file.
+ */
+
+#include "capture_writer.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "config.hpp"
+#include "socket_table.hpp"
+
+CCapture_Writer* gCapture_Writer = nullptr;
+
+namespace {
+
+    // pcapng block types and constants
+    constexpr uint32_t Block_Section_Header = 0x0A0D0D0A;
+    constexpr uint32_t Block_Interface_Description = 0x00000001;
+    constexpr uint32_t Block_Enhanced_Packet = 0x00000006;
+    constexpr uint32_t Byte_Order_Magic = 0x1A2B3C4D;
+    // raw IPv4 packets, without any link layer header
+    constexpr uint16_t Link_Type_Raw = 101;
+    constexpr uint16_t Option_End = 0;
+    constexpr uint16_t Option_Shb_User_Application = 4;
+    constexpr uint16_t Option_If_Ts_Resolution = 9;
+
+    constexpr size_t Ip_Header_Size = 20;
+    constexpr size_t Tcp_Header_Size = 20;
+    // longer buffers are split to several segments, so every packet fits to the IPv4 length field
+    constexpr size_t Max_Segment = 65535 - Ip_Header_Size - Tcp_Header_Size;
+
+    // TCP flags of all synthesized segments
+    constexpr uint8_t Tcp_Flags_Psh_Ack = 0x18;
+
+    // synthesized addresses (10.0.0.1 and 10.0.0.2) of sockets, that are not IPv4
+    constexpr uint32_t Synthesized_Local_Addr = 0x0A000001;
+    constexpr uint32_t Synthesized_Remote_Addr = 0x0A000002;
+
+    template<typename T>
+    void Append(std::vector<char>& buf, const T& value) {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buf.insert(buf.end(), bytes, bytes + sizeof(T));
+    }
+
+    void Append_Padding(std::vector<char>& buf) {
+        while (buf.size() % 4) {
+            buf.push_back(0);
+        }
+    }
+
+    void Append_Option(std::vector<char>& buf, uint16_t code, const void* value, uint16_t len) {
+        Append(buf, code);
+        Append(buf, len);
+        const char* bytes = static_cast<const char*>(value);
+        buf.insert(buf.end(), bytes, bytes + len);
+        Append_Padding(buf);
+    }
+
+    // starts a block; the total length is filled by End_Block
+    void Begin_Block(std::vector<char>& buf, uint32_t type) {
+        buf.clear();
+        Append(buf, type);
+        Append(buf, uint32_t(0));
+    }
+
+    void End_Block(std::vector<char>& buf) {
+        const uint32_t total = static_cast<uint32_t>(buf.size() + sizeof(uint32_t));
+        std::memcpy(buf.data() + sizeof(uint32_t), &total, sizeof(total));
+        Append(buf, total);
+    }
+
+    // internet checksum (RFC 1071) of the data, continuing from the given partial sum
+    uint32_t Checksum_Add(uint32_t sum, const uint8_t* data, size_t len) {
+        for (size_t i = 0; i + 1 < len; i += 2) {
+            sum += (static_cast<uint32_t>(data[i]) << 8) | data[i + 1];
+        }
+        if (len & 1) {
+            sum += static_cast<uint32_t>(data[len - 1]) << 8;
+        }
+        return sum;
+    }
+
+    uint16_t Checksum_Finish(uint32_t sum) {
+        while (sum >> 16) {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        return static_cast<uint16_t>(~sum);
+    }
+
+    void Put16(uint8_t* at, uint16_t value) {
+        at[0] = static_cast<uint8_t>(value >> 8);
+        at[1] = static_cast<uint8_t>(value);
+    }
+
+    void Put32(uint8_t* at, uint32_t value) {
+        Put16(at, static_cast<uint16_t>(value >> 16));
+        Put16(at + 2, static_cast<uint16_t>(value));
+    }
+
+    // extracts IPv4 address and port (both in host byte order) from the socket address; returns false for other families
+    bool Ipv4_Of(const struct sockaddr_storage& addr, uint32_t& ip, uint16_t& port) {
+        if (addr.ss_family == AF_INET) {
+            const auto& in = reinterpret_cast<const struct sockaddr_in&>(addr);
+            ip = ntohl(in.sin_addr.s_addr);
+            port = ntohs(in.sin_port);
+            return true;
+        }
+        if (addr.ss_family == AF_INET6) {
+            const auto& in6 = reinterpret_cast<const struct sockaddr_in6&>(addr);
+            if (IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr)) {
+                uint32_t v4;
+                std::memcpy(&v4, in6.sin6_addr.s6_addr + 12, sizeof(v4));
+                ip = ntohl(v4);
+                port = ntohs(in6.sin6_port);
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+CCapture_Writer::CCapture_Writer() {
+    if (!gConfig->Is_Capture_Enabled()) {
+        return;
+    }
+
+    _file.open(gConfig->GetCapture_File(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!_file.is_open()) {
+        std::cerr << "[[InTCPtor: failed to create capture file " << gConfig->GetCapture_File() << "]]" << std::endl;
+        return;
+    }
+
+    // section header
+    Begin_Block(_packet, Block_Section_Header);
+    Append(_packet, Byte_Order_Magic);
+    Append(_packet, uint16_t(1));
+    Append(_packet, uint16_t(0));
+    Append(_packet, int64_t(-1));
+    const char application[] = "InTCPtor";
+    Append_Option(_packet, Option_Shb_User_Application, application, sizeof(application) - 1);
+    Append(_packet, Option_End);
+    Append(_packet, uint16_t(0));
+    End_Block(_packet);
+    _file.write(_packet.data(), static_cast<std::streamsize>(_packet.size()));
+
+    // the only interface; timestamps in nanoseconds
+    Begin_Block(_packet, Block_Interface_Description);
+    Append(_packet, Link_Type_Raw);
+    Append(_packet, uint16_t(0));
+    Append(_packet, uint32_t(0));
+    const uint8_t resolution = 9;
+    Append_Option(_packet, Option_If_Ts_Resolution, &resolution, sizeof(resolution));
+    Append(_packet, Option_End);
+    Append(_packet, uint16_t(0));
+    End_Block(_packet);
+    _file.write(_packet.data(), static_cast<std::streamsize>(_packet.size()));
+
+    if (gConfig->Is_Log_Enabled()) {
+        std::cout << "[[InTCPtor: capturing traffic to " << gConfig->GetCapture_File() << "]]" << std::endl;
+    }
+
+    _enabled = true;
+    _worker = std::thread(&CCapture_Writer::worker, this);
+}
+
+CCapture_Writer::~CCapture_Writer() {
+    if (!_enabled) {
+        return;
+    }
+
+    Stop();
+
+    // NOTE: the stages are intentionally leaked, as other threads may still hold (and release on exit) their stages
+    for (auto& stage : _stages) {
+        stage.release();
+    }
+}
+
+CCapture_Writer::TStage_Holder::~TStage_Holder() {
+    if (stage) {
+        stage->abandoned.store(true, std::memory_order_release);
+    }
+}
+
+CCapture_Writer::TStage* CCapture_Writer::Acquire_Stage() {
+    thread_local TStage_Holder holder;
+
+    if (holder.stage) {
+        return holder.stage;
+    }
+
+    std::unique_lock<std::mutex> lock(_stages_mutex);
+
+    if (!_free_stages.empty()) {
+        holder.stage = _free_stages.back();
+        _free_stages.pop_back();
+        holder.stage->abandoned.store(false, std::memory_order_relaxed);
+    }
+    else {
+        _stages.push_back(std::make_unique<TStage>());
+        holder.stage = _stages.back().get();
+    }
+
+    return holder.stage;
+}
+
+CCapture_Writer::TEndpoints CCapture_Writer::Resolve(int fd) {
+    uint32_t local_ip = Synthesized_Local_Addr;
+    uint32_t remote_ip = Synthesized_Remote_Addr;
+    // synthesized ports tell the sockets apart at least by the descriptor
+    uint16_t local_port = static_cast<uint16_t>(fd);
+    uint16_t remote_port = static_cast<uint16_t>(fd);
+
+    struct sockaddr_storage local, remote;
+    socklen_t local_len = sizeof(local), remote_len = sizeof(remote);
+    if (::getsockname(fd, reinterpret_cast<struct sockaddr*>(&local), &local_len) == 0
+        && ::getpeername(fd, reinterpret_cast<struct sockaddr*>(&remote), &remote_len) == 0) {
+
+        uint32_t lip, rip;
+        uint16_t lport, rport;
+        if (Ipv4_Of(local, lip, lport) && Ipv4_Of(remote, rip, rport)) {
+            local_ip = lip;
+            remote_ip = rip;
+            local_port = lport;
+            remote_port = rport;
+        }
+    }
+
+    return TEndpoints{ local_ip, remote_ip, local_port, remote_port };
+}
+
+namespace {
+
+    // reused descriptors are different connections
+    uint64_t Stream_Key(int fd) {
+        const intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+        return (static_cast<uint64_t>(state ? state->generation.load(std::memory_order_relaxed) : 0) << 32) | static_cast<uint32_t>(fd);
+    }
+}
+
+CCapture_Writer::TEndpoints CCapture_Writer::Endpoints_Of(int fd) {
+    intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+    if (!state) {
+        return Resolve(fd);
+    }
+
+    // the endpoints are kept with the socket, so every capturing thread uses the same ones, and they are looked up without
+    // any lock once per connection
+    const uint32_t generation = state->generation.load(std::memory_order_relaxed);
+    if (state->capture_generation.load(std::memory_order_acquire) == generation) {
+        const uint64_t addrs = state->capture_addrs.load(std::memory_order_relaxed);
+        const uint32_t ports = state->capture_ports.load(std::memory_order_relaxed);
+        return TEndpoints{ static_cast<uint32_t>(addrs >> 32), static_cast<uint32_t>(addrs), static_cast<uint16_t>(ports >> 16), static_cast<uint16_t>(ports) };
+    }
+
+    const TEndpoints endpoints = Resolve(fd);
+    state->capture_addrs.store((static_cast<uint64_t>(endpoints.local_addr) << 32) | endpoints.remote_addr, std::memory_order_relaxed);
+    state->capture_ports.store((static_cast<uint32_t>(endpoints.local_port) << 16) | endpoints.remote_port, std::memory_order_relaxed);
+    state->capture_generation.store(generation, std::memory_order_release);
+
+    return endpoints;
+}
+
+void CCapture_Writer::capture(int fd, NDirection direction, const struct iovec* iov, size_t iovcnt, size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    if (_pending_bytes.load(std::memory_order_relaxed) + sizeof(TEvent) + len > Pending_Limit) {
+        _dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+        return;
+    }
+
+    TEvent event;
+    std::memset(&event, 0, sizeof(event));
+    event.timestamp_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    event.stream_key = Stream_Key(fd);
+    event.len = static_cast<uint32_t>(len);
+    event.direction = direction;
+
+    event.endpoints = Endpoints_Of(fd);
+
+    Stage_Event(event, iov, iovcnt, len);
+}
+
+void CCapture_Writer::forget(int fd) {
+    if (!_enabled) {
+        return;
+    }
+
+    TEvent event;
+    std::memset(&event, 0, sizeof(event));
+    event.timestamp_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    event.stream_key = Stream_Key(fd);
+    event.closed = true;
+
+    Stage_Event(event, nullptr, 0, 0);
+}
+
+void CCapture_Writer::Stage_Event(const TEvent& event, const struct iovec* iov, size_t iovcnt, size_t len) {
+    TStage* stage = Acquire_Stage();
+
+    {
+        std::unique_lock<std::mutex> lock(stage->mutex);
+
+        Append(stage->pending, event);
+
+        size_t left = len;
+        for (size_t i = 0; i < iovcnt && left > 0; i++) {
+            const size_t part = std::min(left, iov[i].iov_len);
+            const char* base = static_cast<const char*>(iov[i].iov_base);
+            stage->pending.insert(stage->pending.end(), base, base + part);
+            left -= part;
+        }
+    }
+
+    const size_t before = _pending_bytes.fetch_add(sizeof(TEvent) + len, std::memory_order_relaxed);
+    if (before < Flush_Threshold && before + sizeof(TEvent) + len >= Flush_Threshold) {
+        _cond.notify_one();
+    }
+}
+
+void CCapture_Writer::Stop() {
+    if (!_enabled || !_worker.joinable()) {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _running = false;
+        _cond.notify_all();
+    }
+    _worker.join();
+
+    const uint64_t dropped = _dropped_bytes.load(std::memory_order_relaxed);
+    if (dropped > 0) {
+        std::cerr << "[[InTCPtor: capture writer could not keep up, " << dropped << " bytes were not captured]]" << std::endl;
+    }
+}
+
+void CCapture_Writer::worker() {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _cond.wait_for(lock, Flush_Interval, [this] { return !_running || _pending_bytes.load(std::memory_order_relaxed) >= Flush_Threshold; });
+
+        const bool running = _running;
+
+        lock.unlock();
+
+        Drain();
+        _file.flush();
+
+        lock.lock();
+
+        if (!running) {
+            break;
+        }
+    }
+}
+
+void CCapture_Writer::Drain() {
+    {
+        std::unique_lock<std::mutex> lock(_stages_mutex);
+
+        for (const auto& stage : _stages) {
+            const bool abandoned = stage->abandoned.load(std::memory_order_acquire);
+
+            // the stage gets an empty buffer of the last drain, so neither side allocates in the steady state
+            std::vector<char> taken;
+            if (!_spare.empty()) {
+                taken = std::move(_spare.back());
+                _spare.pop_back();
+            }
+            {
+                std::unique_lock<std::mutex> stage_lock(stage->mutex);
+                taken.swap(stage->pending);
+            }
+
+            if (!taken.empty()) {
+                _taken.push_back(std::move(taken));
+            }
+            else {
+                _spare.push_back(std::move(taken));
+            }
+
+            // the owning thread exited and everything was taken; the stage may be reused by another thread
+            if (abandoned && std::find(_free_stages.begin(), _free_stages.end(), stage.get()) == _free_stages.end()) {
+                _free_stages.push_back(stage.get());
+            }
+        }
+    }
+
+    size_t bytes = 0;
+    _order.clear();
+    for (const auto& buf : _taken) {
+        size_t pos = 0;
+        while (pos + sizeof(TEvent) <= buf.size()) {
+            TEvent event;
+            std::memcpy(&event, buf.data() + pos, sizeof(event));
+            _order.emplace_back(event.timestamp_ns, buf.data() + pos);
+            pos += sizeof(event) + event.len;
+        }
+        bytes += buf.size();
+    }
+
+    // events of different threads are interleaved in order of their capture
+    std::stable_sort(_order.begin(), _order.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
+    for (const auto& [timestamp_ns, at] : _order) {
+        TEvent event;
+        std::memcpy(&event, at, sizeof(event));
+        Write_Event(event, at + sizeof(event));
+    }
+
+    _pending_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+
+    for (auto& buf : _taken) {
+        buf.clear();
+        _spare.push_back(std::move(buf));
+    }
+    _taken.clear();
+}
+
+void CCapture_Writer::Write_Event(const TEvent& event, const char* payload) {
+    // the connection is over; a reused descriptor starts a new stream
+    if (event.closed) {
+        _sequences.erase(event.stream_key);
+        return;
+    }
+
+    // sequence numbers of both directions continue across the buffers, so the capture tool reassembles the stream
+    auto& sequences = _sequences.try_emplace(event.stream_key, std::array<uint32_t, 2>{ 1, 1 }).first->second;
+
+    const int dir = static_cast<int>(event.direction);
+    for (size_t offset = 0; offset < event.len; offset += Max_Segment) {
+        const size_t seg_len = std::min(Max_Segment, static_cast<size_t>(event.len) - offset);
+        Write_Packet(event, sequences[dir], sequences[1 - dir], payload + offset, seg_len);
+        sequences[dir] += static_cast<uint32_t>(seg_len);
+    }
+}
+
+void CCapture_Writer::Write_Packet(const TEvent& event, uint32_t seq, uint32_t ack, const char* payload, size_t len) {
+    const bool out = (event.direction == NDirection::Out);
+    const uint32_t src_ip = out ? event.endpoints.local_addr : event.endpoints.remote_addr;
+    const uint32_t dst_ip = out ? event.endpoints.remote_addr : event.endpoints.local_addr;
+    const uint16_t src_port = out ? event.endpoints.local_port : event.endpoints.remote_port;
+    const uint16_t dst_port = out ? event.endpoints.remote_port : event.endpoints.local_port;
+
+    const size_t packet_len = Ip_Header_Size + Tcp_Header_Size + len;
+
+    uint8_t headers[Ip_Header_Size + Tcp_Header_Size] = {};
+    uint8_t* ip = headers;
+    uint8_t* tcp = headers + Ip_Header_Size;
+
+    ip[0] = 0x45;   // version 4, header of 5 words
+    Put16(ip + 2, static_cast<uint16_t>(packet_len));
+    Put16(ip + 4, _ip_id++);
+    Put16(ip + 6, 0x4000);  // don't fragment
+    ip[8] = 64;     // TTL
+    ip[9] = IPPROTO_TCP;
+    Put32(ip + 12, src_ip);
+    Put32(ip + 16, dst_ip);
+    Put16(ip + 10, Checksum_Finish(Checksum_Add(0, ip, Ip_Header_Size)));
+
+    Put16(tcp + 0, src_port);
+    Put16(tcp + 2, dst_port);
+    Put32(tcp + 4, seq);
+    Put32(tcp + 8, ack);
+    tcp[12] = 5 << 4;   // header of 5 words
+    tcp[13] = Tcp_Flags_Psh_Ack;
+    Put16(tcp + 14, 65535);
+
+    // the checksum covers the pseudo header, TCP header and the payload
+    uint8_t pseudo[12] = {};
+    Put32(pseudo + 0, src_ip);
+    Put32(pseudo + 4, dst_ip);
+    pseudo[9] = IPPROTO_TCP;
+    Put16(pseudo + 10, static_cast<uint16_t>(Tcp_Header_Size + len));
+    uint32_t sum = Checksum_Add(0, pseudo, sizeof(pseudo));
+    sum = Checksum_Add(sum, tcp, Tcp_Header_Size);
+    sum = Checksum_Add(sum, reinterpret_cast<const uint8_t*>(payload), len);
+    Put16(tcp + 16, Checksum_Finish(sum));
+
+    Begin_Block(_packet, Block_Enhanced_Packet);
+    Append(_packet, uint32_t(0));
+    Append(_packet, static_cast<uint32_t>(event.timestamp_ns >> 32));
+    Append(_packet, static_cast<uint32_t>(event.timestamp_ns));
+    Append(_packet, static_cast<uint32_t>(packet_len));
+    Append(_packet, static_cast<uint32_t>(packet_len));
+    _packet.insert(_packet.end(), reinterpret_cast<const char*>(headers), reinterpret_cast<const char*>(headers) + sizeof(headers));
+    _packet.insert(_packet.end(), payload, payload + len);
+    Append_Padding(_packet);
+    End_Block(_packet);
+
+    _file.write(_packet.data(), static_cast<std::streamsize>(_packet.size()));
+}
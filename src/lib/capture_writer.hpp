@@ -0,0 +1,144 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the capture writer, that stores the intercepted traffic to a pcapng file.
+ */
+
+#pragma once
+
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <unordered_map>
+#include <array>
+#include <fstream>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include <sys/uio.h>
+
+// writes the data, that were actually sent to and received from the sockets, as TCP segments of synthesized IPv4 packets;
+// the callers only copy the data to a pending buffer of their own thread, the packets are built and written by a background
+// thread, so the capture does not change the timing of the application
+class CCapture_Writer {
+    public:
+        enum class NDirection : uint8_t {
+            Out = 0,    // sent by the application (i.e., passed to the original send())
+            In = 1,     // received by the application
+        };
+
+        // the pending data are written at least this often
+        static constexpr auto Flush_Interval = std::chrono::milliseconds(100);
+        // the writer is woken up before the interval, if this many bytes are pending
+        static constexpr size_t Flush_Threshold = 1 << 20;
+        // if the writer can't keep up and this many bytes are pending, new data are dropped rather than slowing the
+        // application down
+        static constexpr size_t Pending_Limit = 64 << 20;
+
+        CCapture_Writer();
+
+        virtual ~CCapture_Writer();
+
+        // writes out the staged data and stops the writer thread; the data captured later are not written
+        void Stop();
+
+        bool Is_Enabled() const { return _enabled; }
+
+        // captures first len bytes of the scatter-gather buffer
+        void capture(int fd, NDirection direction, const struct iovec* iov, size_t iovcnt, size_t len);
+
+        void capture(int fd, NDirection direction, const char* data, size_t len) {
+            const struct iovec iov = { const_cast<char*>(data), len };
+            capture(fd, direction, &iov, 1, len);
+        }
+
+        // called before the socket is closed; the writer forgets the connection once its data are written
+        void forget(int fd);
+
+    private:
+        // IPv4 endpoints of a connection, in network byte order
+        struct TEndpoints {
+            uint32_t local_addr;
+            uint32_t remote_addr;
+            uint16_t local_port;
+            uint16_t remote_port;
+        };
+
+        // header of a single captured buffer in the pending data; the payload follows right after it
+        struct TEvent {
+            uint64_t timestamp_ns;
+            uint64_t stream_key;
+            TEndpoints endpoints;
+            uint32_t len;
+            NDirection direction;
+            // the socket was closed; the event has no payload
+            bool closed;
+        };
+
+        // events with their payload captured by a single thread; the thread appends to it, the worker takes the events
+        // over, so the lock is contended only by the worker
+        struct TStage {
+            std::mutex mutex;
+            std::vector<char> pending;
+            // set when the owning thread exits; the stage is reused after it is drained
+            std::atomic<bool> abandoned{ false };
+        };
+
+        // releases the stage of a thread when the thread exits
+        struct TStage_Holder {
+            TStage* stage = nullptr;
+            ~TStage_Holder();
+        };
+
+        TStage* Acquire_Stage();
+
+        // appends the event and len bytes of the segments to the stage of the calling thread
+        void Stage_Event(const TEvent& event, const struct iovec* iov, size_t iovcnt, size_t len);
+
+        void worker();
+
+        // takes over the events of all stages and writes them in order of their timestamps; called from the worker only
+        void Drain();
+
+        // finds out the endpoints of the socket, so the packets can be told apart by connection in the capture; sockets,
+        // that are not IPv4, get a synthesized address
+        static TEndpoints Resolve(int fd);
+        // the same, cached in the socket record for the current generation of the socket
+        static TEndpoints Endpoints_Of(int fd);
+
+        // builds packets from the pending events and writes them to the file; called from the worker only
+        void Write_Event(const TEvent& event, const char* payload);
+        void Write_Packet(const TEvent& event, uint32_t seq, uint32_t ack, const char* payload, size_t len);
+
+        bool _enabled = false;
+
+        std::thread _worker;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        bool _running = true;
+
+        // all stages ever allocated; stages are never freed while the writer runs, only reused
+        std::mutex _stages_mutex;
+        std::vector<std::unique_ptr<TStage>> _stages;
+        std::vector<TStage*> _free_stages;
+        // bytes of all stages, that were not written yet
+        std::atomic<size_t> _pending_bytes{ 0 };
+        std::atomic<uint64_t> _dropped_bytes{ 0 };
+
+        // the rest is used by the worker only
+        std::ofstream _file;
+        // events taken over from the stages, and their order
+        std::vector<std::vector<char>> _taken;
+        std::vector<std::vector<char>> _spare;
+        std::vector<std::pair<uint64_t, const char*>> _order;
+        // next sequence number of both directions of every connection
+        std::unordered_map<uint64_t, std::array<uint32_t, 2>> _sequences;
+        uint16_t _ip_id = 0;
+        std::vector<char> _packet;
+};
+
+extern CCapture_Writer* gCapture_Writer;
@@ -9,11 +9,142 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <random>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "logger.hpp"
 
 constexpr bool Debug_Config_Outputs = false;
 
-const std::string Config_Filename = "intcptor_config.cfg";
-CConfig::TPtr gConfig;
+constexpr const char* Config_Filename = "intcptor_config.cfg";
+CConfig_Holder gConfig;
+
+namespace {
+    // settings, that can be overridden by a fault profile; the keys are the same as of the global settings
+    struct TProfile_Key {
+        const char* key;
+        double CConfig::TFault_Profile::* field;
+    };
+
+    constexpr TProfile_Key Profile_Keys[] = {
+        { "Send__1B_Sends", &CConfig::TFault_Profile::prob_send_1b_sends },
+        { "Send__2B_Sends", &CConfig::TFault_Profile::prob_send_2b_sends },
+        { "Send__2_Separate_Sends", &CConfig::TFault_Profile::prob_send_2_separate_sends },
+        { "Send__2B_Sends_And_Second_Send", &CConfig::TFault_Profile::prob_send_2b_sends_and_second_send },
+        { "Recv__1B_Less", &CConfig::TFault_Profile::prob_recv_1b_less },
+        { "Recv__2B_Less", &CConfig::TFault_Profile::prob_recv_2b_less },
+        { "Recv__Half", &CConfig::TFault_Profile::prob_recv_half },
+        { "Recv__2B", &CConfig::TFault_Profile::prob_recv_2b },
+        { "Send_Delay_Ms_Mean", &CConfig::TFault_Profile::send_delay_ms_mean },
+        { "Send_Delay_Ms_Sigma", &CConfig::TFault_Profile::send_delay_ms_sigma },
+        { "Recv_Delay_Ms_Mean", &CConfig::TFault_Profile::recv_delay_ms_mean },
+        { "Recv_Delay_Ms_Sigma", &CConfig::TFault_Profile::recv_delay_ms_sigma },
+        { "Connect_Delay_Ms_Mean", &CConfig::TFault_Profile::connect_delay_ms_mean },
+        { "Connect_Delay_Ms_Sigma", &CConfig::TFault_Profile::connect_delay_ms_sigma },
+    };
+
+    constexpr const char* Default_Profile_Name = "default";
+
+    // parses an IPv4 prefix "a.b.c.d[/bits]" or an IPv6 one "x:x::x[/bits]"; IPv4 prefixes are mapped to IPv6
+    bool Parse_Prefix(const std::string& text, CConfig::TAddress_Prefix& prefix) {
+        const size_t slash = text.find('/');
+        const std::string address = text.substr(0, slash);
+
+        struct in_addr in{};
+        struct in6_addr in6{};
+        int max_bits;
+        if (::inet_pton(AF_INET, address.c_str(), &in) == 1) {
+            max_bits = 32;
+            prefix.addr = {};
+            prefix.addr[10] = prefix.addr[11] = 0xFF;
+            std::memcpy(&prefix.addr[12], &in, 4);
+        } else if (::inet_pton(AF_INET6, address.c_str(), &in6) == 1) {
+            max_bits = 128;
+            std::memcpy(prefix.addr.data(), &in6, 16);
+        } else {
+            return false;
+        }
+
+        int bits = max_bits;
+        if (slash != std::string::npos) {
+            try {
+                size_t used = 0;
+                bits = std::stoi(text.substr(slash + 1), &used);
+                if (used != text.size() - slash - 1) {
+                    return false;
+                }
+            }
+            catch (...) {
+                return false;
+            }
+        }
+        if (bits < 0 || bits > max_bits) {
+            return false;
+        }
+
+        // "any IPv4 address" is still limited to IPv4 peers; a zero-length IPv6 prefix matches anything
+        prefix.bits = max_bits == 32 ? bits + 96 : bits;
+
+        // the bits past the prefix are cleared, so the matching compares whole bytes
+        for (int i = 0; i < 16; i++) {
+            const int keep = std::clamp(prefix.bits - i * 8, 0, 8);
+            prefix.addr[i] &= static_cast<uint8_t>(0xFF00 >> keep);
+        }
+        return true;
+    }
+
+    // endpoint of a socket as seen by the rules
+    struct TEndpoint {
+        bool valid = false;
+        // the address in the IPv6 form (IPv4 ones are mapped)
+        std::array<uint8_t, 16> addr{};
+        int port = -1;
+    };
+
+    TEndpoint To_Endpoint(const struct sockaddr_storage& ss) {
+        TEndpoint ep;
+        if (ss.ss_family == AF_INET) {
+            const auto* sin = reinterpret_cast<const struct sockaddr_in*>(&ss);
+            ep.valid = true;
+            ep.addr[10] = ep.addr[11] = 0xFF;
+            std::memcpy(&ep.addr[12], &sin->sin_addr, 4);
+            ep.port = ntohs(sin->sin_port);
+        } else if (ss.ss_family == AF_INET6) {
+            // IPv4 clients of a dual-stack socket come with the mapped address, so they are matched by IPv4 prefixes
+            const auto* sin6 = reinterpret_cast<const struct sockaddr_in6*>(&ss);
+            ep.valid = true;
+            std::memcpy(ep.addr.data(), &sin6->sin6_addr, 16);
+            ep.port = ntohs(sin6->sin6_port);
+        }
+        return ep;
+    }
+
+    bool Matches(const TEndpoint& ep, int port, const CConfig::TAddress_Prefix& prefix) {
+        if (port >= 0 && ep.port != port) {
+            return false;
+        }
+        if (prefix.bits == 0) {
+            return true;
+        }
+        if (!ep.valid) {
+            return false;
+        }
+        for (int i = 0; i < 16 && i * 8 < prefix.bits; i++) {
+            const int keep = std::min(prefix.bits - i * 8, 8);
+            if ((ep.addr[i] & static_cast<uint8_t>(0xFF00 >> keep)) != prefix.addr[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
 
 CConfig::CConfig() {
     Load_Default_Path();
@@ -23,14 +154,98 @@ CConfig::~CConfig() {
 }
 
 void CConfig::Load_Default_Path() {
-    std::ifstream file(Config_Filename);
-    if (!file.is_open()) {
+    if (!Load(Config_Filename)) {
         std::cerr << "[[InTCPtor: could not open config file, using defaults]]" << std::endl;
         Save_Default();
-        Initialize_Runtime();
-        return;
+        Build_Profiles({}, {});
     }
 
+    mStarted_Recv_Delay = Is_Recv_Delay_Enabled();
+    mStarted_Drop_Connections = mDrop_Connections;
+
+    Initialize_Runtime();
+}
+
+std::string CConfig::Default_Path() {
+    std::error_code ec;
+    const auto path = std::filesystem::absolute(Config_Filename, ec);
+    return ec ? Config_Filename : path.string();
+}
+
+CConfig::TPtr CConfig::Reload(const std::string& path, const CConfig& current, std::vector<std::string>& ignored) {
+    TPtr config(new CConfig(TDefaults_Only{}));
+    if (!config->Load(path)) {
+        return nullptr;
+    }
+
+    ignored = config->Keep_Startup_Settings(current);
+    return config;
+}
+
+std::vector<std::string> CConfig::Keep_Startup_Settings(const CConfig& current) {
+    std::vector<std::string> ignored;
+
+    auto keep = [&ignored](auto& value, const auto& current_value, const char* name) {
+        if (value != current_value) {
+            ignored.push_back(name);
+            value = current_value;
+        }
+    };
+
+    // the queue limits decide, whether the writability of sockets is virtualized, so they can't change under the epoll sets
+    keep(mSend_Queue_Socket_Limit, current.mSend_Queue_Socket_Limit, "Send_Queue_Socket_Limit");
+    keep(mSend_Queue_Total_Limit, current.mSend_Queue_Total_Limit, "Send_Queue_Total_Limit");
+    keep(mSend_Queue_Low_Watermark, current.mSend_Queue_Low_Watermark, "Send_Queue_Low_Watermark");
+    keep(mOutput_Backend, current.mOutput_Backend, "Output_Backend");
+    keep(mSend_Zerocopy_Threshold, current.mSend_Zerocopy_Threshold, "Send_Zerocopy_Threshold");
+    keep(mOutput_Queue_Shards, current.mOutput_Queue_Shards, "Output_Queue_Shards");
+    keep(mSend_Bandwidth_Socket_Kbit, current.mSend_Bandwidth_Socket_Kbit, "Send_Bandwidth_Socket_Kbit");
+    keep(mSend_Bandwidth_Total_Kbit, current.mSend_Bandwidth_Total_Kbit, "Send_Bandwidth_Total_Kbit");
+    keep(mSend_Bandwidth_Burst, current.mSend_Bandwidth_Burst, "Send_Bandwidth_Burst");
+    keep(mTrace_Mode, current.mTrace_Mode, "Trace_Mode");
+    keep(mTrace_File, current.mTrace_File, "Trace_File");
+    keep(mCapture_Enabled, current.mCapture_Enabled, "Capture_Enabled");
+    keep(mCapture_File, current.mCapture_File, "Capture_File");
+    keep(mStats_Enabled, current.mStats_Enabled, "Stats_Enabled");
+    keep(mConfig_Reload_Enabled, current.mConfig_Reload_Enabled, "Config_Reload_Enabled");
+    keep(mRandom_Seed, current.mRandom_Seed, "Random_Seed");
+
+    // the sockets bound to a profile of the current config resolve their profile again
+    mGeneration = current.mGeneration + 1;
+
+    // the input delay stage and the random socket closer can be retuned (or paused), but only if they were started
+    mStarted_Recv_Delay = current.mStarted_Recv_Delay;
+    mStarted_Drop_Connections = current.mStarted_Drop_Connections;
+
+    if (!mStarted_Recv_Delay && Is_Recv_Delay_Enabled()) {
+        ignored.push_back("Recv_Delay_Ms_Mean");
+        ignored.push_back("Recv_Delay_Ms_Sigma");
+        mRecv_Delay_Ms_Mean = current.mRecv_Delay_Ms_Mean;
+        mRecv_Delay_Ms_Sigma = current.mRecv_Delay_Ms_Sigma;
+        // the current config does not delay received data at all (otherwise the stage would have been started)
+        for (auto& profile : mProfiles) {
+            profile.recv_delay_ms_mean = 0;
+            profile.recv_delay_ms_sigma = 0;
+        }
+    }
+
+    if (!mStarted_Drop_Connections && mDrop_Connections) {
+        ignored.push_back("Drop_Connections");
+        mDrop_Connections = false;
+    }
+
+    return ignored;
+}
+
+bool CConfig::Load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    TProfile_Overrides profile_overrides;
+    TPending_Rules profile_rules;
+
     std::string line;
     while (std::getline(file, line)) {
         std::istringstream iss(line);
@@ -109,10 +324,380 @@ void CConfig::Load_Default_Path() {
             if constexpr (Debug_Config_Outputs) {
                 std::cout << "[[InTCPtor: config Log_Enabled = " << mLog_Enabled << " ]]" << std::endl;
             }
+        } else if (key == "Send_Queue_Socket_Limit") {
+            iss >> mSend_Queue_Socket_Limit;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Queue_Socket_Limit = " << mSend_Queue_Socket_Limit << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Queue_Total_Limit") {
+            iss >> mSend_Queue_Total_Limit;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Queue_Total_Limit = " << mSend_Queue_Total_Limit << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Queue_Low_Watermark") {
+            iss >> mSend_Queue_Low_Watermark;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Queue_Low_Watermark = " << mSend_Queue_Low_Watermark << " ]]" << std::endl;
+            }
+        } else if (key == "Recv_Delay_Ms_Mean") {
+            iss >> mRecv_Delay_Ms_Mean;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Recv_Delay_Ms_Mean = " << mRecv_Delay_Ms_Mean << " ]]" << std::endl;
+            }
+        } else if (key == "Recv_Delay_Ms_Sigma") {
+            iss >> mRecv_Delay_Ms_Sigma;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Recv_Delay_Ms_Sigma = " << mRecv_Delay_Ms_Sigma << " ]]" << std::endl;
+            }
+        } else if (key == "Output_Backend") {
+            iss >> mOutput_Backend;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Output_Backend = " << mOutput_Backend << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Zerocopy_Threshold") {
+            iss >> mSend_Zerocopy_Threshold;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Zerocopy_Threshold = " << mSend_Zerocopy_Threshold << " ]]" << std::endl;
+            }
+        } else if (key == "Output_Queue_Shards") {
+            iss >> mOutput_Queue_Shards;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Output_Queue_Shards = " << mOutput_Queue_Shards << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Bandwidth_Socket_Kbit") {
+            iss >> mSend_Bandwidth_Socket_Kbit;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Bandwidth_Socket_Kbit = " << mSend_Bandwidth_Socket_Kbit << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Bandwidth_Total_Kbit") {
+            iss >> mSend_Bandwidth_Total_Kbit;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Bandwidth_Total_Kbit = " << mSend_Bandwidth_Total_Kbit << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Bandwidth_Burst") {
+            iss >> mSend_Bandwidth_Burst;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Bandwidth_Burst = " << mSend_Bandwidth_Burst << " ]]" << std::endl;
+            }
+        } else if (key == "Trace_Mode") {
+            iss >> mTrace_Mode;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Trace_Mode = " << mTrace_Mode << " ]]" << std::endl;
+            }
+        } else if (key == "Trace_File") {
+            iss >> mTrace_File;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Trace_File = " << mTrace_File << " ]]" << std::endl;
+            }
+        } else if (key == "Capture_Enabled") {
+            iss >> mCapture_Enabled;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Capture_Enabled = " << mCapture_Enabled << " ]]" << std::endl;
+            }
+        } else if (key == "Capture_File") {
+            iss >> mCapture_File;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Capture_File = " << mCapture_File << " ]]" << std::endl;
+            }
+        } else if (key == "Stats_Enabled") {
+            iss >> mStats_Enabled;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Stats_Enabled = " << mStats_Enabled << " ]]" << std::endl;
+            }
+        } else if (key == "Config_Reload_Enabled") {
+            iss >> mConfig_Reload_Enabled;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Config_Reload_Enabled = " << mConfig_Reload_Enabled << " ]]" << std::endl;
+            }
+        } else if (key == "Connect_Delay_Ms_Mean") {
+            iss >> mConnect_Delay_Ms_Mean;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Connect_Delay_Ms_Mean = " << mConnect_Delay_Ms_Mean << " ]]" << std::endl;
+            }
+        } else if (key == "Connect_Delay_Ms_Sigma") {
+            iss >> mConnect_Delay_Ms_Sigma;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Connect_Delay_Ms_Sigma = " << mConnect_Delay_Ms_Sigma << " ]]" << std::endl;
+            }
+        } else if (key == "Close_Linger_Ms") {
+            iss >> mClose_Linger_Ms;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Close_Linger_Ms = " << mClose_Linger_Ms << " ]]" << std::endl;
+            }
+        } else if (key == "Drop_Connection_Lifetime") {
+            iss >> mDrop_Connection_Lifetime;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Drop_Connection_Lifetime = " << mDrop_Connection_Lifetime << " ]]" << std::endl;
+            }
+        } else if (key == "Drop_Connection_Lifetime_Ms_Mean") {
+            iss >> mDrop_Connection_Lifetime_Ms_Mean;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Drop_Connection_Lifetime_Ms_Mean = " << mDrop_Connection_Lifetime_Ms_Mean << " ]]" << std::endl;
+            }
+        } else if (key == "Drop_Connection_Lifetime_Shape") {
+            iss >> mDrop_Connection_Lifetime_Shape;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Drop_Connection_Lifetime_Shape = " << mDrop_Connection_Lifetime_Shape << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Delay_Distribution") {
+            iss >> mSend_Delay_Distribution;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Delay_Distribution = " << mSend_Delay_Distribution << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Delay_Distribution_File") {
+            iss >> mSend_Delay_Distribution_File;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Delay_Distribution_File = " << mSend_Delay_Distribution_File << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Delay_Slow_Ms_Mean") {
+            iss >> mSend_Delay_Slow_Ms_Mean;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Delay_Slow_Ms_Mean = " << mSend_Delay_Slow_Ms_Mean << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Delay_Slow_Fraction") {
+            iss >> mSend_Delay_Slow_Fraction;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Delay_Slow_Fraction = " << mSend_Delay_Slow_Fraction << " ]]" << std::endl;
+            }
+        } else if (key == "Send_Delay_Pareto_Shape") {
+            iss >> mSend_Delay_Pareto_Shape;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Send_Delay_Pareto_Shape = " << mSend_Delay_Pareto_Shape << " ]]" << std::endl;
+            }
+        } else if (key == "Random_Seed") {
+            iss >> mRandom_Seed;
+            if constexpr (Debug_Config_Outputs) {
+                std::cout << "[[InTCPtor: config Random_Seed = " << mRandom_Seed << " ]]" << std::endl;
+            }
+        } else if (key == "Profile") {
+            Parse_Profile_Line(iss, profile_overrides);
+        } else if (key == "Profile_Rule") {
+            Parse_Rule_Line(iss, profile_rules);
         }
     }
 
-    Initialize_Runtime();
+    Build_Profiles(profile_overrides, profile_rules);
+
+    return true;
+}
+
+void CConfig::Parse_Profile_Line(std::istringstream& iss, TProfile_Overrides& overrides) {
+    std::string name, setting;
+    double value = 0;
+    if (!(iss >> name >> setting >> value)) {
+        std::cerr << "[[InTCPtor: invalid profile line, expected \"Profile <name> <setting> <value>\"]]" << std::endl;
+        return;
+    }
+
+    if (name == Default_Profile_Name) {
+        std::cerr << "[[InTCPtor: the default profile is set by the global settings, ignoring Profile " << name << " " << setting << "]]" << std::endl;
+        return;
+    }
+
+    bool known = false;
+    for (const auto& pk : Profile_Keys) {
+        known = known || setting == pk.key;
+    }
+    if (!known) {
+        std::cerr << "[[InTCPtor: setting " << setting << " can not be set per profile, ignoring it]]" << std::endl;
+        return;
+    }
+
+    auto itr = std::find_if(overrides.begin(), overrides.end(), [&name](const auto& entry) { return entry.first == name; });
+    if (itr == overrides.end()) {
+        overrides.push_back({ name, {} });
+        itr = std::prev(overrides.end());
+    }
+    itr->second.push_back({ setting, value });
+
+    if constexpr (Debug_Config_Outputs) {
+        std::cout << "[[InTCPtor: config profile " << name << " " << setting << " = " << value << " ]]" << std::endl;
+    }
+}
+
+void CConfig::Parse_Rule_Line(std::istringstream& iss, TPending_Rules& rules) {
+    std::string name;
+    if (!(iss >> name)) {
+        std::cerr << "[[InTCPtor: invalid profile rule, expected \"Profile_Rule <profile> <condition>...\"]]" << std::endl;
+        return;
+    }
+
+    TProfile_Rule rule;
+    std::string condition;
+    while (iss >> condition) {
+        const size_t eq = condition.find('=');
+        const std::string what = condition.substr(0, eq);
+        const std::string value = eq == std::string::npos ? std::string{} : condition.substr(eq + 1);
+
+        bool valid = eq != std::string::npos;
+        if (!valid) {
+            // fall through to the error below
+        } else if (what == "role") {
+            if (value == "accepted") {
+                rule.role = NSocket_Role::Accepted;
+            } else if (value == "connected") {
+                rule.role = NSocket_Role::Connected;
+            } else if (value == "any") {
+                rule.role = NSocket_Role::Any;
+            } else {
+                valid = false;
+            }
+        } else if (what == "local_port" || what == "remote_port") {
+            int port = -1;
+            try {
+                port = std::stoi(value);
+            }
+            catch (...) {
+                port = -1;
+            }
+            valid = port >= 0 && port <= 65535;
+            (what == "local_port" ? rule.local_port : rule.remote_port) = port;
+        } else if (what == "local") {
+            valid = Parse_Prefix(value, rule.local);
+        } else if (what == "remote") {
+            valid = Parse_Prefix(value, rule.remote);
+        } else {
+            valid = false;
+        }
+
+        if (!valid) {
+            std::cerr << "[[InTCPtor: invalid condition " << condition << " in rule of profile " << name << ", ignoring the rule]]" << std::endl;
+            return;
+        }
+    }
+
+    rules.push_back({ name, rule });
+}
+
+void CConfig::Build_Profiles(const TProfile_Overrides& overrides, const TPending_Rules& rules) {
+    TFault_Profile base;
+    base.name = Default_Profile_Name;
+    base.prob_send_1b_sends = mProb_Send__1B_Sends;
+    base.prob_send_2b_sends = mProb_Send__2B_Sends;
+    base.prob_send_2_separate_sends = mProb_Send__2_Separate_Sends;
+    base.prob_send_2b_sends_and_second_send = mProb_Send__2B_Sends_And_Second_Send;
+    base.prob_recv_1b_less = mProb_Recv__1B_Less;
+    base.prob_recv_2b_less = mProb_Recv__2B_Less;
+    base.prob_recv_half = mProb_Recv__Half;
+    base.prob_recv_2b = mProb_Recv__2B;
+    base.send_delay_ms_mean = mSend_Delay_Ms_Mean;
+    base.send_delay_ms_sigma = mSend_Delay_Ms_Sigma;
+    base.recv_delay_ms_mean = mRecv_Delay_Ms_Mean;
+    base.recv_delay_ms_sigma = mRecv_Delay_Ms_Sigma;
+    base.connect_delay_ms_mean = mConnect_Delay_Ms_Mean;
+    base.connect_delay_ms_sigma = mConnect_Delay_Ms_Sigma;
+
+    mProfiles.assign(1, base);
+    mRules.clear();
+
+    // the profiles inherit the global settings and override some of them
+    for (const auto& [name, settings] : overrides) {
+        if (mProfiles.size() >= Max_Profiles) {
+            std::cerr << "[[InTCPtor: too many fault profiles, ignoring profile " << name << "]]" << std::endl;
+            continue;
+        }
+
+        TFault_Profile profile = base;
+        profile.name = name;
+        for (const auto& [setting, value] : settings) {
+            for (const auto& pk : Profile_Keys) {
+                if (setting == pk.key) {
+                    profile.*pk.field = value;
+                }
+            }
+        }
+        mProfiles.push_back(std::move(profile));
+    }
+
+    // the send delay distributions are built last, as the profiles may override their mean and sigma
+    intcptor::NDelay_Family family = intcptor::NDelay_Family::Normal;
+    bool cdf = false;
+    if (!intcptor::CDelay_Distribution::Parse_Family(mSend_Delay_Distribution, family, cdf)) {
+        std::cerr << "[[InTCPtor: unknown send delay distribution " << mSend_Delay_Distribution << ", using normal]]" << std::endl;
+    }
+
+    // the mean of a Pareto distribution exists only for the shape above 1
+    if (family == intcptor::NDelay_Family::Pareto && mSend_Delay_Pareto_Shape != 0 && mSend_Delay_Pareto_Shape <= 1.0) {
+        std::cerr << "[[InTCPtor: Send_Delay_Pareto_Shape must be above 1, deriving the shape from the sigma]]" << std::endl;
+        mSend_Delay_Pareto_Shape = 0;
+    }
+
+    std::shared_ptr<const intcptor::CAlias_Table> table;
+    if (family == intcptor::NDelay_Family::Empirical) {
+        std::string error;
+        table = intcptor::CAlias_Table::Load(mSend_Delay_Distribution_File, cdf, error);
+        if (!table) {
+            std::cerr << "[[InTCPtor: " << error << ", using normal send delays]]" << std::endl;
+            family = intcptor::NDelay_Family::Normal;
+        }
+    }
+
+    for (auto& profile : mProfiles) {
+        profile.send_delay = intcptor::CDelay_Distribution(family, profile.send_delay_ms_mean, profile.send_delay_ms_sigma, mSend_Delay_Slow_Ms_Mean, mSend_Delay_Slow_Fraction, mSend_Delay_Pareto_Shape, table);
+    }
+
+    for (const auto& [name, rule] : rules) {
+        auto itr = std::find_if(mProfiles.begin(), mProfiles.end(), [&name = name](const TFault_Profile& profile) { return profile.name == name; });
+        if (itr == mProfiles.end()) {
+            std::cerr << "[[InTCPtor: rule refers to unknown fault profile " << name << ", ignoring it]]" << std::endl;
+            continue;
+        }
+
+        mRules.push_back(rule);
+        mRules.back().profile = static_cast<size_t>(itr - mProfiles.begin());
+    }
+}
+
+size_t CConfig::Resolve_Profile(int fd, intcptor::TSocket_State& state, const struct sockaddr* peer, socklen_t peer_len) const {
+    const NSocket_Role role = state.kind.load(std::memory_order_relaxed) == intcptor::NSocket_Kind::Managed ? NSocket_Role::Accepted : NSocket_Role::Connected;
+
+    struct sockaddr_storage ss{};
+    socklen_t len = sizeof(ss);
+    const TEndpoint local = ::getsockname(fd, reinterpret_cast<struct sockaddr*>(&ss), &len) == 0 ? To_Endpoint(ss) : TEndpoint{};
+
+    ss = {};
+    len = sizeof(ss);
+    if (peer) {
+        std::memcpy(&ss, peer, std::min<size_t>(peer_len, sizeof(ss)));
+    }
+    const TEndpoint remote = peer || ::getpeername(fd, reinterpret_cast<struct sockaddr*>(&ss), &len) == 0 ? To_Endpoint(ss) : TEndpoint{};
+
+    size_t index = 0;
+    for (const auto& rule : mRules) {
+        if (rule.role != NSocket_Role::Any && rule.role != role) {
+            continue;
+        }
+        if (Matches(local, rule.local_port, rule.local) && Matches(remote, rule.remote_port, rule.remote)) {
+            index = rule.profile;
+            break;
+        }
+    }
+
+    // the result is cached even for a socket, that is not connected (yet), so it does not look up its addresses on every
+    // call; connect() binds the socket again by the peer address
+    state.profile.store((Binding_Generation() << Profile_Bits) | static_cast<uint32_t>(index), std::memory_order_relaxed);
+    if (index != 0 && mLog_Enabled) {
+        intcptor::Log(intcptor::NLog_Event::Profile_Bound, fd, static_cast<int64_t>(index));
+    }
+
+    return index;
+}
+
+double CConfig::Generate_Connection_Lifetime(int fd) const {
+    if (!Is_Drop_Lifetime_Enabled()) {
+        return -1.0;
+    }
+
+    const bool weibull = mDrop_Connection_Lifetime == "weibull";
+
+    // the exponential distribution is the Weibull one with shape 1; the scale is derived from the mean, so changing the
+    // shape does not change the average churn
+    const double shape = (weibull && mDrop_Connection_Lifetime_Shape > 0) ? mDrop_Connection_Lifetime_Shape : 1.0;
+    const double scale = std::max(0.0, mDrop_Connection_Lifetime_Ms_Mean) / std::tgamma(1.0 + 1.0 / shape);
+
+    // inverse of the distribution function
+    const double unit = Generate_Base_Prob(fd, intcptor::NDecision::Drop_Lifetime);
+    return scale * std::pow(-std::log1p(-unit), 1.0 / shape);
 }
 
 void CConfig::Save_Default() {
@@ -137,12 +722,144 @@ void CConfig::Save_Default() {
     file << "Drop_Connection_Delay_Ms_Min " << mDrop_Connection_Delay_Ms_Min << std::endl;
     file << "Drop_Connection_Delay_Ms_Max " << mDrop_Connection_Delay_Ms_Max << std::endl;
     file << "Log_Enabled " << mLog_Enabled << std::endl;
+    file << "Send_Queue_Socket_Limit " << mSend_Queue_Socket_Limit << std::endl;
+    file << "Send_Queue_Total_Limit " << mSend_Queue_Total_Limit << std::endl;
+    file << "Send_Queue_Low_Watermark " << mSend_Queue_Low_Watermark << std::endl;
+    file << "Recv_Delay_Ms_Mean " << mRecv_Delay_Ms_Mean << std::endl;
+    file << "Recv_Delay_Ms_Sigma " << mRecv_Delay_Ms_Sigma << std::endl;
+    file << "Output_Backend " << mOutput_Backend << std::endl;
+    file << "Send_Zerocopy_Threshold " << mSend_Zerocopy_Threshold << std::endl;
+    file << "Output_Queue_Shards " << mOutput_Queue_Shards << std::endl;
+    file << "Send_Bandwidth_Socket_Kbit " << mSend_Bandwidth_Socket_Kbit << std::endl;
+    file << "Send_Bandwidth_Total_Kbit " << mSend_Bandwidth_Total_Kbit << std::endl;
+    file << "Send_Bandwidth_Burst " << mSend_Bandwidth_Burst << std::endl;
+    file << "Trace_Mode " << mTrace_Mode << std::endl;
+    file << "Trace_File " << mTrace_File << std::endl;
+    file << "Capture_Enabled " << mCapture_Enabled << std::endl;
+    file << "Capture_File " << mCapture_File << std::endl;
+    file << "Stats_Enabled " << mStats_Enabled << std::endl;
+    file << "Config_Reload_Enabled " << mConfig_Reload_Enabled << std::endl;
+    file << "Connect_Delay_Ms_Mean " << mConnect_Delay_Ms_Mean << std::endl;
+    file << "Connect_Delay_Ms_Sigma " << mConnect_Delay_Ms_Sigma << std::endl;
+    file << "Close_Linger_Ms " << mClose_Linger_Ms << std::endl;
+    file << "Drop_Connection_Lifetime " << mDrop_Connection_Lifetime << std::endl;
+    file << "Drop_Connection_Lifetime_Ms_Mean " << mDrop_Connection_Lifetime_Ms_Mean << std::endl;
+    file << "Drop_Connection_Lifetime_Shape " << mDrop_Connection_Lifetime_Shape << std::endl;
+    file << "Send_Delay_Distribution " << mSend_Delay_Distribution << std::endl;
+    file << "Send_Delay_Distribution_File " << mSend_Delay_Distribution_File << std::endl;
+    file << "Send_Delay_Slow_Ms_Mean " << mSend_Delay_Slow_Ms_Mean << std::endl;
+    file << "Send_Delay_Slow_Fraction " << mSend_Delay_Slow_Fraction << std::endl;
+    file << "Send_Delay_Pareto_Shape " << mSend_Delay_Pareto_Shape << std::endl;
+    file << "Random_Seed " << mRandom_Seed << std::endl;
 
     std::cout << "[[InTCPtor: saved config file]]" << std::endl;
 }
 
 void CConfig::Initialize_Runtime() {
-    mRandEng.seed(std::random_device()());
-    mSendDelayDist = std::normal_distribution<double>(mSend_Delay_Ms_Mean, mSend_Delay_Ms_Sigma);
-    mProbDist = std::uniform_real_distribution<double>(0.0, 1.0);
+    uint64_t seed = mRandom_Seed;
+    if (seed == 0) {
+        std::random_device rd;
+        seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+
+    intcptor::Set_Master_Seed(seed);
+
+    if (mLog_Enabled) {
+        // print the seed, so the run can be reproduced by setting Random_Seed in the config file
+        std::cout << "[[InTCPtor: random seed = " << seed << "]]" << std::endl;
+
+        // the log refers to the profiles by their index
+        for (size_t i = 1; i < mProfiles.size(); i++) {
+            std::cout << "[[InTCPtor: fault profile #" << i << " = " << mProfiles[i].name << "]]" << std::endl;
+        }
+    }
+}
+
+namespace {
+    // head of the list of all reader slots
+    std::atomic<void*> reader_slots{ nullptr };
+
+    // slot of the calling thread; a plain pointer, so it stays usable in the thread-local destructors run after the holder's
+    thread_local void* thread_reader_slot = nullptr;
+    thread_local bool thread_exiting = false;
+
+    struct TReader_Slot_Holder {
+        std::atomic<bool>* in_use = nullptr;
+
+        ~TReader_Slot_Holder() {
+            thread_exiting = true;
+            thread_reader_slot = nullptr;
+            if (in_use) {
+                in_use->store(false, std::memory_order_release);
+            }
+        }
+    };
+}
+
+CConfig_Holder::TReader_Slot* CConfig_Holder::Thread_Slot() {
+    if (thread_reader_slot) {
+        return static_cast<TReader_Slot*>(thread_reader_slot);
+    }
+
+    TReader_Slot* slot = nullptr;
+    for (auto* cur = static_cast<TReader_Slot*>(reader_slots.load(std::memory_order_acquire)); cur && !slot; cur = cur->next) {
+        bool expected = false;
+        if (cur->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            slot = cur;
+        }
+    }
+
+    // NOTE: slots are never freed, as the config watcher may be scanning them at any time
+    if (!slot) {
+        slot = new TReader_Slot();
+        void* head = reader_slots.load(std::memory_order_relaxed);
+        do {
+            slot->next = static_cast<TReader_Slot*>(head);
+        } while (!reader_slots.compare_exchange_weak(head, slot, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    thread_reader_slot = slot;
+    // a thread calling us from its thread-local destructors keeps its new slot for good
+    if (!thread_exiting) {
+        thread_local TReader_Slot_Holder holder;
+        holder.in_use = &slot->in_use;
+    }
+
+    return slot;
+}
+
+CConfig_Holder::CSnapshot CConfig_Holder::Acquire() const {
+    TReader_Slot* slot = Thread_Slot();
+
+    if (slot->depth++ > 0) {
+        return CSnapshot(slot, slot->pinned.load(std::memory_order_relaxed));
+    }
+
+    // the pin is valid only if the config is still current after it was published, otherwise the watcher could have missed it
+    const CConfig* config = _current.load(std::memory_order_acquire);
+    while (true) {
+        slot->pinned.store(config, std::memory_order_seq_cst);
+        const CConfig* current = _current.load(std::memory_order_seq_cst);
+        if (current == config) {
+            break;
+        }
+        config = current;
+    }
+
+    return CSnapshot(slot, config);
+}
+
+CConfig_Holder::CSnapshot::~CSnapshot() {
+    if (--_slot->depth == 0) {
+        _slot->pinned.store(nullptr, std::memory_order_release);
+    }
+}
+
+bool CConfig_Holder::Is_Pinned(const CConfig* config) const {
+    for (auto* cur = static_cast<TReader_Slot*>(reader_slots.load(std::memory_order_acquire)); cur; cur = cur->next) {
+        if (cur->pinned.load(std::memory_order_seq_cst) == config) {
+            return true;
+        }
+    }
+    return false;
 }
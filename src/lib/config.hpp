@@ -7,11 +7,85 @@
 #pragma once
 
 #include <string>
-#include <random>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+
+#include <sys/socket.h>
 
 #include <memory>
+#include <atomic>
+
+#include "random.hpp"
+#include "socket_table.hpp"
+#include "delay_distribution.hpp"
 
 class CConfig {
+    public:
+        // fault settings, that may differ for sockets of different endpoints; the global settings form the default profile
+        struct TFault_Profile {
+            std::string name;
+
+            double prob_send_1b_sends = 0;
+            double prob_send_2b_sends = 0;
+            double prob_send_2_separate_sends = 0;
+            double prob_send_2b_sends_and_second_send = 0;
+
+            double prob_recv_1b_less = 0;
+            double prob_recv_2b_less = 0;
+            double prob_recv_half = 0;
+            double prob_recv_2b = 0;
+
+            double send_delay_ms_mean = 0;
+            double send_delay_ms_sigma = 0;
+            double recv_delay_ms_mean = 0;
+            double recv_delay_ms_sigma = 0;
+            double connect_delay_ms_mean = 0;
+            double connect_delay_ms_sigma = 0;
+
+            // built from the send delay settings above, once all of them are known
+            intcptor::CDelay_Distribution send_delay;
+
+            double Prob_Send_Total() const { return prob_send_1b_sends + prob_send_2b_sends + prob_send_2_separate_sends + prob_send_2b_sends_and_second_send; }
+            double Prob_Recv_Total() const { return prob_recv_1b_less + prob_recv_2b_less + prob_recv_half + prob_recv_2b; }
+            bool Is_Recv_Delay_Enabled() const { return recv_delay_ms_mean > 0 || recv_delay_ms_sigma > 0; }
+            bool Is_Connect_Delay_Enabled() const { return connect_delay_ms_mean > 0 || connect_delay_ms_sigma > 0; }
+        };
+
+        // which end of the connection the socket is
+        enum class NSocket_Role : uint8_t {
+            Any,
+            Accepted,       // accepted by a listening socket of the application
+            Connected,      // created and connected by the application
+        };
+
+        // address prefix of a rule; IPv4 addresses are kept in the IPv4-mapped IPv6 form (::ffff:a.b.c.d), so a single
+        // prefix matches IPv4 sockets as well as IPv4 clients of dual-stack sockets
+        struct TAddress_Prefix {
+            std::array<uint8_t, 16> addr{};
+            // number of significant leading bits; 0 = any address
+            int bits = 0;
+        };
+
+        // binds sockets matching all given conditions to a profile; the rules are evaluated in order of the config file, the
+        // first matching one wins; sockets not matched by any rule use the default profile
+        struct TProfile_Rule {
+            size_t profile = 0;
+            NSocket_Role role = NSocket_Role::Any;
+            // -1 = any port
+            int local_port = -1;
+            int remote_port = -1;
+            TAddress_Prefix local;
+            TAddress_Prefix remote;
+        };
+
+        // a socket record caches the profile as (config generation << Profile_Bits) | index; zero means "not resolved"
+        static constexpr uint32_t Profile_Bits = 8;
+        static constexpr size_t Max_Profiles = size_t(1) << Profile_Bits;
+
     private:
         double mProb_Send__1B_Sends = 0.1;
         double mProb_Send__2B_Sends = 0.1;
@@ -32,9 +106,101 @@ class CConfig {
 
         bool mLog_Enabled = true;
 
-        std::default_random_engine mRandEng;
-        std::normal_distribution<double> mSendDelayDist;
-        std::uniform_real_distribution<double> mProbDist;
+        // byte budget of the output queue (0 = unlimited)
+        size_t mSend_Queue_Socket_Limit = 4194304;
+        size_t mSend_Queue_Total_Limit = 268435456;
+        double mSend_Queue_Low_Watermark = 0.5;
+
+        // delay of received data (both zero = disabled)
+        double mRecv_Delay_Ms_Mean = 0;
+        double mRecv_Delay_Ms_Sigma = 0;
+
+        // sending backend of the output queue ("send" or "io_uring") and zero-copy threshold of the io_uring backend (0 = off)
+        std::string mOutput_Backend = "send";
+        size_t mSend_Zerocopy_Threshold = 0;
+
+        // number of output queue shards with own worker thread (0 = one per CPU core)
+        size_t mOutput_Queue_Shards = 1;
+
+        // bandwidth limits in kbit/s (0 = unlimited) and the burst size in bytes, enforced by token buckets in the output queue
+        uint64_t mSend_Bandwidth_Socket_Kbit = 0;
+        uint64_t mSend_Bandwidth_Total_Kbit = 0;
+        size_t mSend_Bandwidth_Burst = 16384;
+
+        // recording and replaying of fault decisions ("off", "record" or "replay") and the trace file
+        std::string mTrace_Mode = "off";
+        std::string mTrace_File = "intcptor_trace.bin";
+
+        // capture of the intercepted traffic to a pcapng file
+        bool mCapture_Enabled = false;
+        std::string mCapture_File = "intcptor_capture.pcapng";
+
+        // publishing of live statistics to shared memory
+        bool mStats_Enabled = false;
+
+        // reloading of the config file on change or SIGHUP
+        bool mConfig_Reload_Enabled = false;
+
+        // simulated handshake delay of connect()
+        double mConnect_Delay_Ms_Mean = 0;
+        double mConnect_Delay_Ms_Sigma = 0;
+
+        // how long close() and shutdown() wait for the queued data of the socket to be sent
+        size_t mClose_Linger_Ms = 0;
+
+        // distribution of connection lifetimes: none, exponential or weibull
+        std::string mDrop_Connection_Lifetime = "none";
+        double mDrop_Connection_Lifetime_Ms_Mean = 60000;
+        double mDrop_Connection_Lifetime_Shape = 1.0;
+
+        // distribution of send delays: normal, lognormal, pareto, bimodal, histogram or cdf
+        std::string mSend_Delay_Distribution = "normal";
+        std::string mSend_Delay_Distribution_File = "intcptor_delays.txt";
+        double mSend_Delay_Slow_Ms_Mean = 1000;
+        double mSend_Delay_Slow_Fraction = 0.05;
+        // shape of the pareto distribution; zero means "derive it from the sigma"
+        double mSend_Delay_Pareto_Shape = 0;
+
+        // master seed of all random streams; zero means "pick a random seed on startup"
+        uint64_t mRandom_Seed = 0;
+
+        // profiles (the default one first) and the rules binding sockets to them
+        std::vector<TFault_Profile> mProfiles;
+        std::vector<TProfile_Rule> mRules;
+
+        // incremented by every reload, so the sockets resolve their profile again
+        uint32_t mGeneration = 1;
+
+        // components, that were started with the initial config; a reload can retune or pause them, but not start them
+        bool mStarted_Recv_Delay = false;
+        bool mStarted_Drop_Connections = false;
+
+        struct TDefaults_Only {};
+
+        // creates the config with default values, without loading any file
+        explicit CConfig(TDefaults_Only) {}
+
+        // profile settings and rules as parsed, before the profile names are known
+        using TProfile_Overrides = std::vector<std::pair<std::string, std::vector<std::pair<std::string, double>>>>;
+        using TPending_Rules = std::vector<std::pair<std::string, TProfile_Rule>>;
+
+        // parses a "Profile <name> <key> <value>" line; the values are applied once the whole file is loaded, as profiles
+        // inherit the global settings, that may come later in the file
+        void Parse_Profile_Line(std::istringstream& iss, TProfile_Overrides& overrides);
+
+        // parses a "Profile_Rule <profile> <condition>..." line; the profile names are resolved once the file is loaded
+        void Parse_Rule_Line(std::istringstream& iss, TPending_Rules& rules);
+
+        // builds the profiles from the global settings and the overrides, and binds the rules to them
+        void Build_Profiles(const TProfile_Overrides& overrides, const TPending_Rules& rules);
+
+        // matches the socket against the rules; caches the result in the socket record, once the socket is connected
+        // the peer address is looked up, unless it is given (connect() knows it before the connection is established)
+        size_t Resolve_Profile(int fd, intcptor::TSocket_State& state, const struct sockaddr* peer = nullptr, socklen_t peer_len = 0) const;
+
+        // copies the settings, that are used only on startup, from the config the running components were created with;
+        // returns names of those, that differ in this config (and so are ignored)
+        std::vector<std::string> Keep_Startup_Settings(const CConfig& current);
 
     protected:
         void Initialize_Runtime();
@@ -46,8 +212,17 @@ class CConfig {
         virtual ~CConfig();
 
         void Load_Default_Path();
+        bool Load(const std::string& path);
         void Save_Default();
 
+        // absolute path of the default config file (it is relative to the current working directory)
+        static std::string Default_Path();
+
+        // loads a new config from given file to replace the current one; the random seed is not reinitialized, and the
+        // settings used only on startup keep their current values (ignored ones are reported in ignored); returns nullptr
+        // if the file can't be read
+        static TPtr Reload(const std::string& path, const CConfig& current, std::vector<std::string>& ignored);
+
         double GetProb_Send__1B_Sends() const { return mProb_Send__1B_Sends; }
         double GetProb_Send__2B_Sends() const { return mProb_Send__2B_Sends; }
         double GetProb_Send__2_Separate_Sends() const { return mProb_Send__2_Separate_Sends; }
@@ -60,19 +235,191 @@ class CConfig {
         double GetProb_Recv__2B() const { return mProb_Recv__2B; }
         double GetProb_Recv_Total() const { return mProb_Recv__1B_Less + mProb_Recv__2B_Less + mProb_Recv__Half + mProb_Recv__2B; }
 
-        double Generate_Send_Delay() {
-            return mSendDelayDist(mRandEng);
+        // fault profile of given socket; resolved by the rules on the first use and cached in the socket record, so this
+        // is just a couple of loads, unless the socket is new or the config was reloaded
+        const TFault_Profile& Profile_Of(int fd) const {
+            if (mRules.empty()) {
+                return mProfiles[0];
+            }
+            intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+            if (!state || state->kind.load(std::memory_order_relaxed) == intcptor::NSocket_Kind::None) {
+                return mProfiles[0];
+            }
+            const uint32_t binding = state->profile.load(std::memory_order_relaxed);
+            if ((binding >> Profile_Bits) == Binding_Generation()) {
+                return mProfiles[binding & (Max_Profiles - 1)];
+            }
+            return mProfiles[Resolve_Profile(fd, *state)];
+        }
+
+        // binds the socket to a profile by the address it is being connected to
+        const TFault_Profile& Bind_Profile(int fd, const struct sockaddr* peer, socklen_t peer_len) const {
+            intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+            if (mRules.empty() || !state || state->kind.load(std::memory_order_relaxed) == intcptor::NSocket_Kind::None) {
+                return mProfiles[0];
+            }
+            return mProfiles[Resolve_Profile(fd, *state, peer, peer_len)];
+        }
+
+        const std::vector<TFault_Profile>& Get_Profiles() const { return mProfiles; }
+
+        // random values are drawn from the stream of given socket, or from the stream of the calling thread, if the fd
+        // is not a tracked socket (or not given at all)
+        double Generate_Send_Delay(int fd, const TFault_Profile& profile) const {
+            return intcptor::Socket_Random_Delay(fd, profile.send_delay, intcptor::NDecision::Send_Delay);
         }
 
-        double Generate_Base_Prob() {
-            return mProbDist(mRandEng);
+        double Generate_Send_Delay(int fd = -1) const {
+            return Generate_Send_Delay(fd, Profile_Of(fd));
         }
 
+        double Generate_Base_Prob(int fd = -1, intcptor::NDecision decision = intcptor::NDecision::Other) const {
+            return intcptor::Socket_Random_Unit(fd, decision);
+        }
+
+        double Generate_Recv_Delay(int fd = -1) const {
+            const TFault_Profile& profile = Profile_Of(fd);
+            return std::max(0.0, intcptor::Socket_Random_Normal(fd, profile.recv_delay_ms_mean, profile.recv_delay_ms_sigma, intcptor::NDecision::Recv_Delay));
+        }
+
+        double Generate_Connect_Delay(int fd, const TFault_Profile& profile) const {
+            return std::max(0.0, intcptor::Socket_Random_Normal(fd, profile.connect_delay_ms_mean, profile.connect_delay_ms_sigma, intcptor::NDecision::Connect_Delay));
+        }
+
+        // lifetime of an accepted connection in ms, drawn from the configured distribution; negative, if lifetimes are not
+        // enabled (the connections are dropped at random intervals instead)
+        double Generate_Connection_Lifetime(int fd) const;
+
         bool Should_Drop_Connections() const { return mDrop_Connections; }
+        bool Is_Drop_Lifetime_Enabled() const { return mDrop_Connection_Lifetime == "exponential" || mDrop_Connection_Lifetime == "weibull"; }
         size_t GetDrop_Connection_Delay_Ms_Min() const { return mDrop_Connection_Delay_Ms_Min; }
         size_t GetDrop_Connection_Delay_Ms_Max() const { return mDrop_Connection_Delay_Ms_Max; }
 
         bool Is_Log_Enabled() const { return mLog_Enabled; }
+
+        size_t GetSend_Queue_Socket_Limit() const { return mSend_Queue_Socket_Limit; }
+        size_t GetSend_Queue_Total_Limit() const { return mSend_Queue_Total_Limit; }
+        double GetSend_Queue_Low_Watermark() const { return mSend_Queue_Low_Watermark; }
+
+        double GetRecv_Delay_Ms_Mean() const { return mRecv_Delay_Ms_Mean; }
+        double GetRecv_Delay_Ms_Sigma() const { return mRecv_Delay_Ms_Sigma; }
+        // is the handshake of any connection delayed? (connected sockets are then virtualized in poll(), select() and epoll)
+        bool Is_Connect_Delay_Enabled() const {
+            for (const auto& profile : mProfiles) {
+                if (profile.Is_Connect_Delay_Enabled()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // the input delay stage is needed, if any of the profiles delays received data
+        bool Is_Recv_Delay_Enabled() const {
+            for (const auto& profile : mProfiles) {
+                if (profile.Is_Recv_Delay_Enabled()) {
+                    return true;
+                }
+            }
+            return mRecv_Delay_Ms_Mean > 0 || mRecv_Delay_Ms_Sigma > 0;
+        }
+
+        const std::string& GetOutput_Backend() const { return mOutput_Backend; }
+        size_t GetSend_Zerocopy_Threshold() const { return mSend_Zerocopy_Threshold; }
+
+        size_t GetOutput_Queue_Shards() const { return mOutput_Queue_Shards; }
+
+        uint64_t GetSend_Bandwidth_Socket_Kbit() const { return mSend_Bandwidth_Socket_Kbit; }
+        uint64_t GetSend_Bandwidth_Total_Kbit() const { return mSend_Bandwidth_Total_Kbit; }
+        size_t GetSend_Bandwidth_Burst() const { return mSend_Bandwidth_Burst; }
+
+        const std::string& GetTrace_Mode() const { return mTrace_Mode; }
+        const std::string& GetTrace_File() const { return mTrace_File; }
+
+        bool Is_Capture_Enabled() const { return mCapture_Enabled; }
+        const std::string& GetCapture_File() const { return mCapture_File; }
+
+        bool Is_Stats_Enabled() const { return mStats_Enabled; }
+
+        bool Is_Config_Reload_Enabled() const { return mConfig_Reload_Enabled; }
+
+        double GetConnect_Delay_Ms_Mean() const { return mConnect_Delay_Ms_Mean; }
+        double GetConnect_Delay_Ms_Sigma() const { return mConnect_Delay_Ms_Sigma; }
+
+        size_t GetClose_Linger_Ms() const { return mClose_Linger_Ms; }
+
+        const std::string& GetDrop_Connection_Lifetime() const { return mDrop_Connection_Lifetime; }
+        double GetDrop_Connection_Lifetime_Ms_Mean() const { return mDrop_Connection_Lifetime_Ms_Mean; }
+        double GetDrop_Connection_Lifetime_Shape() const { return mDrop_Connection_Lifetime_Shape; }
+
+        const std::string& GetSend_Delay_Distribution() const { return mSend_Delay_Distribution; }
+        const std::string& GetSend_Delay_Distribution_File() const { return mSend_Delay_Distribution_File; }
+        double GetSend_Delay_Slow_Ms_Mean() const { return mSend_Delay_Slow_Ms_Mean; }
+        double GetSend_Delay_Slow_Fraction() const { return mSend_Delay_Slow_Fraction; }
+        double GetSend_Delay_Pareto_Shape() const { return mSend_Delay_Pareto_Shape; }
+
+        uint64_t GetRandom_Seed() const { return mRandom_Seed; }
+
+    private:
+        uint32_t Binding_Generation() const { return mGeneration & ((uint32_t(1) << (32 - Profile_Bits)) - 1); }
+};
+
+// holds the current config; every reload publishes a new immutable snapshot, so the readers never take a lock; a reader
+// pins the snapshot it uses in its thread's reader slot (a hazard pointer), and a replaced snapshot is freed by the config
+// watcher only when no slot pins it anymore; the current config is never freed, as the intercepted calls may come until
+// the very end of the process
+class CConfig_Holder {
+    private:
+        // per-thread reader slot; slots are never freed, the slots of exited threads are reused by new threads
+        struct alignas(64) TReader_Slot {
+            std::atomic<const CConfig*> pinned{ nullptr };
+            std::atomic<bool> in_use{ true };
+            // nesting of the snapshots of the owning thread; only the outermost one pins
+            uint32_t depth = 0;
+            TReader_Slot* next = nullptr;
+        };
+
+    public:
+        // a pinned config snapshot; an intercepted call takes one at its start and uses it throughout, so it sees a single
+        // config even if a reload happens meanwhile; the snapshots taken while another one of the same thread is alive
+        // (nested calls) return the same config
+        class CSnapshot {
+            public:
+                ~CSnapshot();
+
+                CSnapshot(const CSnapshot&) = delete;
+                CSnapshot& operator=(const CSnapshot&) = delete;
+
+                const CConfig* operator->() const { return _config; }
+                const CConfig& operator*() const { return *_config; }
+
+            private:
+                CSnapshot(TReader_Slot* slot, const CConfig* config) : _slot(slot), _config(config) {
+                }
+
+                TReader_Slot* _slot;
+                const CConfig* _config;
+
+                friend class CConfig_Holder;
+        };
+
+        CSnapshot Acquire() const;
+
+        // pins the config for the rest of the full expression
+        CSnapshot operator->() const { return Acquire(); }
+        explicit operator bool() const { return _current.load(std::memory_order_acquire) != nullptr; }
+
+        // publishes the new config; returns the previous one, that must not be freed while Is_Pinned says so
+        CConfig::TPtr Exchange(CConfig::TPtr next) {
+            return CConfig::TPtr(_current.exchange(next.release(), std::memory_order_seq_cst));
+        }
+
+        // is the (already replaced) config still used by a reader?
+        bool Is_Pinned(const CConfig* config) const;
+
+    private:
+        static TReader_Slot* Thread_Slot();
+
+        std::atomic<CConfig*> _current{ nullptr };
 };
 
-extern CConfig::TPtr gConfig;
+extern CConfig_Holder gConfig;
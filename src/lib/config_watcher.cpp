@@ -0,0 +1,214 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the config watcher, that reloads the config file while the application runs.
+ */
+
+#include "config_watcher.hpp"
+
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cerrno>
+
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+
+#include "overrides.hpp"
+
+CConfig_Watcher* gConfig_Watcher = nullptr;
+
+std::atomic<int> CConfig_Watcher::_wake_fd{ -1 };
+
+CConfig_Watcher::CConfig_Watcher() {
+    if (!gConfig->Is_Config_Reload_Enabled()) {
+        return;
+    }
+
+    // the path is resolved now, as the application may change its working directory later
+    _path = CConfig::Default_Path();
+    const std::filesystem::path path(_path);
+    _file_name = path.filename().string();
+
+    const int wake_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        std::cerr << "[[InTCPtor: failed to create config watcher, config will not be reloaded]]" << std::endl;
+        return;
+    }
+    _wake_fd.store(wake_fd, std::memory_order_release);
+
+    // the directory is watched rather than the file, so the reload works with editors, that replace the file by renaming
+    _inotify_fd = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (_inotify_fd >= 0 && ::inotify_add_watch(_inotify_fd, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        orig::close(_inotify_fd);
+        _inotify_fd = -1;
+    }
+    if (_inotify_fd < 0) {
+        std::cerr << "[[InTCPtor: failed to watch " << _path << ", config will be reloaded only on SIGHUP]]" << std::endl;
+    }
+
+    // SIGHUP terminates the process by default; the handler is installed only if the application did not install its own
+    // (it may still do so later, the file is watched anyway)
+    struct sigaction current{};
+    if (::sigaction(SIGHUP, nullptr, &current) == 0 && !(current.sa_flags & SA_SIGINFO) && (current.sa_handler == SIG_DFL || current.sa_handler == SIG_IGN)) {
+        struct sigaction action{};
+        action.sa_handler = &CConfig_Watcher::Signal_Handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        _signal_installed = ::sigaction(SIGHUP, &action, &_previous_action) == 0;
+    }
+
+    _running = true;
+    _worker = std::thread(&CConfig_Watcher::worker, this);
+
+    if (gConfig->Is_Log_Enabled()) {
+        std::cout << "[[InTCPtor: reloading config " << _path << " on change" << (_signal_installed ? " or SIGHUP" : "") << "]]" << std::endl;
+    }
+}
+
+CConfig_Watcher::~CConfig_Watcher() {
+    const int wake_fd = _wake_fd.load(std::memory_order_acquire);
+    if (wake_fd < 0) {
+        return;
+    }
+
+    if (_signal_installed) {
+        // restore the previous handler only if the application did not replace ours in the meantime
+        struct sigaction current{};
+        if (::sigaction(SIGHUP, nullptr, &current) == 0 && current.sa_handler == &CConfig_Watcher::Signal_Handler) {
+            ::sigaction(SIGHUP, &_previous_action, nullptr);
+        }
+    }
+
+    if (_running) {
+        _running = false;
+        const uint64_t one = 1;
+        orig::write(wake_fd, &one, sizeof(one));
+        _worker.join();
+    }
+
+    _wake_fd.store(-1, std::memory_order_release);
+    orig::close(wake_fd);
+    if (_inotify_fd >= 0) {
+        orig::close(_inotify_fd);
+    }
+
+    Free_Retired();
+
+    // the configs still pinned are left to the process teardown, their readers may still be inside the intercepted calls
+    for (auto& retired : _retired) {
+        static_cast<void>(retired.release());
+    }
+}
+
+void CConfig_Watcher::Signal_Handler(int) {
+    const int saved_errno = errno;
+
+    const int wake_fd = _wake_fd.load(std::memory_order_acquire);
+    if (wake_fd >= 0) {
+        const uint64_t one = 1;
+        static_cast<void>(orig::write(wake_fd, &one, sizeof(one)));
+    }
+
+    errno = saved_errno;
+}
+
+bool CConfig_Watcher::Drain_Events() {
+    if (_inotify_fd < 0) {
+        return false;
+    }
+
+    bool changed = false;
+    alignas(struct inotify_event) char buffer[4096];
+
+    while (true) {
+        const ssize_t len = orig::read(_inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+
+        for (ssize_t pos = 0; pos < len; ) {
+            const auto* event = reinterpret_cast<const struct inotify_event*>(buffer + pos);
+            // on overflow, the event of the config file may have been lost
+            if ((event->mask & IN_Q_OVERFLOW) || (event->len > 0 && _file_name == event->name)) {
+                changed = true;
+            }
+            pos += static_cast<ssize_t>(sizeof(struct inotify_event) + event->len);
+        }
+    }
+
+    return changed;
+}
+
+void CConfig_Watcher::worker() {
+    struct pollfd fds[2] = {
+        { _wake_fd.load(std::memory_order_acquire), POLLIN, 0 },
+        { _inotify_fd, POLLIN, 0 },
+    };
+
+    while (_running) {
+        // wakes up regularly to free the retired configs, that were pinned the last time
+        const int res = orig::poll(fds, 2, 1000);
+
+        bool reload = false;
+        if (res > 0) {
+            if (fds[0].revents & POLLIN) {
+                uint64_t count;
+                static_cast<void>(orig::read(fds[0].fd, &count, sizeof(count)));
+                reload = true;
+            }
+            if (fds[1].revents & POLLIN) {
+                reload = Drain_Events() || reload;
+            }
+
+            // the application closed our descriptor (e.g., a daemon closing everything it inherited); stop polling it
+            for (auto& pfd : fds) {
+                if (pfd.revents & POLLNVAL) {
+                    pfd.fd = -1;
+                }
+            }
+        }
+
+        if (!_running) {
+            break;
+        }
+
+        if (reload) {
+            do {
+                std::this_thread::sleep_for(Settle_Time);
+            } while (Drain_Events());
+
+            Reload();
+        }
+
+        Free_Retired();
+    }
+}
+
+void CConfig_Watcher::Reload() {
+    std::vector<std::string> ignored;
+    CConfig::TPtr config = CConfig::Reload(_path, *gConfig.Acquire(), ignored);
+    if (!config) {
+        std::cerr << "[[InTCPtor: could not read config file " << _path << ", keeping the current config]]" << std::endl;
+        return;
+    }
+
+    _retired.push_back(gConfig.Exchange(std::move(config)));
+
+    std::cout << "[[InTCPtor: config reloaded from " << _path << "]]" << std::endl;
+
+    if (!ignored.empty()) {
+        std::cout << "[[InTCPtor: settings applied only on startup were not changed:";
+        for (const auto& name : ignored) {
+            std::cout << " " << name;
+        }
+        std::cout << "]]" << std::endl;
+    }
+}
+
+void CConfig_Watcher::Free_Retired() {
+    _retired.erase(std::remove_if(_retired.begin(), _retired.end(), [](const CConfig::TPtr& retired) {
+        return !gConfig.Is_Pinned(retired.get());
+    }), _retired.end());
+}
@@ -0,0 +1,61 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the config watcher, that reloads the config file while the application runs.
+ */
+
+#pragma once
+
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <memory>
+
+#include <signal.h>
+
+#include "config.hpp"
+
+// reloads the config file, when it is written (watched with inotify) or when the process receives SIGHUP, and publishes
+// the new config to gConfig; the replaced configs are freed once no reader pins them
+class CConfig_Watcher {
+    public:
+        // editors often write the file in several steps; the reload waits until the file is quiet for this long
+        static constexpr auto Settle_Time = std::chrono::milliseconds(100);
+
+        CConfig_Watcher();
+
+        virtual ~CConfig_Watcher();
+
+        bool Is_Enabled() const { return _running; }
+
+    private:
+        void worker();
+
+        // reads all pending inotify events; returns true, if any of them concerns the config file
+        bool Drain_Events();
+
+        void Reload();
+        // frees the retired configs, that are not pinned by any reader
+        void Free_Retired();
+
+        static void Signal_Handler(int sig);
+
+        // descriptor of the eventfd, that wakes up the worker (written by the signal handler and the destructor)
+        static std::atomic<int> _wake_fd;
+
+        std::string _path;
+        std::string _file_name;
+        int _inotify_fd = -1;
+        bool _signal_installed = false;
+        struct sigaction _previous_action{};
+
+        std::thread _worker;
+        std::atomic<bool> _running{ false };
+
+        // used by the worker only
+        std::vector<CConfig::TPtr> _retired;
+};
+
+extern CConfig_Watcher* gConfig_Watcher;
@@ -0,0 +1,231 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the distributions of artificial delays.
+ */
+
+#include "delay_distribution.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+namespace intcptor {
+
+    CAlias_Table::CAlias_Table(std::vector<TBin> bins) : _bins(std::move(bins)) {
+        const size_t n = _bins.size();
+
+        double total = 0;
+        for (const auto& bin : _bins) {
+            total += bin.weight;
+        }
+
+        // scaled probabilities; the bins are split to "small" (below the average) and "large" ones, and every small bin
+        // is topped up from a large one, so each column of the table holds at most two bins
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            scaled[i] = _bins[i].weight * static_cast<double>(n) / total;
+            (scaled[i] < 1.0 ? small : large).push_back(static_cast<uint32_t>(i));
+        }
+
+        _keep.assign(n, 1.0);
+        _alias.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            _alias[i] = static_cast<uint32_t>(i);
+        }
+
+        while (!small.empty() && !large.empty()) {
+            const uint32_t s = small.back();
+            small.pop_back();
+            const uint32_t l = large.back();
+
+            _keep[s] = scaled[s];
+            _alias[s] = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // what is left is full up to the rounding errors
+    }
+
+    double CAlias_Table::Sample(double u1, double u2) const {
+        const double x = u1 * static_cast<double>(_bins.size());
+        const size_t column = std::min(static_cast<size_t>(x), _bins.size() - 1);
+
+        const TBin& bin = _bins[(x - static_cast<double>(column)) < _keep[column] ? column : _alias[column]];
+
+        return bin.from + u2 * (bin.to - bin.from);
+    }
+
+    std::shared_ptr<const CAlias_Table> CAlias_Table::Load(const std::string& path, bool cdf, std::string& error) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            error = "could not open " + path;
+            return nullptr;
+        }
+
+        std::vector<TBin> bins;
+        double total = 0;
+
+        // the previous point of the distribution function
+        double prev_delay = 0;
+        double prev_prob = 0;
+        bool first = true;
+
+        std::string line;
+        size_t line_no = 0;
+        while (std::getline(file, line)) {
+            line_no++;
+
+            std::istringstream iss(line);
+            std::string token;
+            if (!(iss >> token) || token[0] == '#') {
+                continue;
+            }
+            iss.clear();
+            iss.str(line);
+
+            if (cdf) {
+                double delay, prob;
+                if (!(iss >> delay >> prob) || prob < prev_prob || prob > 1.0 || (!first && delay < prev_delay)) {
+                    error = path + ":" + std::to_string(line_no) + ": expected \"<delay ms> <cumulative probability>\" with both values non-decreasing";
+                    return nullptr;
+                }
+
+                // the probability of the first point is the mass at (or below) its delay
+                if (prob > prev_prob) {
+                    bins.push_back({ first ? delay : prev_delay, delay, prob - prev_prob });
+                }
+
+                prev_delay = delay;
+                prev_prob = prob;
+                first = false;
+            }
+            else {
+                TBin bin;
+                if (!(iss >> bin.from >> bin.to >> bin.weight) || bin.to < bin.from || bin.weight < 0) {
+                    error = path + ":" + std::to_string(line_no) + ": expected \"<from ms> <to ms> <weight>\"";
+                    return nullptr;
+                }
+
+                if (bin.weight > 0) {
+                    bins.push_back(bin);
+                }
+            }
+        }
+
+        for (const auto& bin : bins) {
+            total += bin.weight;
+        }
+
+        if (bins.empty() || total <= 0) {
+            error = path + ": the distribution is empty";
+            return nullptr;
+        }
+
+        return std::make_shared<const CAlias_Table>(std::move(bins));
+    }
+
+    CDelay_Distribution::CDelay_Distribution(NDelay_Family family, double mean, double sigma, double slow_mean, double slow_fraction,
+                                             double pareto_shape, std::shared_ptr<const CAlias_Table> table)
+        : _family(family), _mean(mean), _sigma(sigma), _slow_fraction(slow_fraction), _table(std::move(table)) {
+
+        switch (_family) {
+            case NDelay_Family::Lognormal:
+                // chosen so the delays themselves have the configured mean and sigma
+                if (_mean > 0) {
+                    _b = std::sqrt(std::log1p((_sigma * _sigma) / (_mean * _mean)));
+                    _a = std::log(_mean) - _b * _b / 2;
+                }
+                break;
+            case NDelay_Family::Pareto:
+                // an explicit shape sets the tail directly (at most 2 means infinite variance); otherwise, the shape follows
+                // from the coefficient of variation, and it stays above 2, so the variance exists; the scale keeps the mean
+                if (pareto_shape > 1.0) {
+                    _b = pareto_shape;
+                }
+                else if (_sigma > 0) {
+                    _b = 1.0 + std::sqrt(1.0 + (_mean * _mean) / (_sigma * _sigma));
+                }
+                if (_mean > 0 && _b > 0) {
+                    _a = _mean * (_b - 1.0) / _b;
+                }
+                else {
+                    _b = 0;
+                }
+                break;
+            case NDelay_Family::Bimodal:
+                _a = slow_mean;
+                break;
+            case NDelay_Family::Empirical:
+                if (!_table) {
+                    _family = NDelay_Family::Normal;
+                }
+                break;
+            case NDelay_Family::Normal:
+                break;
+        }
+    }
+
+    double CDelay_Distribution::Sample(double u1, double u2, double u3) const {
+        // standard normal value (Box-Muller transform); 1 - u1 is in (0, 1], so the logarithm is defined
+        auto standard_normal = [u1, u2] {
+            return std::sqrt(-2.0 * std::log(1.0 - u1)) * std::cos(2.0 * M_PI * u2);
+        };
+
+        double delay = 0;
+
+        switch (_family) {
+            case NDelay_Family::Normal:
+                delay = _mean + _sigma * standard_normal();
+                break;
+            case NDelay_Family::Lognormal:
+                delay = _mean > 0 ? std::exp(_a + _b * standard_normal()) : 0.0;
+                break;
+            case NDelay_Family::Pareto:
+                delay = _b > 0 ? _a / std::pow(1.0 - u1, 1.0 / _b) : _mean;
+                break;
+            case NDelay_Family::Bimodal:
+                delay = (u3 < _slow_fraction ? _a : _mean) + _sigma * standard_normal();
+                break;
+            case NDelay_Family::Empirical:
+                delay = _table->Sample(u1, u2);
+                break;
+        }
+
+        // the delays are used as durations, a negative one would wrap around
+        return std::max(0.0, delay);
+    }
+
+    bool CDelay_Distribution::Parse_Family(const std::string& name, NDelay_Family& family, bool& cdf) {
+        cdf = false;
+
+        if (name == "normal") {
+            family = NDelay_Family::Normal;
+        }
+        else if (name == "lognormal") {
+            family = NDelay_Family::Lognormal;
+        }
+        else if (name == "pareto") {
+            family = NDelay_Family::Pareto;
+        }
+        else if (name == "bimodal") {
+            family = NDelay_Family::Bimodal;
+        }
+        else if (name == "histogram" || name == "cdf") {
+            family = NDelay_Family::Empirical;
+            cdf = (name == "cdf");
+        }
+        else {
+            return false;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,89 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the distributions of artificial delays.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace intcptor {
+
+    // shape of the delay distribution
+    enum class NDelay_Family : uint8_t {
+        Normal,         // normal with given mean and sigma; the default, and the only one drawn with two values
+        Lognormal,      // lognormal with given mean and sigma of the delay itself
+        Pareto,         // Pareto (power-law tail) with given mean, and either given shape or sigma of the delay itself
+        Bimodal,        // normal around the mean, with a given fraction of the delays around a second (slow) mean
+        Empirical,      // histogram loaded from a file, sampled through an alias table
+    };
+
+    // histogram of delays prepared for sampling in constant time (alias method of Walker and Vose); a single uniform value
+    // picks a bin, another one the delay within the bin
+    class CAlias_Table final {
+        public:
+            // a bin of the histogram; the delays are spread uniformly within [from, to]
+            struct TBin {
+                double from;
+                double to;
+                double weight;
+            };
+
+            explicit CAlias_Table(std::vector<TBin> bins);
+
+            double Sample(double u1, double u2) const;
+
+            // reads a histogram from a file; lines "<from ms> <to ms> <weight>" form a histogram, lines "<delay ms>
+            // <cumulative probability>" (if cdf is set) form a piecewise linear distribution function; empty lines and
+            // lines starting with # are skipped; returns nullptr and sets error, if the file is not usable
+            static std::shared_ptr<const CAlias_Table> Load(const std::string& path, bool cdf, std::string& error);
+
+        private:
+            std::vector<TBin> _bins;
+            // probability of keeping the picked bin, and the bin to take instead
+            std::vector<double> _keep;
+            std::vector<uint32_t> _alias;
+    };
+
+    // immutable parameters of a delay distribution; the derived parameters are computed once, when the config is loaded
+    class CDelay_Distribution final {
+        public:
+            // number of uniform values a single sample takes from the random stream
+            static constexpr size_t Draw_Count = 3;
+
+            CDelay_Distribution() = default;
+
+            // pareto_shape above 1 overrides the Pareto shape derived from sigma
+            CDelay_Distribution(NDelay_Family family, double mean, double sigma, double slow_mean = 0, double slow_fraction = 0,
+                                double pareto_shape = 0, std::shared_ptr<const CAlias_Table> table = nullptr);
+
+            // the normal distribution keeps using the two-value draw of the random stream, so the runs recorded before
+            // the other families existed still replay the same
+            bool Is_Normal() const { return _family == NDelay_Family::Normal; }
+
+            double Mean() const { return _mean; }
+            double Sigma() const { return _sigma; }
+
+            // delay in ms from Draw_Count independent uniform values in [0, 1); never negative
+            double Sample(double u1, double u2, double u3) const;
+
+            // parses the family name used in the config file; returns false, if it is unknown
+            static bool Parse_Family(const std::string& name, NDelay_Family& family, bool& cdf);
+
+        private:
+            NDelay_Family _family = NDelay_Family::Normal;
+            double _mean = 0;
+            double _sigma = 0;
+
+            // lognormal - parameters of the underlying normal distribution; Pareto - scale and shape; bimodal - the slow mode
+            double _a = 0;
+            double _b = 0;
+            double _slow_fraction = 0;
+
+            std::shared_ptr<const CAlias_Table> _table;
+    };
+}
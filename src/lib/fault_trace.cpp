@@ -0,0 +1,280 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the fault trace, that records all fault decisions to a binary file and replays them later.
+ */
+
+#include "fault_trace.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "overrides.hpp"
+#include "config.hpp"
+
+CFault_Trace* gFault_Trace = nullptr;
+
+namespace {
+
+    constexpr char Trace_Magic[8] = { 'I', 'N', 'T', 'C', 'P', 'T', 'R', 'C' };
+    constexpr uint32_t Trace_Version = 1;
+
+    // the header takes the place of the first records
+    constexpr uint64_t Header_Slots = sizeof(intcptor::TTrace_Header) / sizeof(intcptor::TTrace_Record);
+
+    constexpr size_t Chunk_Bytes = CFault_Trace::Chunk_Records * sizeof(intcptor::TTrace_Record);
+
+    uint64_t Stream_Key(int fd, uint32_t generation) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(fd)) << 32) | generation;
+    }
+}
+
+CFault_Trace::CFault_Trace() {
+    const std::string& mode = gConfig->GetTrace_Mode();
+
+    if (mode == "record") {
+        _recording = Open_Record(gConfig->GetTrace_File());
+        if (_recording && gConfig->Is_Log_Enabled()) {
+            std::cout << "[[InTCPtor: recording fault decisions to " << gConfig->GetTrace_File() << "]]" << std::endl;
+        }
+    }
+    else if (mode == "replay") {
+        _replaying = Load_Replay(gConfig->GetTrace_File());
+        if (_replaying && gConfig->Is_Log_Enabled()) {
+            std::cout << "[[InTCPtor: replaying fault decisions from " << gConfig->GetTrace_File() << "]]" << std::endl;
+        }
+    }
+    else if (mode != "off") {
+        std::cerr << "[[InTCPtor: unknown trace mode " << mode << ", not tracing]]" << std::endl;
+    }
+}
+
+CFault_Trace::~CFault_Trace() {
+    if (!_recording) {
+        return;
+    }
+
+    Stop();
+
+    for (auto& chunk : _chunks) {
+        if (auto* records = chunk.load(std::memory_order_relaxed)) {
+            ::munmap(records, Chunk_Bytes);
+        }
+    }
+}
+
+void CFault_Trace::Stop() {
+    if (!_recording || _stopped.exchange(true)) {
+        return;
+    }
+
+    // the remaining slots are taken at once, so the later decisions find the trace full and are not recorded (quietly);
+    // the chunks stay mapped, the decisions being recorded right now still write to them
+    _overflow_reported.store(true, std::memory_order_relaxed);
+    const uint64_t slots = std::min<uint64_t>(_next_slot.exchange(Max_Chunks * Chunk_Records), Max_Chunks * Chunk_Records);
+
+    // cut off the unused rest of the last chunk; if the process crashes before this point, the trace is still complete up
+    // to the last written record, the rest are empty records skipped by the replay
+    if (::truncate(_path.c_str(), static_cast<off_t>(slots * sizeof(intcptor::TTrace_Record))) != 0) {
+        std::cerr << "[[InTCPtor: failed to truncate the trace file]]" << std::endl;
+    }
+}
+
+bool CFault_Trace::Open_Record(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "[[InTCPtor: failed to create trace file " << path << "]]" << std::endl;
+        return false;
+    }
+    orig::close(fd);
+
+    _path = path;
+
+    auto* first = Map_Chunk(0);
+    if (!first) {
+        std::cerr << "[[InTCPtor: failed to map trace file " << path << "]]" << std::endl;
+        return false;
+    }
+
+    intcptor::TTrace_Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, Trace_Magic, sizeof(header.magic));
+    header.version = Trace_Version;
+    header.record_size = sizeof(intcptor::TTrace_Record);
+    header.master_seed = intcptor::Get_Master_Seed();
+    std::memcpy(first, &header, sizeof(header));
+
+    _next_slot.store(Header_Slots, std::memory_order_relaxed);
+
+    return true;
+}
+
+intcptor::TTrace_Record* CFault_Trace::Map_Chunk(size_t chunk) {
+    std::unique_lock<std::mutex> lock(_map_mutex);
+
+    // some other thread may have mapped it in the meantime
+    if (auto* records = _chunks[chunk].load(std::memory_order_acquire)) {
+        return records;
+    }
+
+    // the file is not kept open, so the trace does not shift the descriptor numbers of the application - the sockets are
+    // identified by them in the trace
+    const int fd = ::open(_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    // the new area of the file reads as zeroes, i.e., as empty records; chunks may be mapped out of order, the file must
+    // never shrink, though
+    if (chunk >= _file_chunks) {
+        if (::ftruncate(fd, static_cast<off_t>((chunk + 1) * Chunk_Bytes)) != 0) {
+            orig::close(fd);
+            return nullptr;
+        }
+        _file_chunks = chunk + 1;
+    }
+
+    void* mem = ::mmap(nullptr, Chunk_Bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(chunk * Chunk_Bytes));
+    orig::close(fd);
+
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto* records = static_cast<intcptor::TTrace_Record*>(mem);
+    _chunks[chunk].store(records, std::memory_order_release);
+
+    return records;
+}
+
+void CFault_Trace::Record(int fd, uint32_t generation, uint64_t seq, intcptor::NDecision decision, double value) {
+    const uint64_t slot = _next_slot.fetch_add(1, std::memory_order_relaxed);
+    const size_t chunk = static_cast<size_t>(slot / Chunk_Records);
+
+    intcptor::TTrace_Record* records = (chunk < Max_Chunks) ? _chunks[chunk].load(std::memory_order_acquire) : nullptr;
+    if (!records && chunk < Max_Chunks) {
+        records = Map_Chunk(chunk);
+    }
+
+    if (!records) {
+        if (!_overflow_reported.exchange(true, std::memory_order_relaxed)) {
+            std::cerr << "[[InTCPtor: trace file is full or could not be extended, further decisions are not recorded]]" << std::endl;
+        }
+        return;
+    }
+
+    intcptor::TTrace_Record& record = records[slot % Chunk_Records];
+    record.fd = fd;
+    record.generation = generation;
+    record.seq = seq;
+    record.value = value;
+    __atomic_store_n(reinterpret_cast<uint8_t*>(&record.decision), static_cast<uint8_t>(decision), __ATOMIC_RELEASE);
+}
+
+bool CFault_Trace::Load_Replay(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "[[InTCPtor: failed to open trace file " << path << "]]" << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(intcptor::TTrace_Header)) {
+        std::cerr << "[[InTCPtor: trace file " << path << " is not valid]]" << std::endl;
+        orig::close(fd);
+        return false;
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* mem = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    orig::close(fd);
+
+    if (mem == MAP_FAILED) {
+        std::cerr << "[[InTCPtor: failed to map trace file " << path << "]]" << std::endl;
+        return false;
+    }
+
+    const auto* header = static_cast<const intcptor::TTrace_Header*>(mem);
+    if (std::memcmp(header->magic, Trace_Magic, sizeof(Trace_Magic)) != 0 || header->version != Trace_Version
+        || header->record_size != sizeof(intcptor::TTrace_Record)) {
+        std::cerr << "[[InTCPtor: trace file " << path << " is not valid]]" << std::endl;
+        ::munmap(mem, size);
+        return false;
+    }
+
+    // decisions missing in the trace are drawn the same way as in the recorded run, unless the seed is set explicitly
+    if (gConfig->GetRandom_Seed() == 0) {
+        intcptor::Set_Master_Seed(header->master_seed);
+        if (gConfig->Is_Log_Enabled()) {
+            std::cout << "[[InTCPtor: random seed = " << header->master_seed << " (from trace)]]" << std::endl;
+        }
+    }
+
+    const auto* records = static_cast<const intcptor::TTrace_Record*>(mem);
+    const size_t count = size / sizeof(intcptor::TTrace_Record);
+
+    for (size_t i = Header_Slots; i < count; i++) {
+        const auto& record = records[i];
+        if (record.decision == intcptor::NDecision::None) {
+            continue;
+        }
+
+        if (record.fd < 0 || record.decision == intcptor::NDecision::Drop_Delay || record.decision == intcptor::NDecision::Drop_Victim) {
+            _replay_unbound.push_back(record);
+        }
+        else {
+            _replay_streams[Stream_Key(record.fd, record.generation)].push_back({ record.seq, record.value, record.decision });
+        }
+    }
+
+    ::munmap(mem, size);
+
+    // concurrent calls on a single socket may have written their records out of order
+    for (auto& stream : _replay_streams) {
+        std::sort(stream.second.begin(), stream.second.end(), [](const TReplay_Entry& a, const TReplay_Entry& b) {
+            return a.seq < b.seq;
+        });
+    }
+    std::stable_sort(_replay_unbound.begin(), _replay_unbound.end(), [](const intcptor::TTrace_Record& a, const intcptor::TTrace_Record& b) {
+        return a.seq < b.seq;
+    });
+
+    return true;
+}
+
+bool CFault_Trace::Replay(int fd, uint32_t generation, uint64_t seq, intcptor::NDecision decision, double& value) {
+    const auto itr = _replay_streams.find(Stream_Key(fd, generation));
+    if (itr != _replay_streams.end()) {
+        const auto& entries = itr->second;
+        const auto entry = std::lower_bound(entries.begin(), entries.end(), seq, [](const TReplay_Entry& e, uint64_t s) {
+            return e.seq < s;
+        });
+
+        if (entry != entries.end() && entry->seq == seq && entry->decision == decision) {
+            value = entry->value;
+            return true;
+        }
+    }
+
+    if (!_divergence_reported.exchange(true, std::memory_order_relaxed)) {
+        std::cerr << "[[InTCPtor: replayed run diverged from the trace on socket " << fd << ", missing decisions are drawn randomly]]" << std::endl;
+    }
+
+    return false;
+}
+
+bool CFault_Trace::Next_Unbound(intcptor::TTrace_Record& record) {
+    const size_t pos = _replay_unbound_pos.fetch_add(1, std::memory_order_relaxed);
+    if (pos >= _replay_unbound.size()) {
+        return false;
+    }
+
+    record = _replay_unbound[pos];
+    return true;
+}
@@ -0,0 +1,115 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the fault trace, that records all fault decisions to a binary file and replays them later.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+#include "random.hpp"
+
+namespace intcptor {
+
+    // a single decision in the trace file
+    struct TTrace_Record {
+        // socket the decision was made for (-1 for decisions not bound to a socket)
+        int32_t fd;
+        // generation of the fd (see TSocket_State), so reused descriptors are told apart
+        uint32_t generation;
+        // position in the random stream of the socket (or sequence number of decisions not bound to a socket)
+        uint64_t seq;
+        // the drawn value
+        double value;
+        // written last, so a record with NDecision::None was not written completely
+        NDecision decision;
+        uint8_t reserved[7];
+    };
+
+    static_assert(sizeof(TTrace_Record) == 32, "trace record layout must not change");
+
+    // header of the trace file; occupies the space of the first two records
+    struct TTrace_Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        // master seed of the recorded run; the replay uses it for decisions missing in the trace
+        uint64_t master_seed;
+        uint64_t reserved[5];
+    };
+
+    static_assert(sizeof(TTrace_Header) == 2 * sizeof(TTrace_Record), "trace header must span two records");
+}
+
+class CFault_Trace {
+    public:
+        // the file is mapped in chunks of this many records; chunks are mapped on demand and never moved, so the records
+        // are written without any lock
+        static constexpr size_t Chunk_Records = size_t(1) << 16;
+        static constexpr size_t Max_Chunks = 4096;
+
+        CFault_Trace();
+
+        virtual ~CFault_Trace();
+
+        // cuts the recorded trace to the decisions made so far; the decisions made later are not recorded
+        void Stop();
+
+        bool Is_Recording() const { return _recording; }
+        bool Is_Replaying() const { return _replaying; }
+
+        // appends the decision to the trace
+        void Record(int fd, uint32_t generation, uint64_t seq, intcptor::NDecision decision, double value);
+
+        // looks the decision up in the replayed trace; returns false, if the trace does not contain it (i.e., the replayed
+        // run diverged from the recorded one)
+        bool Replay(int fd, uint32_t generation, uint64_t seq, intcptor::NDecision decision, double& value);
+
+        // returns the next recorded decision not bound to a socket stream (connection drops), in the recorded order
+        bool Next_Unbound(intcptor::TTrace_Record& record);
+
+    private:
+        // maps the chunk of the trace file (and grows the file, if needed); returns nullptr on failure
+        intcptor::TTrace_Record* Map_Chunk(size_t chunk);
+
+        // opens the trace file for recording and writes the header
+        bool Open_Record(const std::string& path);
+
+        // reads the whole trace file and indexes its records
+        bool Load_Replay(const std::string& path);
+
+        bool _recording = false;
+        bool _replaying = false;
+
+        // recording
+        std::string _path;
+        std::atomic<uint64_t> _next_slot{ 0 };
+        std::atomic<intcptor::TTrace_Record*> _chunks[Max_Chunks] = {};
+        std::mutex _map_mutex;
+        // number of chunks the file was extended to; guarded by the map mutex
+        size_t _file_chunks = 0;
+        std::atomic<bool> _overflow_reported{ false };
+
+        // replay; the index is built in the constructor and never modified afterwards, so it is read without a lock
+        struct TReplay_Entry {
+            uint64_t seq;
+            double value;
+            intcptor::NDecision decision;
+        };
+        // socket streams keyed by fd and generation; entries sorted by seq
+        std::unordered_map<uint64_t, std::vector<TReplay_Entry>> _replay_streams;
+        // decisions not bound to a socket stream, in the recorded order
+        std::vector<intcptor::TTrace_Record> _replay_unbound;
+        std::atomic<size_t> _replay_unbound_pos{ 0 };
+        std::atomic<bool> _divergence_reported{ false };
+        std::atomic<bool> _stopped{ false };
+};
+
+extern CFault_Trace* gFault_Trace;
@@ -0,0 +1,1113 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the input delay stage, that holds received data until their release time, and the readiness
+ * virtualization of poll(), select() and epoll, so the application is notified only about the released data.
+ */
+
+#include "input_delay_stage.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <limits>
+#include <thread>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "overrides.hpp"
+#include "config.hpp"
+#include "logger.hpp"
+#include "stats.hpp"
+#include "output_timed_queue.hpp"
+
+CInput_Delay_Stage* gInput_Delay_Stage = nullptr;
+
+namespace {
+
+    // kernel registrations of virtualized sockets carry this tag and the fd in their data, instead of the application data
+    constexpr uint64_t Epoll_Tag = 0x1A7C'7042'0000'0000ULL;
+    constexpr uint64_t Epoll_Tag_Mask = 0xFFFF'FFFF'0000'0000ULL;
+
+    constexpr uint32_t Epoll_Input_Events = EPOLLIN | EPOLLRDNORM | EPOLLRDHUP;
+    constexpr uint32_t Epoll_Output_Events = EPOLLOUT | EPOLLWRNORM;
+    constexpr short Poll_Input_Events = POLLIN | POLLRDNORM | POLLRDHUP;
+    constexpr short Poll_Output_Events = POLLOUT | POLLWRNORM;
+
+    // is the writability of the socket hidden? (it is over its output queue budget - see COutput_Timed_Queue::reserve - or
+    // its simulated handshake is in progress); recheck is lowered to the time the answer may change
+    bool Is_Output_Masked(int fd, CInput_Delay_Stage::TClock::time_point now, CInput_Delay_Stage::TClock::time_point& recheck) {
+        CInput_Delay_Stage::TClock::time_point ready;
+        if (intcptor::Is_Connecting(fd, now, &ready)) {
+            recheck = std::min(recheck, ready);
+            return true;
+        }
+        if (gOutput_Timed_Queue->is_blocked(fd)) {
+            recheck = std::min(recheck, now + CInput_Delay_Stage::Send_Blocked_Recheck);
+            return true;
+        }
+        return false;
+    }
+
+    bool Is_Released(const intcptor::TInput_Buffer& buf, CInput_Delay_Stage::TClock::time_point now) {
+        return !buf.chunks.empty() && buf.chunks.front().release <= now;
+    }
+
+    bool Is_Eof_Released(const intcptor::TInput_Buffer& buf, CInput_Delay_Stage::TClock::time_point now) {
+        return buf.eof_pulled && buf.eof_release <= now;
+    }
+
+    // the earliest time the readiness of the buffer changes
+    CInput_Delay_Stage::TClock::time_point Next_Release(const intcptor::TInput_Buffer& buf) {
+        if (!buf.chunks.empty()) {
+            return buf.chunks.front().release;
+        }
+        if (buf.eof_pulled) {
+            return buf.eof_release;
+        }
+        return CInput_Delay_Stage::TClock::time_point::max();
+    }
+
+    // number of chunks (and end of stream) released so far; grows every time new data become visible
+    uint64_t Released_Seq(const intcptor::TInput_Buffer& buf, CInput_Delay_Stage::TClock::time_point now) {
+        uint64_t seq = buf.consumed_chunks;
+        for (const auto& chunk : buf.chunks) {
+            if (chunk.release > now) {
+                break;
+            }
+            seq++;
+        }
+        return seq + (Is_Eof_Released(buf, now) ? 1 : 0);
+    }
+
+    // input readiness of the buffer in poll() terms
+    short Poll_Events(const intcptor::TInput_Buffer& buf, CInput_Delay_Stage::TClock::time_point now) {
+        short events = Is_Released(buf, now) ? (POLLIN | POLLRDNORM) : 0;
+        if (Is_Eof_Released(buf, now)) {
+            events |= POLLIN | POLLRDNORM | POLLRDHUP;
+            if (buf.hup_seen) {
+                events |= POLLHUP;
+            }
+            if (buf.error) {
+                events |= POLLERR;
+            }
+        }
+        return events;
+    }
+
+    // converts the time left to given deadline to the timeout of the original call; max() means an infinite wait
+    bool Time_Left(CInput_Delay_Stage::TClock::time_point deadline, CInput_Delay_Stage::TClock::time_point now, struct timespec& ts) {
+        if (deadline == CInput_Delay_Stage::TClock::time_point::max()) {
+            return false;
+        }
+        const auto left = std::max(deadline - now, CInput_Delay_Stage::TClock::duration::zero());
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+        ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+        ts.tv_nsec = static_cast<long>(ns % 1000000000);
+        return true;
+    }
+
+    int Timeout_Ms(CInput_Delay_Stage::TClock::time_point deadline, CInput_Delay_Stage::TClock::time_point now) {
+        if (deadline == CInput_Delay_Stage::TClock::time_point::max()) {
+            return -1;
+        }
+        const auto left = std::max(deadline - now, CInput_Delay_Stage::TClock::duration::zero());
+        // round up, so the wait does not end just before the deadline
+        return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    }
+
+    CInput_Delay_Stage::TClock::time_point Deadline_After(CInput_Delay_Stage::TClock::time_point now, const struct timespec* timeout) {
+        if (!timeout) {
+            return CInput_Delay_Stage::TClock::time_point::max();
+        }
+        return now + std::chrono::seconds(timeout->tv_sec) + std::chrono::nanoseconds(timeout->tv_nsec);
+    }
+}
+
+CInput_Delay_Stage::CInput_Delay_Stage() {
+    _enabled = gConfig->Is_Recv_Delay_Enabled();
+
+    if (_enabled && gConfig->Is_Log_Enabled()) {
+        std::cout << "[[InTCPtor: starting input delay stage]]" << std::endl;
+    }
+}
+
+CInput_Delay_Stage::~CInput_Delay_Stage() {
+    // NOTE: the buffers are intentionally never freed, as other threads may still wait in intercepted calls
+}
+
+bool CInput_Delay_Stage::Is_Connected_Stream(int fd) const {
+    if (!intcptor::socket_table.Is_Tracked(fd)) {
+        return false;
+    }
+    const intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+    const uint32_t flags = state->flags.load(std::memory_order_relaxed);
+    return (flags & intcptor::Stream) && !(flags & intcptor::Listening);
+}
+
+bool CInput_Delay_Stage::Is_Delayed(int fd) const {
+    return _enabled && Is_Connected_Stream(fd);
+}
+
+bool CInput_Delay_Stage::Is_Virtualized(int fd) const {
+    if (!Is_Connected_Stream(fd)) {
+        return false;
+    }
+    // a socket, whose writability was never masked, is left to the kernel, so its epoll calls do not take any lock
+    return _enabled || (intcptor::socket_table.Find(fd)->flags.load(std::memory_order_relaxed) & intcptor::Output_Virtualized);
+}
+
+void CInput_Delay_Stage::virtualize_output(int fd) {
+    intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+    if (!state || (state->flags.fetch_or(intcptor::Output_Virtualized, std::memory_order_relaxed) & intcptor::Output_Virtualized)) {
+        return;
+    }
+
+    if (_enabled || _direct_count.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_direct_mutex);
+
+    auto itr = _direct.find(fd);
+    if (itr == _direct.end()) {
+        return;
+    }
+
+    // the registration is modified to carry the tagged fd; the kernel generates a new edge, if the socket is ready
+    for (auto& reg : itr->second) {
+        register_epoll(reg.epfd, EPOLL_CTL_MOD, fd, &reg.event);
+    }
+
+    _direct.erase(itr);
+    _direct_count.store(_direct.size(), std::memory_order_relaxed);
+}
+
+intcptor::TInput_Buffer* CInput_Delay_Stage::Get_Buffer(int fd) {
+    intcptor::TSocket_State* state = intcptor::socket_table.Get(fd);
+    if (!state) {
+        return nullptr;
+    }
+
+    intcptor::TInput_Buffer* buf = state->input_buffer.load(std::memory_order_acquire);
+    if (buf) {
+        return buf;
+    }
+
+    std::unique_lock<std::mutex> lock(_buffers_mutex);
+
+    if (!_spare_buffers.empty()) {
+        buf = _spare_buffers.back();
+        _spare_buffers.pop_back();
+    }
+    else {
+        buf = new intcptor::TInput_Buffer();
+    }
+
+    // another thread may have created the buffer in the meantime
+    intcptor::TInput_Buffer* expected = nullptr;
+    if (!state->input_buffer.compare_exchange_strong(expected, buf, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        _spare_buffers.push_back(buf);
+        return expected;
+    }
+
+    return buf;
+}
+
+intcptor::TInput_Buffer* CInput_Delay_Stage::Lock_Buffer(int fd, std::unique_lock<std::mutex>& lock) {
+    while (true) {
+        intcptor::TInput_Buffer* buf = Get_Buffer(fd);
+        if (!buf) {
+            return nullptr;
+        }
+
+        lock = std::unique_lock<std::mutex>(buf->mutex);
+
+        // the socket may have been closed (and the buffer recycled) before the mutex was taken
+        if (Is_Current(fd, buf)) {
+            return buf;
+        }
+
+        lock.unlock();
+    }
+}
+
+CInput_Delay_Stage::CBuffer_Ref CInput_Delay_Stage::Hold_Buffer(int fd, std::unique_lock<std::mutex>& lock) {
+    intcptor::TInput_Buffer* buf = Lock_Buffer(fd, lock);
+    if (!buf) {
+        return {};
+    }
+
+    buf->users++;
+    return CBuffer_Ref(this, buf);
+}
+
+void CInput_Delay_Stage::Release_Buffer(intcptor::TInput_Buffer* buf) {
+    {
+        std::unique_lock<std::mutex> lock(buf->mutex);
+        if (--buf->users > 0 || !buf->retired) {
+            return;
+        }
+        buf->retired = false;
+    }
+
+    std::unique_lock<std::mutex> lock(_buffers_mutex);
+    _spare_buffers.push_back(buf);
+}
+
+bool CInput_Delay_Stage::Is_Current(int fd, const intcptor::TInput_Buffer* buf) {
+    const intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+    return state && state->input_buffer.load(std::memory_order_acquire) == buf;
+}
+
+void CInput_Delay_Stage::Update_Pending(int fd, intcptor::TInput_Buffer& buf) {
+    const bool pending = !buf.chunks.empty() || buf.eof_pulled;
+    if (pending == buf.pending) {
+        return;
+    }
+
+    buf.pending = pending;
+
+    std::unique_lock<std::mutex> lock(_pending_mutex);
+    if (pending) {
+        _pending.insert(fd);
+    }
+    else {
+        _pending.erase(fd);
+    }
+}
+
+void CInput_Delay_Stage::Pull(int fd, intcptor::TInput_Buffer& buf) {
+    if (buf.eof_pulled) {
+        return;
+    }
+
+    // the caller must not see errno of the internal calls
+    const int saved_errno = errno;
+
+    thread_local char scratch[65536];
+
+    while (buf.buffered < Buffer_Limit) {
+        const size_t want = std::min(sizeof(scratch), Buffer_Limit - buf.buffered);
+        const ssize_t res = orig::recv(fd, scratch, want, MSG_DONTWAIT);
+
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOTCONN)) {
+            break;
+        }
+
+        // every piece of data is released after its own delay, but never before the data received earlier
+        const double delay = std::max(0.0, gConfig->Generate_Recv_Delay(fd));
+        auto release = TClock::now() + std::chrono::microseconds(static_cast<int64_t>(delay * 1000.0));
+        if (release < buf.last_release) {
+            release = buf.last_release;
+        }
+        buf.last_release = release;
+
+        if (res <= 0) {
+            // end of stream or error; both are reported after all the data received before
+            buf.eof_pulled = true;
+            buf.eof_release = release;
+            buf.error = res < 0 ? errno : 0;
+            break;
+        }
+
+        intcptor::TPayload_Block* block = intcptor::CPayload_Pool::Allocate(static_cast<size_t>(res));
+        std::memcpy(block->Data(), scratch, static_cast<size_t>(res));
+        buf.chunks.push_back({ intcptor::CPayload_Slice(block, 0, static_cast<size_t>(res)), 0, release });
+        buf.buffered += static_cast<size_t>(res);
+
+        if (gConfig->Is_Log_Enabled()) {
+            intcptor::Log(intcptor::NLog_Event::Recv_Delayed, fd, res, static_cast<int64_t>(delay));
+        }
+
+        intcptor::Stat(intcptor::NStat::Held_Bytes, static_cast<uint64_t>(res));
+        intcptor::Stat_Histogram(intcptor::NHistogram::Recv_Delay_Ms, static_cast<uint64_t>(delay));
+
+        // the kernel had less than requested, so there is nothing more to read
+        if (static_cast<size_t>(res) < want) {
+            break;
+        }
+    }
+
+    Update_Pending(fd, buf);
+
+    errno = saved_errno;
+}
+
+size_t CInput_Delay_Stage::Take(int fd, intcptor::TInput_Buffer& buf, const struct iovec* iov, size_t iovcnt, size_t offset, bool peek, TClock::time_point now) {
+    size_t copied = 0;
+
+    // position in the segments
+    size_t seg = 0;
+    size_t seg_pos = offset;
+    while (seg < iovcnt && seg_pos >= iov[seg].iov_len) {
+        seg_pos -= iov[seg].iov_len;
+        seg++;
+    }
+
+    for (auto itr = buf.chunks.begin(); itr != buf.chunks.end() && itr->release <= now && seg < iovcnt; ) {
+        size_t chunk_pos = itr->consumed;
+
+        while (chunk_pos < itr->data.size() && seg < iovcnt) {
+            const size_t n = std::min(itr->data.size() - chunk_pos, iov[seg].iov_len - seg_pos);
+            std::memcpy(static_cast<char*>(iov[seg].iov_base) + seg_pos, itr->data.data() + chunk_pos, n);
+            chunk_pos += n;
+            seg_pos += n;
+            copied += n;
+            if (seg_pos == iov[seg].iov_len) {
+                seg++;
+                seg_pos = 0;
+            }
+        }
+
+        if (peek) {
+            ++itr;
+            continue;
+        }
+
+        buf.buffered -= chunk_pos - itr->consumed;
+        itr->consumed = chunk_pos;
+        if (chunk_pos < itr->data.size()) {
+            break;
+        }
+
+        itr = buf.chunks.erase(itr);
+        buf.consumed_chunks++;
+    }
+
+    if (!peek) {
+        Update_Pending(fd, buf);
+        intcptor::Stat(intcptor::NStat::Released_Bytes, copied);
+    }
+
+    return copied;
+}
+
+ssize_t CInput_Delay_Stage::receive(int fd, const struct iovec* iov, size_t iovcnt, int flags) {
+    // the buffer is kept while the call sleeps, so it is not handed over to another socket; the reference is declared
+    // first, so it is dropped after the lock
+    CBuffer_Ref ref;
+    std::unique_lock<std::mutex> lock;
+    ref = Hold_Buffer(fd, lock);
+    if (!ref) {
+        errno = EBADF;
+        return -1;
+    }
+    intcptor::TInput_Buffer* buf = ref.get();
+
+    size_t capacity = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        capacity += iov[i].iov_len;
+    }
+
+    const bool peek = (flags & MSG_PEEK);
+    const bool wait_all = (flags & MSG_WAITALL) && !peek;
+
+    // found out only when there is nothing to return right away
+    int nonblocking = (flags & MSG_DONTWAIT) ? 1 : -1;
+    TClock::time_point deadline = TClock::time_point::max();
+
+    size_t total = 0;
+
+    while (true) {
+        Pull(fd, *buf);
+
+        const auto now = TClock::now();
+
+        const bool was_full = buf->buffered >= Buffer_Limit;
+
+        total += Take(fd, *buf, iov, iovcnt, total, peek, now);
+
+        // the kernel was not asked for more input while the buffer was full; continue pulling right away, as the
+        // application may not read until EAGAIN
+        if (was_full && !peek) {
+            Pull(fd, *buf);
+        }
+
+        if (total == capacity || (total > 0 && !wait_all)) {
+            return static_cast<ssize_t>(total);
+        }
+
+        if (buf->chunks.empty() && Is_Eof_Released(*buf, now)) {
+            if (total > 0) {
+                return static_cast<ssize_t>(total);
+            }
+            // the error is reported just once, like the kernel does; then the socket reads as closed
+            if (buf->error) {
+                errno = std::exchange(buf->error, 0);
+                return -1;
+            }
+            return 0;
+        }
+
+        if (nonblocking < 0) {
+            nonblocking = (::fcntl(fd, F_GETFL) & O_NONBLOCK) ? 1 : 0;
+
+            // honor the receive timeout of blocking sockets
+            struct timeval tv {};
+            socklen_t tvlen = sizeof(tv);
+            if (!nonblocking && ::getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &tvlen) == 0 && (tv.tv_sec > 0 || tv.tv_usec > 0)) {
+                deadline = now + std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+            }
+        }
+
+        if (nonblocking || now >= deadline) {
+            if (total > 0) {
+                return static_cast<ssize_t>(total);
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+
+        const auto wake = std::min(Next_Release(*buf), deadline);
+        const bool has_pending = Next_Release(*buf) != TClock::time_point::max();
+
+        lock.unlock();
+
+        if (has_pending) {
+            std::this_thread::sleep_until(wake);
+        }
+        else {
+            // nothing pulled yet, wait for the kernel to receive something
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            orig::poll(&pfd, 1, Timeout_Ms(wake, TClock::now()));
+        }
+
+        lock.lock();
+
+        // the socket was closed by another thread meanwhile
+        if (!Is_Current(fd, buf)) {
+            if (total > 0) {
+                return static_cast<ssize_t>(total);
+            }
+            errno = EBADF;
+            return -1;
+        }
+    }
+}
+
+int CInput_Delay_Stage::readable_bytes(int fd) {
+    std::unique_lock<std::mutex> lock;
+    intcptor::TInput_Buffer* buf = Lock_Buffer(fd, lock);
+    if (!buf) {
+        return 0;
+    }
+
+    Pull(fd, *buf);
+
+    const auto now = TClock::now();
+
+    size_t bytes = 0;
+    for (const auto& chunk : buf->chunks) {
+        if (chunk.release > now) {
+            break;
+        }
+        bytes += chunk.data.size() - chunk.consumed;
+    }
+
+    return static_cast<int>(std::min<size_t>(bytes, std::numeric_limits<int>::max()));
+}
+
+int CInput_Delay_Stage::wait_poll(struct pollfd* fds, nfds_t nfds, const struct timespec* timeout, const sigset_t* sigmask) {
+    const TClock::time_point deadline = Deadline_After(TClock::now(), timeout);
+
+    std::vector<struct pollfd> kfds(fds, fds + nfds);
+    std::vector<short> virtual_events(nfds);
+    // the buffers are kept while the call waits in the kernel
+    std::vector<CBuffer_Ref> buffers(nfds);
+
+    while (true) {
+        auto now = TClock::now();
+        TClock::time_point wake = deadline;
+        int ready = 0;
+
+        for (nfds_t i = 0; i < nfds; i++) {
+            const int fd = fds[i].fd;
+
+            kfds[i] = fds[i];
+            kfds[i].revents = 0;
+            virtual_events[i] = 0;
+            buffers[i].Reset();
+
+            if (fd < 0) {
+                continue;
+            }
+
+            if ((fds[i].events & Poll_Input_Events) && Is_Delayed(fd)) {
+                std::unique_lock<std::mutex> lock;
+                buffers[i] = Hold_Buffer(fd, lock);
+                if (!buffers[i]) {
+                    continue;
+                }
+
+                virtual_events[i] = Poll_Events(*buffers[i], now) & (fds[i].events | POLLHUP | POLLERR);
+                if (!virtual_events[i]) {
+                    wake = std::min(wake, Next_Release(*buffers[i]));
+                }
+
+                if (buffers[i]->hup_seen) {
+                    // the kernel would report the hang-up over and over again
+                    kfds[i].fd = -1;
+                }
+                else if (buffers[i]->eof_pulled || buffers[i]->buffered >= Buffer_Limit) {
+                    kfds[i].events &= ~Poll_Input_Events;
+                }
+            }
+
+            if ((fds[i].events & Poll_Output_Events) && Is_Output_Masked(fd, now, wake)) {
+                kfds[i].events &= ~Poll_Output_Events;
+            }
+
+            if (virtual_events[i]) {
+                ready++;
+            }
+        }
+
+        // when something is ready already, just collect the state of other descriptors without waiting
+        struct timespec ts {};
+        const bool timed = ready > 0 || Time_Left(wake, now, ts);
+
+        const int res = orig::ppoll(kfds.data(), nfds, timed ? &ts : nullptr, sigmask);
+        if (res < 0) {
+            if (ready == 0) {
+                return -1;
+            }
+            for (auto& kfd : kfds) {
+                kfd.revents = 0;
+            }
+        }
+
+        now = TClock::now();
+
+        int count = 0;
+        for (nfds_t i = 0; i < nfds; i++) {
+            short revents = kfds[i].fd < 0 ? 0 : kfds[i].revents;
+
+            std::unique_lock<std::mutex> lock;
+            if (buffers[i]) {
+                lock = std::unique_lock<std::mutex>(buffers[i]->mutex);
+                // the socket was closed by another thread while waiting; the kernel result is reported as it is
+                if (!Is_Current(fds[i].fd, buffers[i].get())) {
+                    lock.unlock();
+                    buffers[i].Reset();
+                }
+            }
+
+            if (buffers[i]) {
+                if (revents & (Poll_Input_Events | POLLHUP | POLLERR)) {
+                    if (revents & (POLLHUP | POLLERR)) {
+                        buffers[i]->hup_seen = true;
+                    }
+                    Pull(fds[i].fd, *buffers[i]);
+                    virtual_events[i] = Poll_Events(*buffers[i], now) & (fds[i].events | POLLHUP | POLLERR);
+                }
+
+                // the input readiness is given by the buffer only
+                revents = static_cast<short>((revents & ~(Poll_Input_Events | POLLHUP | POLLERR)) | virtual_events[i]);
+            }
+
+            fds[i].revents = revents;
+            if (revents) {
+                count++;
+            }
+        }
+
+        if (count > 0 || now >= deadline) {
+            return count;
+        }
+    }
+}
+
+int CInput_Delay_Stage::wait_select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout) {
+    std::vector<struct pollfd> pfds;
+
+    for (int fd = 0; fd < nfds; fd++) {
+        short events = 0;
+        if (readfds && FD_ISSET(fd, readfds)) {
+            events |= POLLIN;
+        }
+        if (writefds && FD_ISSET(fd, writefds)) {
+            events |= POLLOUT;
+        }
+        if (exceptfds && FD_ISSET(fd, exceptfds)) {
+            events |= POLLPRI;
+        }
+        if (events) {
+            pfds.push_back({ fd, events, 0 });
+        }
+    }
+
+    const auto start = TClock::now();
+
+    struct timespec ts {};
+    if (timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+    }
+
+    const int res = wait_poll(pfds.data(), pfds.size(), timeout ? &ts : nullptr, nullptr);
+    if (res < 0) {
+        return -1;
+    }
+
+    for (const auto& pfd : pfds) {
+        if (pfd.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    int count = 0;
+    for (const auto& pfd : pfds) {
+        if (readfds && FD_ISSET(pfd.fd, readfds)) {
+            if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+                count++;
+            }
+            else {
+                FD_CLR(pfd.fd, readfds);
+            }
+        }
+        if (writefds && FD_ISSET(pfd.fd, writefds)) {
+            if (pfd.revents & (POLLOUT | POLLERR)) {
+                count++;
+            }
+            else {
+                FD_CLR(pfd.fd, writefds);
+            }
+        }
+        if (exceptfds && FD_ISSET(pfd.fd, exceptfds)) {
+            if (pfd.revents & POLLPRI) {
+                count++;
+            }
+            else {
+                FD_CLR(pfd.fd, exceptfds);
+            }
+        }
+    }
+
+    // like the Linux select(), leave the time not slept in the timeout
+    if (timeout) {
+        const auto total = std::chrono::seconds(timeout->tv_sec) + std::chrono::microseconds(timeout->tv_usec);
+        const auto left = std::max<TClock::duration>(total - (TClock::now() - start), TClock::duration::zero());
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(left).count();
+        timeout->tv_sec = static_cast<time_t>(us / 1000000);
+        timeout->tv_usec = static_cast<suseconds_t>(us % 1000000);
+    }
+
+    return count;
+}
+
+void CInput_Delay_Stage::Sync_Kernel_Events(int epfd, int fd, TEpoll_Registration& reg, const intcptor::TInput_Buffer* buf) {
+    if (!reg.in_kernel) {
+        return;
+    }
+
+    // hang-up is reported regardless of the registered events, so the only way to hide it is to drop the registration
+    if (buf && buf->hup_seen) {
+        orig::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        reg.in_kernel = false;
+        return;
+    }
+
+    uint32_t events = reg.disabled ? 0 : reg.event.events;
+    if (buf && (buf->eof_pulled || buf->buffered >= Buffer_Limit)) {
+        events &= ~Epoll_Input_Events;
+    }
+    if (reg.out_masked) {
+        events &= ~Epoll_Output_Events;
+    }
+
+    if (events == reg.kernel_events) {
+        return;
+    }
+
+    struct epoll_event kevent {};
+    kevent.events = events;
+    kevent.data.u64 = Epoll_Tag | static_cast<uint32_t>(fd);
+
+    orig::epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &kevent);
+    reg.kernel_events = events;
+}
+
+uint32_t CInput_Delay_Stage::Input_Events(TEpoll_Registration& reg, intcptor::TInput_Buffer& buf, TClock::time_point now) {
+    const uint32_t wanted = reg.event.events;
+    if (!(wanted & Epoll_Input_Events)) {
+        return 0;
+    }
+
+    uint32_t events = static_cast<uint16_t>(Poll_Events(buf, now)) & (wanted | EPOLLHUP | EPOLLERR);
+    if (!events) {
+        return 0;
+    }
+
+    // edge-triggered registration reports only newly released data
+    if (wanted & EPOLLET) {
+        const uint64_t seq = Released_Seq(buf, now);
+        if (seq <= reg.reported_seq) {
+            return 0;
+        }
+        reg.reported_seq = seq;
+    }
+
+    return events;
+}
+
+int CInput_Delay_Stage::register_epoll(int epfd, int op, int fd, struct epoll_event* event) {
+    std::unique_lock<std::mutex> lock(_epoll_mutex);
+
+    if (op == EPOLL_CTL_DEL) {
+        auto set_itr = _epoll_sets.find(epfd);
+        if (set_itr != _epoll_sets.end()) {
+            auto reg_itr = set_itr->second.registrations.find(fd);
+            if (reg_itr != set_itr->second.registrations.end()) {
+                const bool in_kernel = reg_itr->second.in_kernel;
+                set_itr->second.registrations.erase(reg_itr);
+                set_itr->second.out_masked.erase(fd);
+                if (!in_kernel) {
+                    return 0;
+                }
+            }
+        }
+        return orig::epoll_ctl(epfd, op, fd, event);
+    }
+
+    // exclusive wakeups can't be modified later, so such registrations are left as they are
+    if (!event || (event->events & EPOLLEXCLUSIVE) || (op != EPOLL_CTL_ADD && op != EPOLL_CTL_MOD)) {
+        return orig::epoll_ctl(epfd, op, fd, event);
+    }
+
+    TEpoll_Set& set = _epoll_sets[epfd];
+    _epoll_set_count.store(_epoll_sets.size(), std::memory_order_relaxed);
+
+    auto reg_itr = set.registrations.find(fd);
+
+    if (op == EPOLL_CTL_MOD && reg_itr != set.registrations.end() && !reg_itr->second.in_kernel) {
+        // the kernel registration was dropped after hang-up; the readiness is fully virtual now
+        reg_itr->second.event = *event;
+        reg_itr->second.disabled = false;
+        return 0;
+    }
+
+    TEpoll_Registration reg;
+    reg.event = *event;
+    reg.kernel_events = event->events;
+    if (reg_itr != set.registrations.end()) {
+        reg.reported_seq = reg_itr->second.reported_seq;
+    }
+
+    struct epoll_event kevent {};
+    kevent.events = event->events;
+    kevent.data.u64 = Epoll_Tag | static_cast<uint32_t>(fd);
+
+    const int res = orig::epoll_ctl(epfd, op, fd, &kevent);
+    if (res < 0) {
+        return res;
+    }
+
+    set.registrations[fd] = reg;
+    set.out_masked.erase(fd);
+
+    return 0;
+}
+
+int CInput_Delay_Stage::register_direct(int epfd, int op, int fd, struct epoll_event* event) {
+    std::unique_lock<std::mutex> lock(_direct_mutex);
+
+    // the socket was virtualized meanwhile
+    if (Is_Virtualized(fd)) {
+        lock.unlock();
+        return register_epoll(epfd, op, fd, event);
+    }
+
+    const int res = orig::epoll_ctl(epfd, op, fd, event);
+    if (res < 0) {
+        return res;
+    }
+
+    auto& regs = _direct[fd];
+    auto itr = std::find_if(regs.begin(), regs.end(), [epfd](const TDirect_Registration& reg) { return reg.epfd == epfd; });
+
+    if (op == EPOLL_CTL_DEL) {
+        if (itr != regs.end()) {
+            regs.erase(itr);
+        }
+    }
+    // exclusive wakeups can't be modified later, so such registrations are never converted
+    else if (event && !(event->events & EPOLLEXCLUSIVE)) {
+        if (itr != regs.end()) {
+            itr->event = *event;
+        }
+        else {
+            regs.push_back({ epfd, *event });
+        }
+    }
+
+    if (regs.empty()) {
+        _direct.erase(fd);
+    }
+    _direct_count.store(_direct.size(), std::memory_order_relaxed);
+
+    return res;
+}
+
+int CInput_Delay_Stage::wait_epoll(int epfd, struct epoll_event* events, int maxevents, int timeout_ms, const sigset_t* sigmask) {
+    if (maxevents <= 0 || _epoll_set_count.load(std::memory_order_relaxed) == 0) {
+        return orig::epoll_pwait(epfd, events, maxevents, timeout_ms, sigmask);
+    }
+
+    const TClock::time_point deadline = timeout_ms < 0 ? TClock::time_point::max() : TClock::now() + std::chrono::milliseconds(timeout_ms);
+
+    thread_local std::vector<int> pending;
+    thread_local std::vector<struct epoll_event> kevents;
+    // index of the output event of each virtualized socket reported by this call, so the events are merged
+    thread_local std::unordered_map<int, int> reported;
+
+    while (true) {
+        auto now = TClock::now();
+        TClock::time_point wake = deadline;
+        int count = 0;
+
+        reported.clear();
+
+        {
+            std::unique_lock<std::mutex> lock(_epoll_mutex);
+
+            auto set_itr = _epoll_sets.find(epfd);
+            if (set_itr == _epoll_sets.end()) {
+                lock.unlock();
+                return orig::epoll_pwait(epfd, events, maxevents, Timeout_Ms(deadline, now), sigmask);
+            }
+            TEpoll_Set& set = set_itr->second;
+
+            // sockets with buffered data may become readable without any kernel event
+            {
+                std::unique_lock<std::mutex> pending_lock(_pending_mutex);
+                pending.assign(_pending.begin(), _pending.end());
+            }
+
+            for (const int fd : pending) {
+                auto reg_itr = set.registrations.find(fd);
+                if (reg_itr == set.registrations.end() || reg_itr->second.disabled) {
+                    continue;
+                }
+                TEpoll_Registration& reg = reg_itr->second;
+
+                std::unique_lock<std::mutex> buf_lock;
+                intcptor::TInput_Buffer* buf = Lock_Buffer(fd, buf_lock);
+                if (!buf) {
+                    continue;
+                }
+
+                // the kernel is not asked for more input while the buffer is full, so refill it here
+                if (buf->buffered >= Buffer_Limit / 2) {
+                    Pull(fd, *buf);
+                }
+
+                const uint32_t input = count < maxevents ? Input_Events(reg, *buf, now) : 0;
+                if (input) {
+                    events[count].events = input;
+                    events[count].data = reg.event.data;
+                    reported[fd] = count;
+                    count++;
+                }
+                else if (!Is_Released(*buf, now)) {
+                    wake = std::min(wake, Next_Release(*buf));
+                }
+
+                Sync_Kernel_Events(epfd, fd, reg, buf);
+            }
+
+            // sockets with masked writability become writable once the output queue drains (or the handshake completes)
+            for (auto itr = set.out_masked.begin(); itr != set.out_masked.end(); ) {
+                auto reg_itr = set.registrations.find(*itr);
+                if (reg_itr == set.registrations.end()) {
+                    itr = set.out_masked.erase(itr);
+                    continue;
+                }
+                if (Is_Output_Masked(*itr, now, wake)) {
+                    ++itr;
+                    continue;
+                }
+
+                // re-adding the events to the kernel registration generates a new edge, if the socket is writable
+                reg_itr->second.out_masked = false;
+
+                intcptor::TInput_Buffer* buf = intcptor::socket_table.Find(*itr)->input_buffer.load(std::memory_order_acquire);
+                std::unique_lock<std::mutex> buf_lock;
+                if (buf) {
+                    buf_lock = std::unique_lock<std::mutex>(buf->mutex);
+                    // the socket was closed meanwhile, the buffer may belong to another socket already
+                    if (!Is_Current(*itr, buf)) {
+                        buf_lock.unlock();
+                        buf = nullptr;
+                    }
+                }
+                Sync_Kernel_Events(epfd, *itr, reg_itr->second, buf);
+
+                itr = set.out_masked.erase(itr);
+            }
+        }
+
+        if (count >= maxevents) {
+            return count;
+        }
+
+        kevents.resize(static_cast<size_t>(maxevents - count));
+
+        const int res = orig::epoll_pwait(epfd, kevents.data(), maxevents - count, count > 0 ? 0 : Timeout_Ms(wake, now), sigmask);
+        if (res < 0) {
+            return count > 0 ? count : -1;
+        }
+
+        now = TClock::now();
+
+        {
+            std::unique_lock<std::mutex> lock(_epoll_mutex);
+
+            auto set_itr = _epoll_sets.find(epfd);
+
+            for (int i = 0; i < res; i++) {
+                const struct epoll_event& kevent = kevents[i];
+
+                if ((kevent.data.u64 & Epoll_Tag_Mask) != Epoll_Tag) {
+                    events[count++] = kevent;
+                    continue;
+                }
+
+                const int fd = static_cast<int>(kevent.data.u64 & ~Epoll_Tag_Mask);
+                if (set_itr == _epoll_sets.end()) {
+                    continue;
+                }
+                auto reg_itr = set_itr->second.registrations.find(fd);
+                if (reg_itr == set_itr->second.registrations.end()) {
+                    // registration removed while waiting
+                    continue;
+                }
+                TEpoll_Registration& reg = reg_itr->second;
+
+                // one-shot registration was disabled by the kernel with this event
+                if (reg.event.events & EPOLLONESHOT) {
+                    reg.kernel_events = 0;
+                }
+
+                uint32_t revents = kevent.events;
+                intcptor::TInput_Buffer* buf = nullptr;
+                std::unique_lock<std::mutex> buf_lock;
+
+                if (Is_Delayed(fd)) {
+                    buf = Lock_Buffer(fd, buf_lock);
+                }
+
+                if (buf) {
+                    if (revents & (Epoll_Input_Events | EPOLLHUP | EPOLLERR)) {
+                        if (revents & (EPOLLHUP | EPOLLERR)) {
+                            buf->hup_seen = true;
+                        }
+                        Pull(fd, *buf);
+                    }
+
+                    // the input readiness is given by the buffer only
+                    revents &= ~(Epoll_Input_Events | EPOLLHUP | EPOLLERR);
+                    if (!reported.count(fd) && !reg.disabled) {
+                        revents |= Input_Events(reg, *buf, now);
+                    }
+                }
+
+                if ((revents & Epoll_Output_Events) && Is_Output_Masked(fd, now, wake)) {
+                    revents &= ~Epoll_Output_Events;
+                    reg.out_masked = true;
+                    set_itr->second.out_masked.insert(fd);
+                }
+
+                if (revents && !reg.disabled) {
+                    auto rep_itr = reported.find(fd);
+                    if (rep_itr != reported.end()) {
+                        events[rep_itr->second].events |= revents;
+                    }
+                    else {
+                        events[count].events = revents;
+                        events[count].data = reg.event.data;
+                        reported[fd] = count;
+                        count++;
+                    }
+                }
+
+                Sync_Kernel_Events(epfd, fd, reg, buf);
+            }
+
+            // one-shot registrations are disabled once they report anything
+            if (set_itr != _epoll_sets.end()) {
+                for (const auto& rep : reported) {
+                    auto reg_itr = set_itr->second.registrations.find(rep.first);
+                    if (reg_itr != set_itr->second.registrations.end() && (reg_itr->second.event.events & EPOLLONESHOT)) {
+                        reg_itr->second.disabled = true;
+                        Sync_Kernel_Events(epfd, rep.first, reg_itr->second, nullptr);
+                    }
+                }
+            }
+        }
+
+        if (count > 0 || now >= deadline) {
+            return count;
+        }
+    }
+}
+
+void CInput_Delay_Stage::forget(int fd) {
+    if (intcptor::TSocket_State* state = intcptor::socket_table.Find(fd)) {
+        if (intcptor::TInput_Buffer* buf = state->input_buffer.exchange(nullptr, std::memory_order_acq_rel)) {
+            bool recycle = true;
+            {
+                std::unique_lock<std::mutex> lock(buf->mutex);
+                // data never taken by the application are released as well, so the held level returns to zero
+                intcptor::Stat(intcptor::NStat::Released_Bytes, buf->buffered);
+                buf->chunks.clear();
+                buf->buffered = 0;
+                buf->last_release = {};
+                buf->consumed_chunks = 0;
+                buf->eof_pulled = false;
+                buf->error = 0;
+                buf->hup_seen = false;
+                if (buf->pending) {
+                    buf->pending = false;
+                    std::unique_lock<std::mutex> pending_lock(_pending_mutex);
+                    _pending.erase(fd);
+                }
+
+                // a receiver or waiter still keeps the buffer; the last one recycles it
+                if (buf->users > 0) {
+                    buf->retired = true;
+                    recycle = false;
+                }
+            }
+
+            if (recycle) {
+                std::unique_lock<std::mutex> lock(_buffers_mutex);
+                _spare_buffers.push_back(buf);
+            }
+        }
+    }
+
+    if (_direct_count.load(std::memory_order_relaxed) > 0) {
+        std::unique_lock<std::mutex> lock(_direct_mutex);
+        if (_direct.erase(fd) > 0) {
+            _direct_count.store(_direct.size(), std::memory_order_relaxed);
+        }
+    }
+
+    if (_epoll_set_count.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_epoll_mutex);
+
+    // the fd may be an epoll instance itself
+    _epoll_sets.erase(fd);
+    _epoll_set_count.store(_epoll_sets.size(), std::memory_order_relaxed);
+
+    for (auto& set : _epoll_sets) {
+        set.second.registrations.erase(fd);
+        set.second.out_masked.erase(fd);
+    }
+}
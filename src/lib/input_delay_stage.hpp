@@ -0,0 +1,250 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the input delay stage, that holds received data until their release time, and the readiness
+ * virtualization of poll(), select() and epoll, so the application is notified only about the released data.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <atomic>
+#include <utility>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+#include "payload_pool.hpp"
+#include "socket_table.hpp"
+
+namespace intcptor {
+
+    // received data of a single socket, that were already pulled from the kernel, but not released to the application yet
+    struct TInput_Buffer {
+        using TClock = std::chrono::steady_clock;
+
+        struct TChunk {
+            CPayload_Slice data;
+            size_t consumed;
+            // absolute time, when the chunk becomes visible to the application
+            TClock::time_point release;
+        };
+
+        std::mutex mutex;
+        // chunks in the order of their arrival; release times never decrease, so the released chunks are always at front
+        std::deque<TChunk> chunks;
+        // bytes held in the chunks and not consumed yet
+        size_t buffered = 0;
+        // release time of the last chunk, so the newer data never overtake the older ones
+        TClock::time_point last_release{};
+        // number of chunks fully consumed so far; with the number of released chunks, this forms a sequence number used
+        // to generate edges for edge-triggered epoll
+        uint64_t consumed_chunks = 0;
+
+        // end of stream (or error) was pulled from the kernel; it is released after all chunks
+        bool eof_pulled = false;
+        TClock::time_point eof_release{};
+        // error to be reported instead of the end of stream (0 = clean end of stream)
+        int error = 0;
+        // the kernel reported hang-up or error condition; the socket can't be waited for in the kernel anymore
+        bool hup_seen = false;
+        // the buffer is listed among the sockets with pending data
+        bool pending = false;
+
+        // receivers and waiters, that keep the buffer while its mutex is unlocked; the buffer is not reused while any is left
+        uint32_t users = 0;
+        // the socket was closed while the buffer was in use; the last user returns it to the spare buffers
+        bool retired = false;
+    };
+}
+
+class CInput_Delay_Stage {
+    public:
+        using TClock = std::chrono::steady_clock;
+
+        // maximum bytes held for a single socket; the rest stays in the kernel, so the TCP flow control slows the peer down
+        static constexpr size_t Buffer_Limit = 4 * 1024 * 1024;
+        // how often a waiting call re-checks sockets, whose writability is masked because of the output queue budget
+        static constexpr std::chrono::milliseconds Send_Blocked_Recheck{ 10 };
+
+        CInput_Delay_Stage();
+
+        virtual ~CInput_Delay_Stage();
+
+        // is the receive delay configured at all?
+        bool Is_Enabled() const { return _enabled; }
+
+        // does the received data of the fd pass through the stage? (connected stream sockets only)
+        bool Is_Delayed(int fd) const;
+
+        // is the fd a connected stream socket? (only these have their readiness virtualized)
+        bool Is_Connected_Stream(int fd) const;
+
+        // is the fd a socket, whose readiness must be virtualized in epoll? (all connected stream sockets, if the input is
+        // delayed; otherwise only those, whose writability was masked at least once)
+        bool Is_Virtualized(int fd) const;
+
+        // called when the writability of the socket gets masked (by the output queue budget, or by a simulated handshake);
+        // from now on, the socket is virtualized, and its plain epoll registrations are converted
+        void virtualize_output(int fd);
+
+        // reads released data to the segments; behaves like recv() with given flags (MSG_PEEK, MSG_WAITALL and
+        // MSG_DONTWAIT are honored, other flags are ignored)
+        ssize_t receive(int fd, const struct iovec* iov, size_t iovcnt, int flags);
+
+        // number of released bytes, i.e., the FIONREAD value
+        int readable_bytes(int fd);
+
+        // poll()/ppoll() with virtualized readiness; timeout is nullptr for infinite wait
+        int wait_poll(struct pollfd* fds, nfds_t nfds, const struct timespec* timeout, const sigset_t* sigmask);
+
+        // select() with virtualized readiness, implemented on top of wait_poll()
+        int wait_select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout);
+
+        // epoll_ctl() of a virtualized socket; the kernel registration carries the fd instead of the application data
+        int register_epoll(int epfd, int op, int fd, struct epoll_event* event);
+
+        // epoll_ctl() of a connected stream socket, that is not virtualized (yet); the kernel registration is left as it
+        // is, but it is remembered, so virtualize_output() can convert it
+        int register_direct(int epfd, int op, int fd, struct epoll_event* event);
+
+        // epoll_wait()/epoll_pwait() with virtualized readiness
+        int wait_epoll(int epfd, struct epoll_event* events, int maxevents, int timeout_ms, const sigset_t* sigmask);
+
+        // drops everything known about the fd - its buffer, its epoll registrations and its epoll set (if it is an epoll fd)
+        void forget(int fd);
+
+    private:
+        // registration of a virtualized socket in an epoll set
+        struct TEpoll_Registration {
+            // events and data as requested by the application
+            struct epoll_event event;
+            // events currently registered in the kernel
+            uint32_t kernel_events = 0;
+            bool in_kernel = true;
+            // EPOLLONESHOT registration already fired
+            bool disabled = false;
+            // writability is hidden, as the socket is over the output queue budget
+            bool out_masked = false;
+            // sequence number (see TInput_Buffer::consumed_chunks) reported last time; for edge-triggered registrations
+            uint64_t reported_seq = 0;
+        };
+
+        struct TEpoll_Set {
+            std::unordered_map<int, TEpoll_Registration> registrations;
+            // sockets with masked writability, to be re-checked by every wait
+            std::unordered_set<int> out_masked;
+        };
+
+        // reference to a buffer, that keeps it from being reused for another socket; after every re-lock of the buffer
+        // mutex, the holder must check the buffer still belongs to the fd (see Is_Current)
+        class CBuffer_Ref {
+            public:
+                CBuffer_Ref() = default;
+
+                CBuffer_Ref(CInput_Delay_Stage* stage, intcptor::TInput_Buffer* buf) : _stage(stage), _buf(buf) {
+                }
+
+                CBuffer_Ref(const CBuffer_Ref&) = delete;
+                CBuffer_Ref& operator=(const CBuffer_Ref&) = delete;
+
+                CBuffer_Ref(CBuffer_Ref&& other) noexcept : _stage(other._stage), _buf(std::exchange(other._buf, nullptr)) {
+                }
+
+                CBuffer_Ref& operator=(CBuffer_Ref&& other) noexcept {
+                    if (this != &other) {
+                        Reset();
+                        _stage = other._stage;
+                        _buf = std::exchange(other._buf, nullptr);
+                    }
+                    return *this;
+                }
+
+                ~CBuffer_Ref() {
+                    Reset();
+                }
+
+                // drops the reference; the buffer mutex must not be held by the caller
+                void Reset() {
+                    if (_buf) {
+                        _stage->Release_Buffer(std::exchange(_buf, nullptr));
+                    }
+                }
+
+                intcptor::TInput_Buffer* get() const { return _buf; }
+                intcptor::TInput_Buffer& operator*() const { return *_buf; }
+                intcptor::TInput_Buffer* operator->() const { return _buf; }
+                explicit operator bool() const { return _buf != nullptr; }
+
+            private:
+                CInput_Delay_Stage* _stage = nullptr;
+                intcptor::TInput_Buffer* _buf = nullptr;
+        };
+
+        // returns the buffer of given fd, creates it if needed
+        intcptor::TInput_Buffer* Get_Buffer(int fd);
+
+        // returns the current buffer of given fd (creates it if needed) with its mutex locked by the given lock; nullptr if
+        // the fd is out of range
+        intcptor::TInput_Buffer* Lock_Buffer(int fd, std::unique_lock<std::mutex>& lock);
+
+        // like Lock_Buffer, and takes a reference, so the buffer may be used after the mutex is unlocked
+        CBuffer_Ref Hold_Buffer(int fd, std::unique_lock<std::mutex>& lock);
+
+        // drops a reference taken by Hold_Buffer; recycles the buffer, if its socket was closed meanwhile
+        void Release_Buffer(intcptor::TInput_Buffer* buf);
+
+        // does the buffer still belong to the fd (it was not dropped by forget)? buffer mutex must be held
+        static bool Is_Current(int fd, const intcptor::TInput_Buffer* buf);
+
+        // moves all data available in the kernel to the buffer (without blocking); buffer mutex must be held
+        void Pull(int fd, intcptor::TInput_Buffer& buf);
+
+        // copies released data to the segments at given offset of the logical stream; consumes them unless peek is set
+        size_t Take(int fd, intcptor::TInput_Buffer& buf, const struct iovec* iov, size_t iovcnt, size_t offset, bool peek, TClock::time_point now);
+
+        // updates the list of buffers with pending data after the buffer contents changed; buffer mutex must be held
+        void Update_Pending(int fd, intcptor::TInput_Buffer& buf);
+
+        // computes events, that should be registered in the kernel, and updates the kernel registration accordingly;
+        // must be called with _epoll_mutex held
+        void Sync_Kernel_Events(int epfd, int fd, TEpoll_Registration& reg, const intcptor::TInput_Buffer* buf);
+
+        // virtual input readiness of a registration (EPOLLIN and related bits), or 0; buffer mutex must be held
+        uint32_t Input_Events(TEpoll_Registration& reg, intcptor::TInput_Buffer& buf, TClock::time_point now);
+
+        bool _enabled = false;
+
+        std::mutex _buffers_mutex;
+        std::vector<intcptor::TInput_Buffer*> _spare_buffers;
+
+        // fds of buffers with pending data (or end of stream); only these can become readable without a kernel event
+        std::mutex _pending_mutex;
+        std::unordered_set<int> _pending;
+
+        std::mutex _epoll_mutex;
+        std::unordered_map<int, TEpoll_Set> _epoll_sets;
+        std::atomic<size_t> _epoll_set_count{ 0 };
+
+        // plain kernel registration of a socket, that is not virtualized
+        struct TDirect_Registration {
+            int epfd;
+            struct epoll_event event;
+        };
+
+        // plain registrations by the socket fd; entries of closed epoll instances are not removed, their conversion just
+        // fails (the epoll fd is gone, or it does not contain the socket)
+        std::mutex _direct_mutex;
+        std::unordered_map<int, std::vector<TDirect_Registration>> _direct;
+        std::atomic<size_t> _direct_count{ 0 };
+};
+
+extern CInput_Delay_Stage* gInput_Delay_Stage;
@@ -0,0 +1,270 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the asynchronous logger, that formats and prints log records on a background thread.
+ */
+
+#include "logger.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+
+CLogger* gLogger = nullptr;
+
+using intcptor::NLog_Event;
+using intcptor::TLog_Record;
+
+namespace {
+    // how often the logger thread drains the rings
+    constexpr auto Drain_Interval = std::chrono::milliseconds(20);
+
+    uint64_t Now_Ns() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void Format_Record(std::ostream& os, const TLog_Record& rec) {
+        switch (rec.event) {
+            case NLog_Event::Socket:
+                os << "[[InTCPtor: overriden socket() call, result = " << rec.a << "]]";
+                break;
+            case NLog_Event::Close_Created:
+                os << "[[InTCPtor: overriden close() call for server socket fd = " << rec.fd << "]]";
+                break;
+            case NLog_Event::Close_Managed:
+                os << "[[InTCPtor: overriden close() call for client socket fd = " << rec.fd << "]]";
+                break;
+            case NLog_Event::Close_Unmanaged:
+                os << "[[InTCPtor: overriden close() call for non-managed fd = " << rec.fd << "]]";
+                break;
+            case NLog_Event::Accept:
+                os << "[[InTCPtor: overriden accept() call, result = " << rec.a << "]]";
+                break;
+            case NLog_Event::Recv_Adjusted:
+                os << "[[InTCPtor: recv() original count = " << rec.a << ", adjusted = " << rec.b << "]]";
+                break;
+            case NLog_Event::Recv:
+                os << "[[InTCPtor: overriden recv() call, result = " << rec.a << "]]";
+                break;
+            case NLog_Event::Send_Adjusted_1B:
+                os << "[[InTCPtor: send() original count = " << rec.a << ", adjusted to 1B sends]]";
+                break;
+            case NLog_Event::Send_Adjusted_2_Separate:
+                os << "[[InTCPtor: send() original count = " << rec.a << ", adjusted to 2 separate sends]]";
+                break;
+            case NLog_Event::Send_Adjusted_2B_And_Second:
+                os << "[[InTCPtor: send() original count = " << rec.a << ", adjusted to 2B sends and second send]]";
+                break;
+            case NLog_Event::Send_Adjusted_2B:
+                os << "[[InTCPtor: send() original count = " << rec.a << ", adjusted to 2B sends]]";
+                break;
+            case NLog_Event::Send:
+                os << "[[InTCPtor: overriden send() call, result = " << rec.a << "]]";
+                break;
+            case NLog_Event::Read_As_Recv:
+                os << "[[InTCPtor: override read() as recv() with flags = 0]]";
+                break;
+            case NLog_Event::Write_As_Send:
+                os << "[[InTCPtor: override write() as send() with flags = 0]]";
+                break;
+            case NLog_Event::Shutdown_Created:
+                os << "[[InTCPtor: overriden shutdown() call for server socket fd = " << rec.fd << "]]";
+                break;
+            case NLog_Event::Shutdown_Managed:
+                os << "[[InTCPtor: overriden shutdown() call for client socket fd = " << rec.fd << "]]";
+                break;
+            case NLog_Event::Shutdown_Unmanaged:
+                os << "[[InTCPtor: overriden shutdown() call for non-managed fd = " << rec.fd << "]]";
+                break;
+            case NLog_Event::Queue_Send:
+                os << "[[InTCPtor: sending " << rec.a << " bytes to socket " << rec.fd << " after delay of " << rec.b << " ms]]";
+                break;
+            case NLog_Event::Random_Close:
+                os << "[[InTCPtor: closing random client socket: " << rec.fd << "]]";
+                break;
+            case NLog_Event::Writev_As_Send:
+                os << "[[InTCPtor: override writev() as send() with flags = 0, segments = " << rec.a << "]]";
+                break;
+            case NLog_Event::Sendto_As_Send:
+                os << "[[InTCPtor: override sendto() without destination as send()]]";
+                break;
+            case NLog_Event::Sendmsg_As_Send:
+                os << "[[InTCPtor: override sendmsg() as send(), segments = " << rec.a << "]]";
+                break;
+            case NLog_Event::Sendmmsg_As_Send:
+                os << "[[InTCPtor: override sendmmsg() as send() per message, messages = " << rec.a << "]]";
+                break;
+            case NLog_Event::Readv_As_Recv:
+                os << "[[InTCPtor: override readv() as recv() with flags = 0, segments = " << rec.a << "]]";
+                break;
+            case NLog_Event::Recv_Delayed:
+                os << "[[InTCPtor: holding " << rec.a << " bytes received on socket " << rec.fd << " for delay of " << rec.b << " ms]]";
+                break;
+            case NLog_Event::Accept4:
+                os << "[[InTCPtor: overriden accept4() call, result = " << rec.a << "]]";
+                break;
+            case NLog_Event::Connect:
+                os << "[[InTCPtor: overriden connect() call for socket " << rec.fd << ", result = " << rec.a << ", handshake delay = " << rec.b << " ms]]";
+                break;
+            case NLog_Event::Queue_Discarded:
+                os << "[[InTCPtor: discarded " << rec.a << " bytes queued for closed socket " << rec.fd << "]]";
+                break;
+            case NLog_Event::Sendfile_As_Send:
+                os << "[[InTCPtor: override sendfile() as delayed file send, count = " << rec.a << "]]";
+                break;
+            case NLog_Event::Splice_As_Send:
+                os << "[[InTCPtor: override splice() to socket as send(), count = " << rec.a << "]]";
+                break;
+            case NLog_Event::Splice_As_Recv:
+                os << "[[InTCPtor: override splice() from socket as recv(), result = " << rec.a << "]]";
+                break;
+            case NLog_Event::Profile_Bound:
+                os << "[[InTCPtor: socket " << rec.fd << " uses fault profile #" << rec.a << "]]";
+                break;
+        }
+    }
+}
+
+CLogger::TRing_Holder::~TRing_Holder() {
+    if (ring) {
+        ring->abandoned.store(true, std::memory_order_release);
+    }
+}
+
+CLogger::CLogger() {
+    _running = true;
+    _worker = std::thread(&CLogger::worker, this);
+}
+
+CLogger::~CLogger() {
+    Stop();
+
+    // NOTE: the rings are intentionally leaked, as other threads may still hold (and release on exit) their rings
+    for (auto& ring : _rings) {
+        ring.release();
+    }
+}
+
+void CLogger::Stop() {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_running) {
+            return;
+        }
+        _running = false;
+        _cond.notify_all();
+    }
+    _worker.join();
+
+    // print whatever was pushed after the last drain
+    drain();
+}
+
+CLogger::TRing* CLogger::Acquire_Ring() {
+    thread_local TRing_Holder holder;
+
+    if (holder.ring) {
+        return holder.ring;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (!_free_rings.empty()) {
+        holder.ring = _free_rings.back();
+        _free_rings.pop_back();
+        holder.ring->abandoned.store(false, std::memory_order_relaxed);
+    }
+    else {
+        _rings.push_back(std::make_unique<TRing>());
+        holder.ring = _rings.back().get();
+    }
+
+    return holder.ring;
+}
+
+void CLogger::push(NLog_Event event, int fd, int64_t a, int64_t b) {
+    TRing* ring = Acquire_Ring();
+
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+
+    if (head - tail >= Ring_Capacity) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    ring->records[head % Ring_Capacity] = { Now_Ns(), event, fd, a, b };
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t CLogger::Get_Dropped_Count() const {
+    uint64_t total = 0;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (const auto& ring : _rings) {
+        total += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+bool CLogger::drain() {
+    uint64_t dropped = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        for (const auto& ring : _rings) {
+            const bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+            const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            const uint64_t head = ring->head.load(std::memory_order_acquire);
+
+            for (uint64_t i = tail; i < head; i++) {
+                _batch.push_back(ring->records[i % Ring_Capacity]);
+            }
+            ring->tail.store(head, std::memory_order_release);
+
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+
+            // the owning thread exited and everything was printed; the ring may be reused by another thread
+            if (abandoned && std::find(_free_rings.begin(), _free_rings.end(), ring.get()) == _free_rings.end()) {
+                _free_rings.push_back(ring.get());
+            }
+        }
+    }
+
+    if (_batch.empty() && dropped == _reported_dropped) {
+        return false;
+    }
+
+    // records of different threads are interleaved in order of their creation
+    std::stable_sort(_batch.begin(), _batch.end(), [](const TLog_Record& a, const TLog_Record& b) {
+        return a.timestamp_ns < b.timestamp_ns;
+    });
+
+    for (const auto& rec : _batch) {
+        Format_Record(std::cout, rec);
+        std::cout << '\n';
+    }
+
+    if (dropped != _reported_dropped) {
+        std::cout << "[[InTCPtor: log buffer full, " << (dropped - _reported_dropped) << " records dropped (" << dropped << " in total)]]" << '\n';
+        _reported_dropped = dropped;
+    }
+
+    std::cout.flush();
+
+    _batch.clear();
+
+    return true;
+}
+
+void CLogger::worker() {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (_running) {
+        _cond.wait_for(lock, Drain_Interval, [this] { return !_running; });
+
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+}
@@ -0,0 +1,126 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the asynchronous logger, that formats and prints log records on a background thread.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+
+namespace intcptor {
+
+    // type of a log record; every type has its own message format (see logger.cpp)
+    enum class NLog_Event : uint32_t {
+        Socket,                     // a = result
+        Close_Created,
+        Close_Managed,
+        Close_Unmanaged,
+        Accept,                     // a = result
+        Recv_Adjusted,              // a = original count, b = adjusted count
+        Recv,                       // a = result
+        Send_Adjusted_1B,           // a = original count
+        Send_Adjusted_2_Separate,   // a = original count
+        Send_Adjusted_2B_And_Second,// a = original count
+        Send_Adjusted_2B,           // a = original count
+        Send,                       // a = result
+        Read_As_Recv,
+        Write_As_Send,
+        Shutdown_Created,
+        Shutdown_Managed,
+        Shutdown_Unmanaged,
+        Queue_Send,                 // a = byte count, b = delay in ms
+        Random_Close,
+        Writev_As_Send,             // a = segment count
+        Sendto_As_Send,
+        Sendmsg_As_Send,            // a = segment count
+        Sendmmsg_As_Send,           // a = message count
+        Readv_As_Recv,              // a = segment count
+        Recv_Delayed,               // a = byte count, b = delay in ms
+        Profile_Bound,              // a = fault profile index
+        Accept4,                    // a = result
+        Connect,                    // a = result, b = handshake delay in ms
+        Queue_Discarded,            // a = byte count
+        Sendfile_As_Send,           // a = byte count
+        Splice_As_Send,             // a = byte count
+        Splice_As_Recv,             // a = result
+    };
+
+    // binary log record; formatting is deferred to the logger thread
+    struct TLog_Record {
+        uint64_t timestamp_ns;
+        NLog_Event event;
+        int32_t fd;
+        int64_t a;
+        int64_t b;
+    };
+}
+
+class CLogger {
+    public:
+        // number of records a single thread may have pending before new records are dropped
+        static constexpr size_t Ring_Capacity = 4096;
+
+        CLogger();
+
+        virtual ~CLogger();
+
+        // stops the logger thread and prints the remaining records; the records pushed later are not printed
+        void Stop();
+
+        // pushes a record to the ring of the calling thread; never blocks, drops the record if the ring is full
+        void push(intcptor::NLog_Event event, int fd, int64_t a, int64_t b);
+
+        // total number of records dropped so far
+        uint64_t Get_Dropped_Count() const;
+
+    private:
+        // single-producer (owning thread), single-consumer (logger thread) ring
+        struct TRing {
+            alignas(64) std::atomic<uint64_t> head{ 0 };
+            alignas(64) std::atomic<uint64_t> tail{ 0 };
+            alignas(64) std::atomic<uint64_t> dropped{ 0 };
+            // set when the owning thread exits; the ring is reused after it is drained
+            std::atomic<bool> abandoned{ false };
+            intcptor::TLog_Record records[Ring_Capacity];
+        };
+
+        // releases the ring of a thread when the thread exits
+        struct TRing_Holder {
+            TRing* ring = nullptr;
+            ~TRing_Holder();
+        };
+
+        TRing* Acquire_Ring();
+        void worker();
+        // moves all pending records to the output; returns true if any record was printed
+        bool drain();
+
+        std::thread _worker;
+        mutable std::mutex _mutex;
+        std::condition_variable _cond;
+        // all rings ever allocated; rings are never freed while the logger runs, only reused
+        std::vector<std::unique_ptr<TRing>> _rings;
+        std::vector<TRing*> _free_rings;
+        std::vector<intcptor::TLog_Record> _batch;
+        uint64_t _reported_dropped = 0;
+        bool _running = true;
+};
+
+// NOTE: the logger is never freed, the application threads may log until the very end of the process
+extern CLogger* gLogger;
+
+namespace intcptor {
+    // convenience function to push a log record, if the logger is running
+    inline void Log(NLog_Event event, int fd, int64_t a = 0, int64_t b = 0) {
+        if (gLogger) {
+            gLogger->push(event, fd, a, b);
+        }
+    }
+}
@@ -0,0 +1,509 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the backends, that send the due fragments of the output timed queue.
+ */
+
+#include "output_backend.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "overrides.hpp"
+#include "config.hpp"
+
+namespace {
+
+    // number of submission queue entries; larger batches are submitted in parts
+    constexpr unsigned Ring_Entries = 256;
+
+    // file chunks for blocking sockets are sent through a buffer of this size
+    constexpr size_t File_Buffer_Size = 64 * 1024;
+
+    // how many fragments of a socket are gathered to a single sendmsg() at most
+    constexpr size_t Max_Gather_Items = 64;
+
+    int Io_Uring_Setup(unsigned entries, struct io_uring_params* params) {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int Io_Uring_Enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    int Io_Uring_Register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args) {
+        return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+    }
+
+    template<typename T>
+    T* Ring_Field(void* ring, uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+    }
+}
+
+COutput_Backend::TPtr COutput_Backend::Create() {
+    if (gConfig->GetOutput_Backend() == "io_uring") {
+        auto backend = std::make_unique<CIo_Uring_Output_Backend>(gConfig->GetSend_Zerocopy_Threshold());
+        if (backend->Is_Ready()) {
+            if (gConfig->Is_Log_Enabled()) {
+                std::cout << "[[InTCPtor: using io_uring output backend]]" << std::endl;
+            }
+            return backend;
+        }
+
+        std::cerr << "[[InTCPtor: io_uring is not available, falling back to send() output backend]]" << std::endl;
+    }
+    else if (gConfig->GetOutput_Backend() != "send") {
+        std::cerr << "[[InTCPtor: unknown output backend " << gConfig->GetOutput_Backend() << ", using send()]]" << std::endl;
+    }
+
+    return std::make_unique<CSend_Output_Backend>();
+}
+
+size_t COutput_Backend::Try_Send(int target_socket, const char* data, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        const ssize_t res = orig::send(target_socket, data + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (res > 0) {
+            done += static_cast<size_t>(res);
+            continue;
+        }
+
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // the socket buffer is full (the peer does not read); the rest is tried again later
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return done;
+        }
+
+        // the connection is broken, there is nobody to deliver the rest to
+        return len;
+    }
+
+    return done;
+}
+
+size_t COutput_Backend::Try_Send_File(int target_socket, const TFile_Chunk& chunk) {
+    // sendfile() has no flag to not block, so it is used only if the socket itself does not block (which is the usual
+    // case for servers using sendfile()); the data for a blocking socket go through a buffer instead
+    const int socket_flags = ::fcntl(target_socket, F_GETFL);
+    const bool nonblocking = socket_flags >= 0 && (socket_flags & O_NONBLOCK);
+
+    char buffer[File_Buffer_Size];
+    size_t done = 0;
+
+    while (done < chunk.len) {
+        off_t offset = chunk.offset + static_cast<off_t>(done);
+
+        ssize_t res;
+        if (nonblocking) {
+            res = orig::sendfile(target_socket, chunk.fd, &offset, chunk.len - done);
+        }
+        else {
+            const ssize_t len = ::pread(chunk.fd, buffer, std::min(sizeof(buffer), chunk.len - done), offset);
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            // the file was truncated meanwhile
+            if (len <= 0) {
+                return chunk.len;
+            }
+            res = orig::send(target_socket, buffer, static_cast<size_t>(len), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+
+        if (res > 0) {
+            done += static_cast<size_t>(res);
+            continue;
+        }
+
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return done;
+        }
+
+        // end of the file (it was truncated), or the connection is broken
+        return chunk.len;
+    }
+
+    return done;
+}
+
+void COutput_Backend::Send_Each(const std::vector<TSend_Item>& items, std::vector<size_t>& sent) {
+    sent.assign(items.size(), 0);
+
+    bool blocked = false;
+    for (size_t i = 0; i < items.size(); i++) {
+        // the socket did not take the previous item completely; this one must wait for it
+        if (items[i].follows_previous && blocked) {
+            continue;
+        }
+
+        const auto& item = items[i];
+        sent[i] = item.file ? Try_Send_File(item.target_socket, *item.file) : Try_Send(item.target_socket, item.data->data(), item.data->size());
+        blocked = sent[i] < item.size();
+    }
+}
+
+void CSend_Output_Backend::send_batch(const std::vector<TSend_Item>& items, std::vector<size_t>& sent) {
+    Send_Each(items, sent);
+}
+
+CIo_Uring_Output_Backend::CIo_Uring_Output_Backend(size_t zerocopy_threshold) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    _ring_fd = Io_Uring_Setup(Ring_Entries, &params);
+    if (_ring_fd < 0) {
+        return;
+    }
+
+    _sq_entries = params.sq_entries;
+
+    _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (single_mmap) {
+        _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+    }
+
+    _sq_ring = ::mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    if (_sq_ring == MAP_FAILED) {
+        _sq_ring = nullptr;
+        orig::close(_ring_fd);
+        _ring_fd = -1;
+        return;
+    }
+
+    if (single_mmap) {
+        _cq_ring = _sq_ring;
+    }
+    else {
+        _cq_ring = ::mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+    }
+
+    _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = ::mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+
+    if (_cq_ring == MAP_FAILED || _sqes == MAP_FAILED) {
+        _cq_ring = (_cq_ring == MAP_FAILED) ? nullptr : _cq_ring;
+        _sqes = (_sqes == MAP_FAILED) ? nullptr : _sqes;
+        Teardown();
+        return;
+    }
+
+    _sq_head = Ring_Field<unsigned>(_sq_ring, params.sq_off.head);
+    _sq_tail = Ring_Field<unsigned>(_sq_ring, params.sq_off.tail);
+    _sq_mask = Ring_Field<unsigned>(_sq_ring, params.sq_off.ring_mask);
+    _sq_array = Ring_Field<unsigned>(_sq_ring, params.sq_off.array);
+    _cq_head = Ring_Field<unsigned>(_cq_ring, params.cq_off.head);
+    _cq_tail = Ring_Field<unsigned>(_cq_ring, params.cq_off.tail);
+    _cq_mask = Ring_Field<unsigned>(_cq_ring, params.cq_off.ring_mask);
+    _cqes = Ring_Field<void>(_cq_ring, params.cq_off.cqes);
+
+    // zero-copy sendmsg() is available since Linux 6.1; probe for it, so older kernels just use the regular one
+    if (zerocopy_threshold > 0) {
+        const size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        std::vector<char> probe_buf(probe_size, 0);
+        auto* probe = reinterpret_cast<struct io_uring_probe*>(probe_buf.data());
+
+        if (Io_Uring_Register(_ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0
+            && probe->last_op >= IORING_OP_SENDMSG_ZC && (probe->ops[IORING_OP_SENDMSG_ZC].flags & IO_URING_OP_SUPPORTED)) {
+            _zerocopy_threshold = zerocopy_threshold;
+        }
+        else {
+            std::cerr << "[[InTCPtor: zero-copy send is not supported by the kernel]]" << std::endl;
+        }
+    }
+}
+
+CIo_Uring_Output_Backend::~CIo_Uring_Output_Backend() {
+    if (_ring_fd >= 0) {
+        // wait for the kernel to release all zero-copy buffers before they are returned to the pool
+        std::vector<int64_t> no_results;
+        while (!_zerocopy_inflight.empty()) {
+            if (Io_Uring_Enter(_ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                break;
+            }
+            Reap(no_results, _next_user_data);
+        }
+    }
+
+    Teardown();
+}
+
+void CIo_Uring_Output_Backend::Teardown() {
+    if (_sqes) {
+        ::munmap(_sqes, _sqes_size);
+        _sqes = nullptr;
+    }
+    if (_cq_ring && _cq_ring != _sq_ring) {
+        ::munmap(_cq_ring, _cq_ring_size);
+    }
+    _cq_ring = nullptr;
+    if (_sq_ring) {
+        ::munmap(_sq_ring, _sq_ring_size);
+        _sq_ring = nullptr;
+    }
+    if (_ring_fd >= 0) {
+        orig::close(_ring_fd);
+        _ring_fd = -1;
+    }
+}
+
+size_t CIo_Uring_Output_Backend::Reap(std::vector<int64_t>& results, uint64_t base) {
+    size_t completed = 0;
+
+    unsigned head = *_cq_head;
+    const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const auto& cqe = static_cast<struct io_uring_cqe*>(_cqes)[head & *_cq_mask];
+
+        // the kernel does not use the buffer of a zero-copy send anymore
+        if (cqe.flags & IORING_CQE_F_NOTIF) {
+            _zerocopy_inflight.erase(cqe.user_data);
+            continue;
+        }
+
+        // a zero-copy send, that failed, does not generate the notification
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            _zerocopy_inflight.erase(cqe.user_data);
+        }
+
+        if (cqe.user_data >= base && cqe.user_data - base < results.size()) {
+            results[cqe.user_data - base] = cqe.res;
+        }
+        completed++;
+    }
+
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+    return completed;
+}
+
+void CIo_Uring_Output_Backend::Submit(const std::vector<TSend_Item>& items, const std::vector<TGather>& gathers, std::vector<int64_t>& results) {
+    const size_t count = gathers.size();
+    const uint64_t base = _next_user_data;
+
+    // the headers must stay in place until the kernel takes them, so all of them are built first
+    _iovs.clear();
+    _msgs.assign(count, msghdr{});
+    for (const auto& gather : gathers) {
+        for (size_t i = gather.begin; i < gather.end; i++) {
+            _iovs.push_back({ const_cast<char*>(items[i].data->data()), items[i].data->size() });
+        }
+    }
+
+    const unsigned first_tail = *_sq_tail;
+    unsigned tail = first_tail;
+    size_t first_iov = 0;
+
+    for (size_t g = 0; g < count; g++) {
+        const TGather& gather = gathers[g];
+        const unsigned index = tail & *_sq_mask;
+
+        _msgs[g].msg_iov = &_iovs[first_iov];
+        _msgs[g].msg_iovlen = gather.end - gather.begin;
+        first_iov += gather.end - gather.begin;
+
+        auto& sqe = static_cast<struct io_uring_sqe*>(_sqes)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+
+        const bool zerocopy = _zerocopy_threshold > 0 && gather.len >= _zerocopy_threshold;
+
+        sqe.opcode = zerocopy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+        sqe.fd = items[gather.begin].target_socket;
+        sqe.addr = reinterpret_cast<uint64_t>(&_msgs[g]);
+        sqe.len = 1;
+        // the kernel must not wait for a socket, whose peer does not read; a full socket completes short (or with EAGAIN)
+        sqe.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+        sqe.user_data = _next_user_data++;
+
+        if (zerocopy) {
+            auto& slices = _zerocopy_inflight[sqe.user_data];
+            for (size_t i = gather.begin; i < gather.end; i++) {
+                slices.push_back(items[i].data->Share());
+            }
+        }
+
+        _sq_array[index] = index;
+        tail++;
+    }
+
+    __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+
+    results.assign(count, Not_Completed);
+
+    size_t completed = 0;
+    unsigned to_submit = static_cast<unsigned>(count);
+
+    while (completed < count) {
+        const int res = Io_Uring_Enter(_ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Abandon_Submission(items, gathers, first_tail, base, results, completed);
+            return;
+        }
+        to_submit -= std::min(to_submit, static_cast<unsigned>(res));
+
+        completed += Reap(results, base);
+    }
+}
+
+void CIo_Uring_Output_Backend::Abandon_Submission(const std::vector<TSend_Item>& items, const std::vector<TGather>& gathers, unsigned first_tail,
+                                                  uint64_t base, std::vector<int64_t>& results, size_t completed) {
+
+    // the entries past the head were not taken by the kernel; they are withdrawn, so no later call submits them, and they
+    // are left as cancelled, so they are sent again later
+    const unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(_sq_tail, head, __ATOMIC_RELEASE);
+
+    const size_t consumed = static_cast<unsigned>(head - first_tail);
+    for (size_t i = consumed; i < gathers.size(); i++) {
+        results[i] = -ECANCELED;
+        // a withdrawn zero-copy send never generates a notification
+        _zerocopy_inflight.erase(base + i);
+    }
+
+    // the taken entries must complete here, so their completions are not credited to a later submission, and they are
+    // never sent again
+    while (completed < consumed) {
+        if (Io_Uring_Enter(_ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            break;
+        }
+        completed += Reap(results, base);
+    }
+
+    if (completed < consumed) {
+        std::cerr << "[[InTCPtor: io_uring failed, falling back to send() output backend]]" << std::endl;
+        _failed = true;
+
+        // the kernel may have sent these, so they are never sent again; the requests may still use their buffers
+        for (size_t i = 0; i < consumed; i++) {
+            if (results[i] == Not_Completed) {
+                results[i] = static_cast<int64_t>(gathers[i].len);
+                for (size_t k = gathers[i].begin; k < gathers[i].end; k++) {
+                    _abandoned.push_back(items[k].data->Share());
+                }
+            }
+        }
+    }
+}
+
+void CIo_Uring_Output_Backend::send_batch(const std::vector<TSend_Item>& items, std::vector<size_t>& sent) {
+    if (_failed) {
+        Send_Each(items, sent);
+        return;
+    }
+
+    sent.assign(items.size(), 0);
+
+    // the items of a socket go in rounds - a round sends either a file chunk, or a run of buffers gathered to a single
+    // sendmsg(); the next round of the socket starts only if the socket took the whole previous one, so its data are never
+    // reordered, and a socket, that does not take its data, does not hold up the others
+    std::vector<size_t> round, next_round;
+    std::vector<TGather> gathers;
+    std::vector<int64_t> results;
+
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!items[i].follows_previous) {
+            round.push_back(i);
+        }
+    }
+
+    while (!round.empty()) {
+        next_round.clear();
+        gathers.clear();
+
+        for (const size_t first : round) {
+            if (items[first].file) {
+                sent[first] = Try_Send_File(items[first].target_socket, *items[first].file);
+                if (sent[first] == items[first].size() && first + 1 < items.size() && items[first + 1].follows_previous) {
+                    next_round.push_back(first + 1);
+                }
+                continue;
+            }
+
+            TGather gather{ first, first, 0 };
+            while (gather.end < items.size() && gather.end - first < Max_Gather_Items && !items[gather.end].file
+                   && (gather.end == first || items[gather.end].follows_previous)) {
+                gather.len += items[gather.end].size();
+                gather.end++;
+            }
+            gathers.push_back(gather);
+        }
+
+        // (in parts, if there are more gathers than the ring entries)
+        for (size_t part = 0; part < gathers.size(); part += _sq_entries) {
+            const size_t part_end = std::min(gathers.size(), part + _sq_entries);
+
+            // the ring failed meanwhile
+            if (_failed) {
+                for (size_t g = part; g < part_end; g++) {
+                    for (size_t i = gathers[g].begin; i < gathers[g].end; i++) {
+                        sent[i] = Try_Send(items[i].target_socket, items[i].data->data(), items[i].data->size());
+                        if (sent[i] < items[i].size()) {
+                            break;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            const std::vector<TGather> submitted(gathers.begin() + static_cast<std::ptrdiff_t>(part), gathers.begin() + static_cast<std::ptrdiff_t>(part_end));
+            Submit(items, submitted, results);
+
+            for (size_t g = 0; g < submitted.size(); g++) {
+                const TGather& gather = submitted[g];
+                const int64_t res = results[g];
+
+                size_t done;
+                if (res >= 0) {
+                    done = static_cast<size_t>(res);
+                }
+                else if (res == -EAGAIN || res == -EWOULDBLOCK || res == -EINTR || res == -ECANCELED) {
+                    // nothing was sent, the items are tried again later
+                    done = 0;
+                }
+                else {
+                    // the connection is broken
+                    done = gather.len;
+                }
+
+                // the sent bytes are credited to the items in order
+                for (size_t i = gather.begin; i < gather.end && done > 0; i++) {
+                    sent[i] = std::min(done, items[i].size());
+                    done -= sent[i];
+                }
+            }
+        }
+
+        for (const auto& gather : gathers) {
+            const size_t last = gather.end - 1;
+            if (sent[last] == items[last].size() && gather.end < items.size() && items[gather.end].follows_previous) {
+                next_round.push_back(gather.end);
+            }
+        }
+
+        round.swap(next_round);
+    }
+}
@@ -0,0 +1,142 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the backends, that send the due fragments of the output timed queue.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "payload_pool.hpp"
+
+class COutput_Backend {
+    public:
+        using TPtr = std::unique_ptr<COutput_Backend>;
+
+        // a part of a file to be sent with sendfile(), so the data are never copied to the user space
+        struct TFile_Chunk {
+            // private duplicate of the descriptor the application passed to sendfile()
+            int fd;
+            off_t offset;
+            size_t len;
+        };
+
+        // a single fragment to be sent
+        struct TSend_Item {
+            int target_socket;
+            // the data to be sent; nullptr, if the item is a file chunk
+            const intcptor::CPayload_Slice* data;
+            // the item must not be sent before the previous item (which belongs to the same socket) is sent completely
+            bool follows_previous;
+            const TFile_Chunk* file = nullptr;
+
+            size_t size() const { return file ? file->len : data->size(); }
+        };
+
+        // creates the backend chosen in config; falls back to plain send() if the chosen one is not available
+        static TPtr Create();
+
+        virtual ~COutput_Backend() = default;
+
+        // sends the items without blocking; items of the same socket are consecutive, and they are sent in order
+        // sent[i] is the number of bytes of the item, that are done with - sent, or all of them, if the connection is broken
+        // (there is nobody to deliver them to); if a socket can't take more data right now, its item is sent only partially
+        // (possibly not at all), and the following items of the socket are not sent, so the caller retries them later
+        virtual void send_batch(const std::vector<TSend_Item>& items, std::vector<size_t>& sent) = 0;
+
+    protected:
+        // sends as much of the buffer as the socket takes right now with the original send(); returns the bytes done
+        static size_t Try_Send(int target_socket, const char* data, size_t len);
+        // the same for a file chunk; a chunk cut short by the file truncated meanwhile is done as a whole
+        static size_t Try_Send_File(int target_socket, const TFile_Chunk& chunk);
+        // sends the items one by one
+        static void Send_Each(const std::vector<TSend_Item>& items, std::vector<size_t>& sent);
+};
+
+// one send() call per fragment
+class CSend_Output_Backend : public COutput_Backend {
+    public:
+        void send_batch(const std::vector<TSend_Item>& items, std::vector<size_t>& sent) override;
+};
+
+// all fragments of a batch submitted at once to io_uring; the consecutive fragments of a single socket are gathered to a
+// single sendmsg(), so they are sent in order; the ring is set up with raw syscalls, so there is no dependency on liburing
+class CIo_Uring_Output_Backend : public COutput_Backend {
+    public:
+        CIo_Uring_Output_Backend(size_t zerocopy_threshold);
+        virtual ~CIo_Uring_Output_Backend();
+
+        // true if the ring was set up successfully
+        bool Is_Ready() const { return _ring_fd >= 0; }
+
+        // result of an item, whose completion was not reaped (yet)
+        static constexpr int64_t Not_Completed = INT64_MIN;
+
+        void send_batch(const std::vector<TSend_Item>& items, std::vector<size_t>& sent) override;
+
+    private:
+        // consecutive buffer items [begin, end) of a single socket, sent with a single sendmsg()
+        struct TGather {
+            size_t begin;
+            size_t end;
+            size_t len;
+        };
+
+        // submits the gathers (of different sockets) and waits for their completions; returns the number of bytes sent for
+        // every gather (or negative error code); the gathers never taken by the kernel are reported as cancelled
+        void Submit(const std::vector<TSend_Item>& items, const std::vector<TGather>& gathers, std::vector<int64_t>& results);
+
+        // the ring failed while the gathers of a submission were in it; withdraws the entries the kernel did not take, and
+        // waits for the completions of the rest; if even that fails, the ring is given up
+        void Abandon_Submission(const std::vector<TSend_Item>& items, const std::vector<TGather>& gathers, unsigned first_tail, uint64_t base,
+                                std::vector<int64_t>& results, size_t completed);
+
+        // unmaps the rings and closes the ring fd
+        void Teardown();
+
+        // processes completions in the ring; returns the number of send completions (zero-copy notifications excluded)
+        size_t Reap(std::vector<int64_t>& results, uint64_t base);
+
+        int _ring_fd = -1;
+        unsigned _sq_entries = 0;
+        // the ring failed, and the state of some requests is not known; nothing is submitted to it anymore, all items are
+        // sent the plain way
+        bool _failed = false;
+
+        void* _sq_ring = nullptr;
+        size_t _sq_ring_size = 0;
+        void* _cq_ring = nullptr;
+        size_t _cq_ring_size = 0;
+        void* _sqes = nullptr;
+        size_t _sqes_size = 0;
+
+        unsigned* _sq_head = nullptr;
+        unsigned* _sq_tail = nullptr;
+        unsigned* _sq_mask = nullptr;
+        unsigned* _sq_array = nullptr;
+        unsigned* _cq_head = nullptr;
+        unsigned* _cq_tail = nullptr;
+        unsigned* _cq_mask = nullptr;
+        void* _cqes = nullptr;
+
+        // gathers at least this long are sent with zero-copy send (0 = never)
+        size_t _zerocopy_threshold = 0;
+        // zero-copy sends, whose buffers are still used by the kernel; the reference keeps the payload block alive
+        std::unordered_map<uint64_t, std::vector<intcptor::CPayload_Slice>> _zerocopy_inflight;
+        // buffers of the requests left in the failed ring; kept until the backend is destroyed
+        std::vector<intcptor::CPayload_Slice> _abandoned;
+        uint64_t _next_user_data = 0;
+
+        // message headers and their segments of the current submission
+        std::vector<struct msghdr> _msgs;
+        std::vector<struct iovec> _iovs;
+};
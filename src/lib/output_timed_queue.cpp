@@ -7,51 +7,599 @@
 #include "output_timed_queue.hpp"
 
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "overrides.hpp"
 #include "config.hpp"
+#include "logger.hpp"
+#include "capture_writer.hpp"
+#include "stats.hpp"
 
-COutput_Timed_Queue::TPtr gOutput_Timed_Queue;
+COutput_Timed_Queue* gOutput_Timed_Queue = nullptr;
+
+COutput_Timed_Queue::COutput_Timed_Queue()
+    : _socket_bandwidth(gConfig->GetSend_Bandwidth_Socket_Kbit(), gConfig->GetSend_Bandwidth_Burst()),
+      _total_bandwidth(gConfig->GetSend_Bandwidth_Total_Kbit(), gConfig->GetSend_Bandwidth_Burst()) {
+
+    size_t shard_count = gConfig->GetOutput_Queue_Shards();
+    if (shard_count == 0) {
+        shard_count = std::max(1u, std::thread::hardware_concurrency());
+    }
 
-COutput_Timed_Queue::COutput_Timed_Queue() {
     if (gConfig->Is_Log_Enabled()) {
-        std::cout << "[[InTCPtor: starting output timed queue]]" << std::endl;
+        std::cout << "[[InTCPtor: starting output timed queue with " << shard_count << " worker(s)]]" << std::endl;
     }
 
-    _running = true;
-    _worker = std::thread(&COutput_Timed_Queue::worker, this);
+    // all shards must exist before any worker starts, as the shard vector is not protected by any lock
+    _shards.reserve(shard_count);
+    for (size_t i = 0; i < shard_count; i++) {
+        _shards.push_back(std::make_unique<TShard>());
+        _shards.back()->backend = COutput_Backend::Create();
+    }
+
+    for (auto& shard : _shards) {
+        shard->worker = std::thread(&COutput_Timed_Queue::worker, this, std::ref(*shard));
+    }
 }
 
 COutput_Timed_Queue::~COutput_Timed_Queue() {
-    _running = false;
-    _worker.join();
+    Stop();
+}
+
+void COutput_Timed_Queue::Stop() {
+    for (auto& shard : _shards) {
+        std::unique_lock<std::mutex> lock(shard->mutex);
+        shard->running = false;
+        shard->cond.notify_all();
+    }
+    for (auto& shard : _shards) {
+        if (shard->worker.joinable()) {
+            shard->worker.join();
+        }
+    }
+}
+
+size_t COutput_Timed_Queue::available(const intcptor::TSocket_State& state) const {
+    size_t avail = std::numeric_limits<size_t>::max();
+
+    const size_t socket_limit = gConfig->GetSend_Queue_Socket_Limit();
+    if (socket_limit > 0) {
+        const uint64_t queued = state.queued_bytes.load(std::memory_order_relaxed);
+        avail = std::min(avail, queued >= socket_limit ? 0 : static_cast<size_t>(socket_limit - queued));
+    }
+
+    const size_t total_limit = gConfig->GetSend_Queue_Total_Limit();
+    if (total_limit > 0) {
+        const uint64_t queued = _queued_bytes.load(std::memory_order_relaxed);
+        avail = std::min(avail, queued >= total_limit ? 0 : static_cast<size_t>(total_limit - queued));
+    }
+
+    return avail;
+}
+
+size_t COutput_Timed_Queue::reserve(int target_socket, size_t len, int flags) {
+    intcptor::TSocket_State* state = intcptor::socket_table.Get(target_socket);
+    if (!state) {
+        // fd out of the table range, nothing to account to
+        return len;
+    }
+
+    // fast path - enough space, no need to lock; concurrent reservations may overshoot the limit by a single call at most
+    if (available(*state) >= len) {
+        state->queued_bytes.fetch_add(len, std::memory_order_relaxed);
+        _queued_bytes.fetch_add(len, std::memory_order_relaxed);
+        return len;
+    }
+
+    // only now it is worth to find out, if the socket is blocking
+    const bool blocking = !(flags & MSG_DONTWAIT) && !(::fcntl(target_socket, F_GETFL) & O_NONBLOCK);
+
+    if (!blocking) {
+        const size_t avail = available(*state);
+        if (avail > 0) {
+            state->queued_bytes.fetch_add(avail, std::memory_order_relaxed);
+            _queued_bytes.fetch_add(avail, std::memory_order_relaxed);
+        }
+        if (avail < len) {
+            // the socket reads as not writable until the queue drains (see CInput_Delay_Stage)
+            state->flags.fetch_or(intcptor::Send_Blocked, std::memory_order_relaxed);
+        }
+        return avail;
+    }
+
+    const double low = gConfig->GetSend_Queue_Low_Watermark();
+    const uint64_t socket_low = static_cast<uint64_t>(gConfig->GetSend_Queue_Socket_Limit() * low);
+    const uint64_t total_low = static_cast<uint64_t>(gConfig->GetSend_Queue_Total_Limit() * low);
+
+    std::unique_lock<std::mutex> lock(_drain_mutex);
+
+    // wait for the queue to drain below the low watermark, then let the whole call in (like a blocking send() does)
+    _drain_waiters++;
+    _drain_cond.wait(lock, [&] {
+        return (gConfig->GetSend_Queue_Socket_Limit() == 0 || state->queued_bytes.load(std::memory_order_relaxed) <= socket_low)
+            && (gConfig->GetSend_Queue_Total_Limit() == 0 || _queued_bytes.load(std::memory_order_relaxed) <= total_low);
+    });
+    _drain_waiters--;
+
+    state->queued_bytes.fetch_add(len, std::memory_order_relaxed);
+    _queued_bytes.fetch_add(len, std::memory_order_relaxed);
+
+    return len;
+}
+
+bool COutput_Timed_Queue::is_blocked(int target_socket) {
+    intcptor::TSocket_State* state = intcptor::socket_table.Find(target_socket);
+    if (!state || !(state->flags.load(std::memory_order_relaxed) & intcptor::Send_Blocked)) {
+        return false;
+    }
+
+    const double low = gConfig->GetSend_Queue_Low_Watermark();
+    const size_t socket_limit = gConfig->GetSend_Queue_Socket_Limit();
+    const size_t total_limit = gConfig->GetSend_Queue_Total_Limit();
+
+    if ((socket_limit > 0 && state->queued_bytes.load(std::memory_order_relaxed) > static_cast<uint64_t>(socket_limit * low))
+        || (total_limit > 0 && _queued_bytes.load(std::memory_order_relaxed) > static_cast<uint64_t>(total_limit * low))) {
+        return true;
+    }
+
+    state->flags.fetch_and(~static_cast<uint32_t>(intcptor::Send_Blocked), std::memory_order_relaxed);
+    return false;
+}
+
+void COutput_Timed_Queue::release(int target_socket, size_t len) {
+    if (intcptor::TSocket_State* state = intcptor::socket_table.Find(target_socket)) {
+        state->queued_bytes.fetch_sub(len, std::memory_order_relaxed);
+    }
+    _queued_bytes.fetch_sub(len, std::memory_order_relaxed);
+
+    if (_drain_waiters.load(std::memory_order_relaxed) > 0) {
+        // the waiters check the budgets under the drain mutex, so take it to not miss them
+        std::unique_lock<std::mutex> lock(_drain_mutex);
+        _drain_cond.notify_all();
+    }
+}
+
+bool COutput_Timed_Queue::shape(intcptor::TSocket_State* state, size_t len, TClock::time_point now, TClock::time_point& ready) {
+    const bool socket_shaped = state && _socket_bandwidth.Is_Enabled();
+    const bool total_shaped = _total_bandwidth.Is_Enabled();
+
+    if (!socket_shaped && !total_shaped) {
+        return true;
+    }
+
+    const int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+
+    int64_t ready_ns = now_ns;
+    if (socket_shaped) {
+        ready_ns = std::max(ready_ns, _socket_bandwidth.Ready_At(state->shaper_state));
+    }
+    if (total_shaped) {
+        ready_ns = std::max(ready_ns, _total_bandwidth.Ready_At(_total_shaper_state));
+    }
+
+    // the aggregate bucket is shared with other shards, so it may be drained by them between the check and the consumption;
+    // the socket bucket belongs to this worker only, so it is consumed only after the aggregate one let the data through
+    if (ready_ns > now_ns || (total_shaped && !_total_bandwidth.Try_Consume(_total_shaper_state, len, now_ns))) {
+        if (ready_ns <= now_ns) {
+            ready_ns = _total_bandwidth.Ready_At(_total_shaper_state);
+        }
+        ready = TClock::time_point(std::chrono::duration_cast<TClock::duration>(std::chrono::nanoseconds(ready_ns)));
+        return false;
+    }
+
+    if (socket_shaped) {
+        _socket_bandwidth.Try_Consume(state->shaper_state, len, now_ns);
+    }
+
+    return true;
 }
 
 void COutput_Timed_Queue::push(int target_socket, size_t delay, const char* data, size_t len) {
-    std::unique_lock<std::mutex> lock(_mutex);
-    _queue.push({target_socket, delay, std::vector<char>(data, data + len)});
-    _cond.notify_one();
+    push(target_socket, data, { { 0, len, delay } });
+}
+
+void COutput_Timed_Queue::push(int target_socket, const char* data, const std::vector<TFragment>& fragments) {
+    // the single segment is as long as the fragments need
+    size_t end = 0;
+    for (const auto& frag : fragments) {
+        end = std::max(end, frag.offset + frag.len);
+    }
+
+    const struct iovec iov = { const_cast<char*>(data), end };
+    push(target_socket, &iov, 1, fragments);
+}
+
+void COutput_Timed_Queue::push(int target_socket, const struct iovec* iov, size_t iovcnt, const std::vector<TFragment>& fragments) {
+    if (fragments.empty()) {
+        return;
+    }
+
+    // copy the caller's buffer just once; fragments only reference parts of the copy
+    size_t begin = fragments.front().offset;
+    size_t end = begin;
+    for (const auto& frag : fragments) {
+        begin = std::min(begin, frag.offset);
+        end = std::max(end, frag.offset + frag.len);
+    }
+
+    intcptor::TPayload_Block* block = intcptor::CPayload_Pool::Allocate(end - begin);
+
+    // gather the [begin, end) range of the logical stream
+    size_t stream_pos = 0;
+    char* dst = block->Data();
+    for (size_t i = 0; i < iovcnt && stream_pos < end; i++) {
+        const size_t seg_begin = stream_pos;
+        const size_t seg_end = stream_pos + iov[i].iov_len;
+        stream_pos = seg_end;
+
+        const size_t from = std::max(seg_begin, begin);
+        const size_t to = std::min(seg_end, end);
+        if (from < to) {
+            std::memcpy(dst, static_cast<const char*>(iov[i].iov_base) + (from - seg_begin), to - from);
+            dst += to - from;
+        }
+    }
+
+    const intcptor::CPayload_Slice whole(block, 0, end - begin);
+
+    std::vector<TOut_Data> entries;
+    entries.reserve(fragments.size());
+    for (const auto& frag : fragments) {
+        entries.push_back({ target_socket, 0, frag.delay, {}, whole.Share(frag.offset - begin, frag.len), nullptr, {} });
+    }
+
+    enqueue(target_socket, entries);
+}
+
+COutput_Timed_Queue::TFile_Source::~TFile_Source() {
+    orig::close(fd);
+    open_count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool COutput_Timed_Queue::push_file(int target_socket, int in_fd, const struct stat& st, off_t start, const std::vector<TFragment>& fragments) {
+    std::shared_ptr<TFile_Source> source;
+    {
+        std::unique_lock<std::mutex> lock(_files_mutex);
+
+        const auto key = std::make_pair(st.st_dev, st.st_ino);
+        auto itr = _file_sources.find(key);
+        if (itr != _file_sources.end()) {
+            source = itr->second.lock();
+        }
+
+        // the application may close (or seek) its descriptor before the fragments are sent, so the queue needs its own
+        if (!source) {
+            if (_open_files.load(std::memory_order_relaxed) >= Max_Open_Files) {
+                return false;
+            }
+
+            const int file_fd = ::fcntl(in_fd, F_DUPFD_CLOEXEC, 0);
+            if (file_fd < 0) {
+                return false;
+            }
+
+            source = std::make_shared<TFile_Source>(file_fd, _open_files);
+
+            // forget the files, whose fragments are all gone, before the map grows too much
+            if (itr == _file_sources.end() && _file_sources.size() >= 2 * Max_Open_Files) {
+                for (auto entry = _file_sources.begin(); entry != _file_sources.end(); ) {
+                    entry = entry->second.expired() ? _file_sources.erase(entry) : std::next(entry);
+                }
+            }
+            _file_sources[key] = source;
+        }
+    }
+
+    std::vector<TOut_Data> entries;
+    entries.reserve(fragments.size());
+    for (const auto& frag : fragments) {
+        const COutput_Backend::TFile_Chunk chunk = { source->fd, start + static_cast<off_t>(frag.offset), frag.len };
+        entries.push_back({ target_socket, 0, frag.delay, {}, {}, source, chunk });
+    }
+
+    enqueue(target_socket, entries);
+
+    return true;
 }
 
-void COutput_Timed_Queue::worker() {
-    while (_running) {
-        std::unique_lock<std::mutex> lock(_mutex);
-        _cond.wait_for(lock, std::chrono::milliseconds(100), [this] { return !_queue.empty() || !_running; });
+void COutput_Timed_Queue::enqueue(int target_socket, std::vector<TOut_Data>& fragments) {
+    if (fragments.empty()) {
+        return;
+    }
+
+    const intcptor::TSocket_State* state = intcptor::socket_table.Find(target_socket);
+    const uint32_t generation = state ? state->generation.load(std::memory_order_relaxed) : 0;
+
+    TShard& shard = Shard_Of(target_socket);
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    const auto now = TClock::now();
+
+    auto& sq = shard.socket_queues[target_socket];
 
-        while (!_queue.empty()) {
-            const TOut_Data data = std::move(_queue.front());
-            _queue.pop();
+    const bool was_empty = sq.fragments.empty();
 
-            lock.unlock();
+    for (auto& frag : fragments) {
+        // every piece of data is due at the time of push plus its own delay, regardless of other sockets
+        auto due = now + std::chrono::milliseconds(frag.delay);
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(data.delay)));
+        // ...but it must not overtake data previously pushed to the same socket
+        if (!sq.fragments.empty() && sq.fragments.back().generation == generation && sq.fragments.back().due > due) {
+            due = sq.fragments.back().due;
+        }
+
+        frag.generation = generation;
+        frag.due = due;
+        sq.fragments.push_back(std::move(frag));
+    }
+
+    // the socket queue was idle, schedule its new head; otherwise, the head is already scheduled (or being sent)
+    if (was_empty) {
+        sq.scheduled = sq.fragments.front().due;
+        shard.schedule.push({sq.scheduled, target_socket});
+        shard.cond.notify_one();
+    }
+}
+
+size_t COutput_Timed_Queue::drain(int target_socket, std::chrono::milliseconds linger) {
+    TShard& shard = Shard_Of(target_socket);
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    if (shard.socket_queues.find(target_socket) == shard.socket_queues.end()) {
+        return 0;
+    }
+
+    auto queue_gone = [&shard, target_socket] {
+        return shard.socket_queues.find(target_socket) == shard.socket_queues.end();
+    };
+
+    shard.drain_waiters++;
+
+    // let the queued data go out (with their delays), as long as the linger time allows
+    if (linger.count() > 0) {
+        shard.drained.wait_for(lock, linger, queue_gone);
+    }
+
+    // the fragments being sent right now are waited for in any case, so they do not race with the close of the descriptor
+    shard.drained.wait_for(lock, In_Flight_Wait, [&] {
+        return queue_gone() || shard.socket_queues[target_socket].in_flight == 0;
+    });
+
+    shard.drain_waiters--;
+
+    auto itr = shard.socket_queues.find(target_socket);
+    if (itr == shard.socket_queues.end()) {
+        return 0;
+    }
+
+    // discard everything not handed over to the backend; the schedule entry of the queue stays, and it is skipped later
+    auto& sq = itr->second;
+    size_t discarded = 0;
+    for (size_t i = sq.in_flight; i < sq.fragments.size(); i++) {
+        discarded += sq.fragments[i].size();
+        release(target_socket, sq.fragments[i].size());
+    }
+    sq.fragments.erase(sq.fragments.begin() + static_cast<std::ptrdiff_t>(sq.in_flight), sq.fragments.end());
+
+    if (sq.fragments.empty()) {
+        shard.socket_queues.erase(itr);
+    }
+
+    if (discarded > 0) {
+        intcptor::Stat(intcptor::NStat::Discarded_Bytes, discarded);
+    }
+
+    return discarded;
+}
 
-            lock.lock();
+void COutput_Timed_Queue::worker(TShard& shard) {
+    // the fragments taken from a single socket queue in the current tick
+    struct TTaken {
+        int target_socket;
+        // the fragments of a closed socket at the front of the queue, that are just dropped
+        size_t discarded;
+        // the fragments handed over to the backend, starting at batch_begin in the batch
+        size_t count;
+        size_t batch_begin;
+        // the bandwidth limits stopped the socket queue until this time
+        TClock::time_point throttled_until;
+    };
 
-            if (gConfig->Is_Log_Enabled()) {
-                std::cout << "[[InTCPtor: sending " << std::string(data.data.data(), data.data.size()) << " bytes to socket " << data.target_socket << " after delay of " << data.delay << " ms]]" << std::endl;
+    // all fragments due in the current tick, the bytes of each of them, that are done with, and the fragments taken from
+    // each socket queue
+    std::vector<COutput_Backend::TSend_Item> batch;
+    std::vector<size_t> batch_sent;
+    std::vector<TTaken> taken;
+
+    // a send to a connection broken meanwhile must not kill the application with SIGPIPE; the buffers are sent with
+    // MSG_NOSIGNAL, but sendfile() takes no flags
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    while (shard.running) {
+
+        if (shard.schedule.empty()) {
+            shard.cond.wait(lock, [&shard] { return !shard.schedule.empty() || !shard.running; });
+            continue;
+        }
+
+        const auto now = TClock::now();
+
+        const auto due = shard.schedule.top().due;
+        if (due > now) {
+            // wait for the earliest deadline; a push with earlier deadline wakes us up sooner
+            shard.cond.wait_until(lock, due);
+            continue;
+        }
+
+        batch.clear();
+        taken.clear();
+
+        while (!shard.schedule.empty() && shard.schedule.top().due <= now) {
+            const TSchedule_Entry entry = shard.schedule.top();
+            const int target_socket = entry.target_socket;
+            shard.schedule.pop();
+
+            // the queue was discarded (and maybe created again) by drain() since the entry was scheduled
+            auto sq_itr = shard.socket_queues.find(target_socket);
+            if (sq_itr == shard.socket_queues.end() || sq_itr->second.scheduled != entry.due) {
+                continue;
+            }
+
+            // the fragments stay in the socket queue while sending, so the concurrent push does not schedule the socket
+            // again (references to deque elements are not invalidated by push_back)
+            auto& sq = sq_itr->second;
+            intcptor::TSocket_State* state = intcptor::socket_table.Find(target_socket);
+
+            // data pushed before the descriptor was closed must not reach the socket, that reuses its number; this
+            // covers the sockets closed without our close() (e.g., by fclose() of a stream), as the new socket is tracked
+            // with a new generation
+            const uint32_t generation = state ? state->generation.load(std::memory_order_relaxed) : 0;
+
+            size_t discarded = 0;
+            size_t sent = 0;
+            const size_t batch_begin = batch.size();
+            auto throttled_until = TClock::time_point::min();
+            for (auto& data : sq.fragments) {
+                if (state && data.generation != generation) {
+                    // the discarded fragments must form the front of the queue; the rest waits for the next tick
+                    if (sent > 0) {
+                        break;
+                    }
+                    if (gConfig->Is_Log_Enabled()) {
+                        intcptor::Log(intcptor::NLog_Event::Queue_Discarded, target_socket, static_cast<int64_t>(data.size()));
+                    }
+                    intcptor::Stat(intcptor::NStat::Discarded_Bytes, data.size());
+                    discarded++;
+                    continue;
+                }
+
+                if (data.due > now) {
+                    break;
+                }
+
+                // the simulated link is busy; the rest of the socket queue waits, until the buckets let the fragment through
+                // (the remainder of a fragment, that the socket did not take completely, went through them already)
+                if (!data.shaped && !shape(state, data.size(), now, throttled_until)) {
+                    intcptor::Stat(intcptor::NStat::Send_Throttled);
+                    break;
+                }
+                data.shaped = true;
+
+                if (gConfig->Is_Log_Enabled()) {
+                    intcptor::Log(intcptor::NLog_Event::Queue_Send, data.target_socket, static_cast<int64_t>(data.size()), static_cast<int64_t>(data.delay));
+                }
+
+                if (data.file) {
+                    batch.push_back({ target_socket, nullptr, sent > 0, &data.chunk });
+                }
+                else {
+                    batch.push_back({ target_socket, &data.data, sent > 0 });
+                }
+                sent++;
+            }
+
+            sq.in_flight = discarded + sent;
+            taken.push_back({ target_socket, discarded, sent, batch_begin, throttled_until });
+        }
+
+        lock.unlock();
+
+        // the backend never waits for a socket, so a peer, that does not read, holds up only its own socket queue
+        shard.backend->send_batch(batch, batch_sent);
+
+        if (gCapture_Writer->Is_Enabled()) {
+            std::vector<char> file_data;
+            for (size_t i = 0; i < batch.size(); i++) {
+                const auto& item = batch[i];
+                if (batch_sent[i] == 0) {
+                    continue;
+                }
+                if (item.file) {
+                    // the file data never pass through the user space otherwise, so they are read just for the capture
+                    file_data.resize(batch_sent[i]);
+                    const ssize_t len = ::pread(item.file->fd, file_data.data(), file_data.size(), item.file->offset);
+                    if (len > 0) {
+                        gCapture_Writer->capture(item.target_socket, CCapture_Writer::NDirection::Out, file_data.data(), static_cast<size_t>(len));
+                    }
+                }
+                else {
+                    gCapture_Writer->capture(item.target_socket, CCapture_Writer::NDirection::Out, item.data->data(), batch_sent[i]);
+                }
             }
-            orig::send(data.target_socket, data.data.data(), data.data.size(), 0);
+        }
+
+        if (gStats->Is_Enabled()) {
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (batch_sent[i] == 0) {
+                    continue;
+                }
+                gStats->Add(intcptor::NStat::Sent_Fragments, 1);
+                gStats->Add(intcptor::NStat::Sent_Bytes, batch_sent[i]);
+                gStats->Add_Socket(batch[i].target_socket, intcptor::NSocket_Stat::Sent_Bytes, batch_sent[i]);
+            }
+        }
+
+        lock.lock();
+
+        const auto retry = TClock::now() + Blocked_Retry;
+
+        for (const auto& socket_taken : taken) {
+            const int target_socket = socket_taken.target_socket;
+            // drain() never removes a queue with fragments in flight
+            auto& sq = shard.socket_queues[target_socket];
+
+            for (size_t i = 0; i < socket_taken.discarded; i++) {
+                release(target_socket, sq.fragments.front().size());
+                sq.fragments.pop_front();
+            }
+
+            // the socket did not take all the data; the remainder stays at the front of the queue
+            bool blocked = false;
+            for (size_t i = 0; i < socket_taken.count; i++) {
+                const size_t done = batch_sent[socket_taken.batch_begin + i];
+                auto& front = sq.fragments.front();
+
+                release(target_socket, done);
+                if (done < front.size()) {
+                    if (front.file) {
+                        front.chunk.offset += static_cast<off_t>(done);
+                        front.chunk.len -= done;
+                    }
+                    else {
+                        front.data.Advance(done);
+                    }
+                    blocked = true;
+                    break;
+                }
+                sq.fragments.pop_front();
+            }
+            sq.in_flight = 0;
+
+            if (sq.fragments.empty()) {
+                shard.socket_queues.erase(target_socket);
+            }
+            else {
+                sq.scheduled = blocked ? retry : std::max(sq.fragments.front().due, socket_taken.throttled_until);
+                shard.schedule.push({sq.scheduled, target_socket});
+            }
+        }
+
+        if (shard.drain_waiters > 0) {
+            shard.drained.notify_all();
         }
     }
 }
@@ -7,36 +7,193 @@
 #pragma once
 
 #include <thread>
+#include <mutex>
 #include <chrono>
 #include <condition_variable>
 #include <queue>
+#include <deque>
+#include <unordered_map>
+#include <map>
 #include <vector>
 #include <memory>
+#include <atomic>
+
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "payload_pool.hpp"
+#include "token_bucket.hpp"
+#include "output_backend.hpp"
+#include "socket_table.hpp"
 
 class COutput_Timed_Queue {
     public:
-        using TPtr = std::unique_ptr<COutput_Timed_Queue>;
+        using TClock = std::chrono::steady_clock;
+
+        // a part of a buffer to be sent with given delay
+        struct TFragment {
+            size_t offset;
+            size_t len;
+            size_t delay;
+        };
+
+        // how long drain() waits for the fragments, that are being sent, at most; the backend never waits for a socket, so
+        // this only bounds a slow batch
+        static constexpr std::chrono::milliseconds In_Flight_Wait{ 1000 };
+
+        // how soon a socket, that did not take all its due data (its peer does not read), is tried again
+        static constexpr std::chrono::milliseconds Blocked_Retry{ 5 };
+
+        // how many files may be held open for the queued sendfile() fragments at most; the application must not run out
+        // of descriptors because of us
+        static constexpr size_t Max_Open_Files = 256;
 
         COutput_Timed_Queue();
 
         virtual ~COutput_Timed_Queue();
 
+        // stops the shard workers; the data still queued are not sent
+        void Stop();
+
+        // reserves space for len bytes in the budget of given socket and in the global budget; the space is released when
+        // the data is actually sent; every pushed byte must be reserved first
+        // if there is not enough space and the call is blocking, waits until the queue drains below the low watermark and
+        // reserves the whole len; if the call is non-blocking (MSG_DONTWAIT in flags, or O_NONBLOCK set on the socket),
+        // reserves only what is left (possibly zero)
+        size_t reserve(int target_socket, size_t len, int flags);
+
+        // true if a non-blocking call was cut short on the socket, and the queue did not drain below the low watermark since
+        // then; such socket is not reported as writable by the intercepted poll(), select() and epoll calls
+        bool is_blocked(int target_socket);
+
         void push(int target_socket, size_t delay, const char* data, size_t len);
+        // pushes all fragments of a single buffer at once, so they are not interleaved with fragments pushed by other threads
+        void push(int target_socket, const char* data, const std::vector<TFragment>& fragments);
+        // the same for a scatter-gather buffer; fragment offsets refer to the logical byte stream of all segments, and the
+        // segments are gathered directly to the pooled copy
+        void push(int target_socket, const struct iovec* iov, size_t iovcnt, const std::vector<TFragment>& fragments);
+        // pushes fragments of a file, that are sent later with sendfile() directly from the file; fragment offsets are
+        // relative to start; all queued fragments of the same file share a single private duplicate of the descriptor,
+        // which is closed once the last of them is sent or discarded; returns false (and pushes nothing), if the file can't
+        // be held open (too many files queued already, or no descriptor left), so the caller has to copy the data
+        bool push_file(int target_socket, int in_fd, const struct stat& st, off_t start, const std::vector<TFragment>& fragments);
+
+        // returns the part of a reservation, that was not pushed after all
+        void cancel(int target_socket, size_t len) { release(target_socket, len); }
+
+        // called before the socket is closed (or shut down for writing); waits up to linger for the data queued for the
+        // socket to be sent, then discards the rest, so nothing is sent to the descriptor once it is reused; returns the
+        // number of discarded bytes
+        size_t drain(int target_socket, std::chrono::milliseconds linger);
 
     private:
-        void worker();
+        struct TShard;
+
+        void worker(TShard& shard);
+
+        // returns the space of sent data to the budgets
+        void release(int target_socket, size_t len);
+
+        // the shard, the socket belongs to; all data of a single socket always go through the same shard
+        TShard& Shard_Of(int target_socket) {
+            return *_shards[static_cast<unsigned>(target_socket) % _shards.size()];
+        }
+
+        // lets len bytes of the socket through the bandwidth limits at time now; if the limits do not allow it, returns
+        // false and sets ready to the time, when the data may be tried again
+        bool shape(intcptor::TSocket_State* state, size_t len, TClock::time_point now, TClock::time_point& ready);
+
+        // how many bytes may be reserved for the socket right now without exceeding any limit
+        size_t available(const intcptor::TSocket_State& state) const;
+
+        // descriptor of a file shared by all queued fragments of the file
+        struct TFile_Source {
+            int fd;
+            // number of the open sources, see _open_files
+            std::atomic<size_t>& open_count;
+
+            TFile_Source(int file_fd, std::atomic<size_t>& count) : fd(file_fd), open_count(count) {
+                open_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            ~TFile_Source();
+        };
 
         struct TOut_Data {
             int target_socket;
+            // generation of the socket record at the time of push (see TSocket_State::generation); data of an older
+            // generation belong to a socket, that was closed, and they are dropped instead of sent to its successor
+            uint32_t generation;
             size_t delay;
-            std::vector<char> data;
+            // absolute time, when the data should be sent
+            TClock::time_point due;
+            // slice of the pooled copy of the buffer passed to send(); all fragments of a single call share one block
+            intcptor::CPayload_Slice data;
+            // set instead of data, if the fragment is a part of a file passed to sendfile()
+            std::shared_ptr<TFile_Source> file;
+            COutput_Backend::TFile_Chunk chunk{};
+            // the fragment went through the bandwidth limits already (only its remainder is left to be sent)
+            bool shaped = false;
+
+            size_t size() const { return file ? chunk.len : data.size(); }
         };
 
-        std::thread _worker;
-        std::mutex _mutex;
-        std::condition_variable _cond;
-        std::queue<TOut_Data> _queue;
-        bool _running = true;
+        // assigns the generation and due times to the fragments of a single call and appends them to the socket queue
+        void enqueue(int target_socket, std::vector<TOut_Data>& fragments);
+
+        // FIFO queue of a single socket; the order of data within a single socket is always preserved
+        struct TSocket_Queue {
+            std::deque<TOut_Data> fragments;
+            // fragments at the front, that the worker is sending right now (it does not hold the shard lock meanwhile)
+            size_t in_flight = 0;
+            // due time of the schedule entry of this queue; entries with other due time are outdated and skipped
+            TClock::time_point scheduled;
+        };
+
+        // entry of the schedule heap - refers to the head of a single socket queue
+        struct TSchedule_Entry {
+            TClock::time_point due;
+            int target_socket;
+
+            bool operator>(const TSchedule_Entry& other) const {
+                return due > other.due;
+            }
+        };
+
+        // independent part of the queue with its own lock and worker thread; sockets are assigned by their descriptor number
+        struct TShard {
+            // sends the fragments due in a single tick
+            COutput_Backend::TPtr backend;
+            std::thread worker;
+            std::mutex mutex;
+            std::condition_variable cond;
+            std::unordered_map<int, TSocket_Queue> socket_queues;
+            // min-heap of socket queue heads, ordered by their due time; there is at most one valid entry per socket
+            std::priority_queue<TSchedule_Entry, std::vector<TSchedule_Entry>, std::greater<TSchedule_Entry>> schedule;
+            // signalled after a batch is sent, if some drain() call waits for its socket queue
+            std::condition_variable drained;
+            size_t drain_waiters = 0;
+            bool running = true;
+        };
+
+        // open file sources by the file identity (device, inode); the entries expire with the last fragment of the file
+        // (declared before the shards, as the fragments in the shards refer to the counter)
+        std::mutex _files_mutex;
+        std::map<std::pair<dev_t, ino_t>, std::weak_ptr<TFile_Source>> _file_sources;
+        std::atomic<size_t> _open_files{ 0 };
+
+        std::vector<std::unique_ptr<TShard>> _shards;
+
+        // the budgets are shared by all shards; blocked reservations wait here for any shard to drain
+        std::mutex _drain_mutex;
+        // signalled when some socket queue drains below the low watermark
+        std::condition_variable _drain_cond;
+        std::atomic<size_t> _drain_waiters{ 0 };
+        std::atomic<uint64_t> _queued_bytes{ 0 };
+
+        // bandwidth limits; the state of the per-socket bucket is kept in the socket table, the aggregate state is here
+        intcptor::CToken_Bucket _socket_bandwidth;
+        intcptor::CToken_Bucket _total_bandwidth;
+        std::atomic<int64_t> _total_shaper_state{ 0 };
 };
 
-extern COutput_Timed_Queue::TPtr gOutput_Timed_Queue;
+extern COutput_Timed_Queue* gOutput_Timed_Queue;
@@ -10,263 +10,1222 @@
 
 #include <dlfcn.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
-#include <iostream>
-#include <mutex>
+#include <fcntl.h>
+
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
 
 #include "overrides.hpp"
 #include "config.hpp"
 
 #include "output_timed_queue.hpp"
+#include "input_delay_stage.hpp"
+#include "random_socket_closer.hpp"
+#include "capture_writer.hpp"
+#include "logger.hpp"
+#include "stats.hpp"
 
 // original socket-related functions
 namespace orig {
     int (*socket)(int, int, int) = nullptr;
     int (*close)(int) = nullptr;
     int (*accept)(int, struct sockaddr*, socklen_t*) = nullptr;
+    int (*accept4)(int, struct sockaddr*, socklen_t*, int) = nullptr;
+    int (*connect)(int, const struct sockaddr*, socklen_t) = nullptr;
     ssize_t (*recv)(int, void*, size_t, int) = nullptr;
     ssize_t (*send)(int, const void*, size_t, int) = nullptr;
     ssize_t (*read)(int, void*, size_t) = nullptr;
     ssize_t (*write)(int, const void*, size_t) = nullptr;
     int (*shutdown)(int, int) = nullptr;
-}
-
-namespace intcptor {
-    std::set<int> created_sockets;
-    std::set<int> managed_sockets;
-    std::recursive_mutex glob_mutex;
+    ssize_t (*writev)(int, const struct iovec*, int) = nullptr;
+    ssize_t (*sendto)(int, const void*, size_t, int, const struct sockaddr*, socklen_t) = nullptr;
+    ssize_t (*sendmsg)(int, const struct msghdr*, int) = nullptr;
+    int (*sendmmsg)(int, struct mmsghdr*, unsigned int, int) = nullptr;
+    ssize_t (*readv)(int, const struct iovec*, int) = nullptr;
+    ssize_t (*recvmsg)(int, struct msghdr*, int) = nullptr;
+    int (*recvmmsg)(int, struct mmsghdr*, unsigned int, int, struct timespec*) = nullptr;
+    int (*listen)(int, int) = nullptr;
+    int (*poll)(struct pollfd*, nfds_t, int) = nullptr;
+    int (*ppoll)(struct pollfd*, nfds_t, const struct timespec*, const sigset_t*) = nullptr;
+    int (*select)(int, fd_set*, fd_set*, fd_set*, struct timeval*) = nullptr;
+    int (*epoll_ctl)(int, int, int, struct epoll_event*) = nullptr;
+    int (*epoll_wait)(int, struct epoll_event*, int, int) = nullptr;
+    int (*epoll_pwait)(int, struct epoll_event*, int, int, const sigset_t*) = nullptr;
+    int (*ioctl)(int, unsigned long, ...) = nullptr;
+    ssize_t (*sendfile)(int, int, off_t*, size_t) = nullptr;
+    ssize_t (*sendfile64)(int, int, off64_t*, size_t) = nullptr;
+    ssize_t (*splice)(int, loff_t*, int, loff_t*, size_t, unsigned int) = nullptr;
 }
 
 // override socket() to track created sockets
 extern "C" int socket(int domain, int type, int protocol) {
 
-    std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
-
     int res = orig::socket(domain, type, protocol);
 
     if (gConfig->Is_Log_Enabled()) {
-        std::cout << "[[InTCPtor: overriden socket() call, result = " << res << "]]" << std::endl;
+        intcptor::Log(intcptor::NLog_Event::Socket, res, res);
     }
 
-    intcptor::created_sockets.insert(res);
+    if (res >= 0) {
+        const bool stream = (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) == SOCK_STREAM;
+        intcptor::socket_table.Track(res, intcptor::NSocket_Kind::Created, stream ? static_cast<uint32_t>(intcptor::Stream) : 0u);
+        intcptor::Stat_Socket_Opened(res);
+    }
 
     return res;
 }
 
+namespace {
+
+    // sends the data queued for the socket within the linger time, and discards the rest, so they never reach a socket,
+    // that reuses the fd number
+    void Drain_Output(int fd) {
+        const size_t discarded = gOutput_Timed_Queue->drain(fd, std::chrono::milliseconds(gConfig->GetClose_Linger_Ms()));
+
+        if (discarded > 0 && gConfig->Is_Log_Enabled()) {
+            intcptor::Log(intcptor::NLog_Event::Queue_Discarded, fd, static_cast<int64_t>(discarded));
+        }
+    }
+}
+
 // override close() to track closed sockets
 extern "C" int close(int fd) {
 
-    std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
+    // drop held data and epoll registrations before the fd number can be reused
+    if (gInput_Delay_Stage) {
+        gInput_Delay_Stage->forget(fd);
+    }
+
+    if (gOutput_Timed_Queue && intcptor::socket_table.Is_Tracked(fd)) {
+        Drain_Output(fd);
+    }
+
+    if (gCapture_Writer && intcptor::socket_table.Is_Tracked(fd)) {
+        gCapture_Writer->forget(fd);
+    }
+
+    const auto kind = intcptor::socket_table.Untrack(fd);
 
-    if (intcptor::created_sockets.find(fd) != intcptor::created_sockets.end()) {
+    if (kind != intcptor::NSocket_Kind::None) {
+        intcptor::Stat_Socket_Closed(fd);
+    }
+
+    if (kind == intcptor::NSocket_Kind::Created) {
         if (gConfig->Is_Log_Enabled()) {
-            std::cout << "[[InTCPtor: overriden close() call for server socket fd = " << fd << "]]" << std::endl;
+            intcptor::Log(intcptor::NLog_Event::Close_Created, fd);
         }
-        intcptor::created_sockets.erase(fd);
     }
-    else if (intcptor::managed_sockets.find(fd) != intcptor::managed_sockets.end()) {
+    else if (kind == intcptor::NSocket_Kind::Managed) {
+        if (gRandom_Socket_Closer) {
+            gRandom_Socket_Closer->remove(fd);
+        }
         if (gConfig->Is_Log_Enabled()) {
-            std::cout << "[[InTCPtor: overriden close() call for client socket fd = " << fd << "]]" << std::endl;
+            intcptor::Log(intcptor::NLog_Event::Close_Managed, fd);
         }
-        intcptor::managed_sockets.erase(fd);
     }
     else {
         if (gConfig->Is_Log_Enabled()) {
-            std::cout << "[[InTCPtor: overriden close() call for non-managed fd = " << fd << "]]" << std::endl;
+            intcptor::Log(intcptor::NLog_Event::Close_Unmanaged, fd);
         }
     }
 
     return orig::close(fd);
 }
 
+namespace {
+
+    // starts tracking a socket returned by accept() or accept4()
+    void Track_Accepted(int fd) {
+        intcptor::socket_table.Track(fd, intcptor::NSocket_Kind::Managed, intcptor::Stream);
+        intcptor::Stat_Socket_Opened(fd);
+        // bind the fault profile right away, so the addresses are looked up off the data path
+        static_cast<void>(gConfig->Profile_Of(fd));
+
+        if (gRandom_Socket_Closer) {
+            gRandom_Socket_Closer->add(fd);
+        }
+    }
+}
+
 // override accept() to track accepted sockets
 extern "C" int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
 
-    //std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
-    // not locking here, as accept call may block
-
     int res = orig::accept(sockfd, addr, addrlen);
 
     if (gConfig->Is_Log_Enabled()) {
-        std::cout << "[[InTCPtor: overriden accept() call, result = " << res << "]]" << std::endl;
+        intcptor::Log(intcptor::NLog_Event::Accept, res, res);
     }
 
-    intcptor::managed_sockets.insert(res);
+    if (res >= 0) {
+        Track_Accepted(res);
+    }
 
     return res;
 }
 
-// override recv() to simulate network trouble
-extern "C" ssize_t recv(int sockfd, void *buf, size_t count, int flags) {
+// override accept4() to track accepted sockets; this is what most event loops call instead of accept()
+extern "C" int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+
+    int res = orig::accept4(sockfd, addr, addrlen, flags);
+
+    if (gConfig->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Accept4, res, res);
+    }
+
+    if (res >= 0) {
+        Track_Accepted(res);
+    }
+
+    return res;
+}
 
-    std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
+// override connect() to simulate the connection setup latency
+extern "C" int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
-    if (count > 2) {
+    auto* state = intcptor::socket_table.Is_Tracked(sockfd) ? intcptor::socket_table.Find(sockfd) : nullptr;
+    if (!state) {
+        return orig::connect(sockfd, addr, addrlen);
+    }
+
+    if (!(state->flags.load(std::memory_order_relaxed) & intcptor::Stream)) {
+        const int res = orig::connect(sockfd, addr, addrlen);
+        // a datagram socket is matched by the rules with its new peer
+        state->profile.store(0, std::memory_order_relaxed);
+        return res;
+    }
+
+    // the application polls the completion of a non-blocking connect() by calling it again
+    if (state->connect_ready_ns.load(std::memory_order_acquire) != 0) {
+        if (intcptor::Is_Connecting(sockfd, std::chrono::steady_clock::now())) {
+            errno = EALREADY;
+            return -1;
+        }
+        // the kernel reports the result of the real handshake (EISCONN, or the error)
+        state->connect_ready_ns.store(0, std::memory_order_relaxed);
+        return orig::connect(sockfd, addr, addrlen);
+    }
+
+    const auto config = gConfig.Acquire();
 
-        const double chance = gConfig->Generate_Base_Prob();
+    const int res = orig::connect(sockfd, addr, addrlen);
+    if (res < 0 && errno != EINPROGRESS) {
+        if (config->Is_Log_Enabled()) {
+            intcptor::Log(intcptor::NLog_Event::Connect, sockfd, res, 0);
+        }
+        return res;
+    }
+
+    // the peer is known now, even if the connection is not established yet
+    const auto& profile = config->Bind_Profile(sockfd, addr, addrlen);
+
+    const double delay = profile.Is_Connect_Delay_Enabled() ? std::max(0.0, config->Generate_Connect_Delay(sockfd, profile)) : 0.0;
+
+    if (config->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Connect, sockfd, res, static_cast<int64_t>(delay));
+    }
 
-        if (chance < gConfig->GetProb_Recv_Total()) {
+    if (delay <= 0) {
+        return res;
+    }
+
+    const auto delay_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(delay));
+
+    // a blocking call returns after the handshake; a non-blocking one reports it in progress, and the socket becomes
+    // writable once the delay passes (see the readiness virtualization of the input delay stage)
+    if (!(::fcntl(sockfd, F_GETFL) & O_NONBLOCK)) {
+        std::this_thread::sleep_for(delay_duration);
+        return res;
+    }
+
+    const auto ready = std::chrono::steady_clock::now() + delay_duration;
+    state->connect_ready_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(ready.time_since_epoch()).count(), std::memory_order_release);
+    if (gInput_Delay_Stage) {
+        gInput_Delay_Stage->virtualize_output(sockfd);
+    }
+
+    errno = EINPROGRESS;
+    return -1;
+}
+
+// override listen() to tell listening sockets apart; their readiness means an incoming connection, not data
+extern "C" int listen(int sockfd, int backlog) {
+
+    const int res = orig::listen(sockfd, backlog);
+
+    if (res == 0) {
+        if (auto* state = intcptor::socket_table.Find(sockfd)) {
+            state->flags.fetch_or(intcptor::Listening, std::memory_order_relaxed);
+        }
+    }
+
+    return res;
+}
+
+namespace {
+
+    // total length of all segments
+    size_t Iov_Length(const struct iovec* iov, size_t iovcnt) {
+        size_t total = 0;
+        for (size_t i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+
+    // applies the short-read decision to the requested byte count; this is the common part of recv() and its variants
+    size_t Adjust_Recv_Count(int sockfd, size_t count) {
+
+        if (count <= 2) {
+            return count;
+        }
+
+        // the profile is a part of the snapshot, it must not outlive it
+        const auto config = gConfig.Acquire();
+        const double chance = config->Generate_Base_Prob(sockfd, intcptor::NDecision::Recv_Trim);
+        const auto& profile = config->Profile_Of(sockfd);
+
+        if (chance < profile.Prob_Recv_Total()) {
             const size_t orig = count;
-            if (chance < gConfig->GetProb_Recv__1B_Less()) {
+            if (chance < profile.prob_recv_1b_less) {
                 count -= 1;
             }
-            else if (chance < gConfig->GetProb_Recv__1B_Less() + gConfig->GetProb_Recv__2B_Less()) {
+            else if (chance < profile.prob_recv_1b_less + profile.prob_recv_2b_less) {
                 count /= 2;
             }
-            else if (chance < gConfig->GetProb_Recv__1B_Less() + gConfig->GetProb_Recv__2B_Less() + gConfig->GetProb_Recv__Half()) {
+            else if (chance < profile.prob_recv_1b_less + profile.prob_recv_2b_less + profile.prob_recv_half) {
                 count = 2;
             }
             else {
                 count -= 2;
             }
 
-            if (gConfig->Is_Log_Enabled()) {
-                std::cout << "[[InTCPtor: recv() original count = " << orig << ", adjusted = " << count << "]]" << std::endl;
+            if (config->Is_Log_Enabled()) {
+                intcptor::Log(intcptor::NLog_Event::Recv_Adjusted, sockfd, static_cast<int64_t>(orig), static_cast<int64_t>(count));
             }
+
+            intcptor::Stat(intcptor::NStat::Recv_Short);
+            intcptor::Stat_Socket(sockfd, intcptor::NSocket_Stat::Recv_Short);
         }
+
+        return count;
     }
 
-    // no longer needed
-    lock.unlock();
+    // passes the data returned to the application to the capture; peeked data are captured once they are actually read
+    void Capture_Recv(int sockfd, const struct iovec* iov, size_t iovcnt, ssize_t res, int flags) {
+        if (res > 0 && !(flags & MSG_PEEK) && gCapture_Writer && gCapture_Writer->Is_Enabled()) {
+            gCapture_Writer->capture(sockfd, CCapture_Writer::NDirection::In, iov, iovcnt, static_cast<size_t>(res));
+        }
+    }
 
-    ssize_t res = orig::recv(sockfd, buf, count, flags);
+    void Account_Recv(int sockfd, ssize_t res) {
 
-    if (gConfig->Is_Log_Enabled()) {
-        std::cout << "[[InTCPtor: overriden recv() call, result = " << res << "]]" << std::endl;
+        if (gConfig->Is_Log_Enabled()) {
+            intcptor::Log(intcptor::NLog_Event::Recv, sockfd, res);
+        }
+
+        intcptor::Stat(intcptor::NStat::Recv_Calls);
+        if (res > 0) {
+            intcptor::Stat(intcptor::NStat::Recv_Bytes, static_cast<uint64_t>(res));
+            intcptor::Stat_Socket(sockfd, intcptor::NSocket_Stat::Recv_Bytes, static_cast<uint64_t>(res));
+        }
+
+        if (auto* state = intcptor::socket_table.Find(sockfd)) {
+            state->recv_calls.fetch_add(1, std::memory_order_relaxed);
+            if (res > 0) {
+                state->bytes_received.fetch_add(static_cast<uint64_t>(res), std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // is the received data of the fd held by the input delay stage?
+    bool Is_Delayed(int fd) {
+        return gInput_Delay_Stage && gInput_Delay_Stage->Is_Delayed(fd);
+    }
+
+    // is the fd a tracked stream socket? the short reads are simulated only on streams, a shortened datagram would be
+    // truncated by the kernel and its rest lost
+    bool Is_Stream(int fd) {
+        if (!intcptor::socket_table.Is_Tracked(fd)) {
+            return false;
+        }
+        const auto* state = intcptor::socket_table.Find(fd);
+        return state && (state->flags.load(std::memory_order_relaxed) & intcptor::Stream);
+    }
+
+    // the messages (or segments) of a single call, for which the bookkeeping fits to the stack
+    constexpr size_t Local_Vector_Count = 16;
+
+    // shortens an iovec array in place to given total capacity, and restores it afterwards
+    // the caller's array is modified only for the duration of the original call, so no segment is copied
+    struct TIov_Trim {
+        static constexpr size_t No_Cut = static_cast<size_t>(-1);
+
+        size_t orig_iovcnt = 0;
+        size_t cut_index = No_Cut;
+        size_t cut_orig_len = 0;
+
+        void Apply(struct iovec* iov, size_t& iovcnt, size_t capacity) {
+            orig_iovcnt = iovcnt;
+
+            size_t total = 0;
+            for (size_t i = 0; i < iovcnt; i++) {
+                if (total + iov[i].iov_len >= capacity) {
+                    cut_index = i;
+                    cut_orig_len = iov[i].iov_len;
+                    iov[i].iov_len = capacity - total;
+                    iovcnt = i + 1;
+                    return;
+                }
+                total += iov[i].iov_len;
+            }
+        }
+
+        void Restore(struct iovec* iov, size_t& iovcnt) const {
+            if (cut_index != No_Cut) {
+                iov[cut_index].iov_len = cut_orig_len;
+            }
+            iovcnt = orig_iovcnt;
+        }
+    };
+}
+
+// override recv() to simulate network trouble
+extern "C" ssize_t recv(int sockfd, void *buf, size_t count, int flags) {
+
+    count = Adjust_Recv_Count(sockfd, count);
+
+    ssize_t res;
+    if (Is_Delayed(sockfd)) {
+        const struct iovec iov = { buf, count };
+        res = gInput_Delay_Stage->receive(sockfd, &iov, 1, flags);
+    }
+    else {
+        res = orig::recv(sockfd, buf, count, flags);
     }
 
+    const struct iovec captured = { buf, count };
+    Capture_Recv(sockfd, &captured, 1, res, flags);
+
+    Account_Recv(sockfd, res);
+
     return res;
 }
 
-// override send() to simulate network trouble
-extern "C" ssize_t send(int sockfd, const void *buf, size_t count, int flags) {
+// override recvmsg() to simulate network trouble
+extern "C" ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+
+    if (!Is_Stream(sockfd)) {
+        return orig::recvmsg(sockfd, msg, flags);
+    }
+
+    const size_t capacity = Adjust_Recv_Count(sockfd, Iov_Length(msg->msg_iov, msg->msg_iovlen));
+
+    TIov_Trim trim;
+    trim.Apply(msg->msg_iov, msg->msg_iovlen, capacity);
+
+    ssize_t res;
+    if (Is_Delayed(sockfd)) {
+        // the held data carry no ancillary data
+        res = gInput_Delay_Stage->receive(sockfd, msg->msg_iov, msg->msg_iovlen, flags);
+        msg->msg_controllen = 0;
+        msg->msg_flags = 0;
+    }
+    else {
+        // msg_flags (and control data) are filled by the kernel directly to the caller's header
+        res = orig::recvmsg(sockfd, msg, flags);
+    }
+
+    trim.Restore(msg->msg_iov, msg->msg_iovlen);
 
-    std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
+    Capture_Recv(sockfd, msg->msg_iov, msg->msg_iovlen, res, flags);
 
-    ssize_t res = 0;
-    
-    auto adjusted_send = [&](size_t offset, size_t lcount) {
+    Account_Recv(sockfd, res);
 
-        if (offset + lcount > count) {
-            lcount = count - offset;
+    return res;
+}
+
+// override recvmmsg() to simulate network trouble
+extern "C" int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+
+    if (!Is_Stream(sockfd)) {
+        return orig::recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+    }
+
+    // every message gets its own short-read decision
+    TIov_Trim local_trims[Local_Vector_Count];
+    std::vector<TIov_Trim> heap_trims;
+    if (vlen > Local_Vector_Count) {
+        heap_trims.resize(vlen);
+    }
+    TIov_Trim* trims = heap_trims.empty() ? local_trims : heap_trims.data();
+
+    for (unsigned int i = 0; i < vlen; i++) {
+        auto& hdr = msgvec[i].msg_hdr;
+        trims[i].Apply(hdr.msg_iov, hdr.msg_iovlen, Adjust_Recv_Count(sockfd, Iov_Length(hdr.msg_iov, hdr.msg_iovlen)));
+    }
+
+    int res;
+    if (Is_Delayed(sockfd)) {
+        // like the original call - the first message is waited for; the others too, unless MSG_WAITFORONE is given or the
+        // timeout has run out (it is checked only after a message is received, so a blocking call may wait longer)
+        const auto deadline = timeout ? std::chrono::steady_clock::now() + std::chrono::seconds(timeout->tv_sec) + std::chrono::nanoseconds(timeout->tv_nsec)
+                                      : std::chrono::steady_clock::time_point::max();
+        const int call_flags = flags & ~MSG_WAITFORONE;
+        res = 0;
+        for (unsigned int i = 0; i < vlen; i++) {
+            auto& hdr = msgvec[i].msg_hdr;
+            const bool wait = (i == 0) || (!(flags & MSG_WAITFORONE) && std::chrono::steady_clock::now() < deadline);
+            const ssize_t len = gInput_Delay_Stage->receive(sockfd, hdr.msg_iov, hdr.msg_iovlen, wait ? call_flags : (call_flags | MSG_DONTWAIT));
+            if (len < 0) {
+                if (i == 0) {
+                    res = -1;
+                }
+                break;
+            }
+            hdr.msg_controllen = 0;
+            hdr.msg_flags = 0;
+            msgvec[i].msg_len = static_cast<unsigned int>(len);
+            res++;
+            if (len == 0) {
+                break;
+            }
         }
+    }
+    else {
+        res = orig::recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+    }
 
-        res += lcount;
+    for (unsigned int i = 0; i < vlen; i++) {
+        trims[i].Restore(msgvec[i].msg_hdr.msg_iov, msgvec[i].msg_hdr.msg_iovlen);
+    }
 
-        gOutput_Timed_Queue->push(sockfd, gConfig->Generate_Send_Delay(), reinterpret_cast<const char*>(buf) + offset, lcount);
-    };
+    for (int i = 0; i < res; i++) {
+        Capture_Recv(sockfd, msgvec[i].msg_hdr.msg_iov, msgvec[i].msg_hdr.msg_iovlen, static_cast<ssize_t>(msgvec[i].msg_len), flags);
+        Account_Recv(sockfd, static_cast<ssize_t>(msgvec[i].msg_len));
+    }
 
-    bool adjusted = false;
-    if (count > 2) {
+    return res;
+}
+
+namespace {
 
-        const double chance = gConfig->Generate_Base_Prob();
+    // waits for the simulated handshake and reserves space for count bytes in the output queue; returns the number of
+    // bytes admitted to the queue, or -1 with errno set
+    ssize_t Admit_Send(int sockfd, size_t count, int flags) {
 
-        if (chance < gConfig->GetProb_Send_Total()) {
-            adjusted = true;
+        // nothing can be sent before the simulated handshake completes
+        std::chrono::steady_clock::time_point ready;
+        if (intcptor::Is_Connecting(sockfd, &ready)) {
+            if ((flags & MSG_DONTWAIT) || (::fcntl(sockfd, F_GETFL) & O_NONBLOCK)) {
+                errno = EAGAIN;
+                return -1;
+            }
+            std::this_thread::sleep_until(ready);
+        }
 
-            if (chance < gConfig->GetProb_Send__1B_Sends()) {
-                for (size_t i = 0; i < count; i++) {
-                    adjusted_send(i, 1);
+        // the output queue is bounded; a blocking call waits for the queue to drain, a non-blocking one may be cut short
+        const size_t admitted = gOutput_Timed_Queue->reserve(sockfd, count, flags);
+        if (admitted < count) {
+            intcptor::Stat(intcptor::NStat::Send_Blocked);
+            // the socket reads as not writable until the queue drains
+            if (gInput_Delay_Stage) {
+                gInput_Delay_Stage->virtualize_output(sockfd);
+            }
+        }
+        if (admitted == 0 && count > 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        return static_cast<ssize_t>(admitted);
+    }
+
+    // splits count bytes of the stream to fragments with their own delays, as the fault profile of the socket decides;
+    // the fault decision is made once for the whole call
+    std::vector<COutput_Timed_Queue::TFragment> Plan_Fragments(int sockfd, size_t count) {
+
+        std::vector<COutput_Timed_Queue::TFragment> fragments;
+
+        // the profile is a part of the snapshot, it must not outlive it
+        const auto config = gConfig.Acquire();
+        const auto& profile = config->Profile_Of(sockfd);
+
+        auto adjusted_send = [&](size_t offset, size_t lcount) {
+
+            if (offset + lcount > count) {
+                lcount = count - offset;
+            }
+
+            fragments.push_back({ offset, lcount, static_cast<size_t>(config->Generate_Send_Delay(sockfd, profile)) });
+        };
+
+        bool adjusted = false;
+        if (count > 2) {
+
+            const double chance = config->Generate_Base_Prob(sockfd, intcptor::NDecision::Send_Split);
+
+            if (chance < profile.Prob_Send_Total()) {
+                adjusted = true;
+
+                if (chance < profile.prob_send_1b_sends) {
+                    for (size_t i = 0; i < count; i++) {
+                        adjusted_send(i, 1);
+                    }
+                    if (config->Is_Log_Enabled()) {
+                        intcptor::Log(intcptor::NLog_Event::Send_Adjusted_1B, sockfd, static_cast<int64_t>(count));
+                    }
                 }
-                if (gConfig->Is_Log_Enabled()) {
-                    std::cout << "[[InTCPtor: send() original count = " << count << ", adjusted to 1B sends]]" << std::endl;
+                else if (chance < profile.prob_send_1b_sends + profile.prob_send_2_separate_sends) {
+                    const size_t half = count / 2;
+                    adjusted_send(0, half);
+                    adjusted_send(half, count - half);
+                    if (config->Is_Log_Enabled()) {
+                        intcptor::Log(intcptor::NLog_Event::Send_Adjusted_2_Separate, sockfd, static_cast<int64_t>(count));
+                    }
                 }
-            }
-            else if (chance < gConfig->GetProb_Send__1B_Sends() + gConfig->GetProb_Send__2_Separate_Sends()) {
-                const size_t half = count / 2;
-                adjusted_send(0, half);
-                adjusted_send(half, count - half);
-                if (gConfig->Is_Log_Enabled()) {
-                    std::cout << "[[InTCPtor: send() original count = " << count << ", adjusted to 2 separate sends]]" << std::endl;
+                else if (chance < profile.prob_send_1b_sends + profile.prob_send_2_separate_sends + profile.prob_send_2b_sends_and_second_send) {
+                    adjusted_send(0, 2);
+                    adjusted_send(2, count - 2);
+                    if (config->Is_Log_Enabled()) {
+                        intcptor::Log(intcptor::NLog_Event::Send_Adjusted_2B_And_Second, sockfd, static_cast<int64_t>(count));
+                    }
                 }
-            }
-            else if (chance < gConfig->GetProb_Send__1B_Sends() + gConfig->GetProb_Send__2_Separate_Sends() + gConfig->GetProb_Send__2B_Sends_And_Second_Send()) {
-                adjusted_send(0, 2);
-                adjusted_send(2, count - 2);
-                if (gConfig->Is_Log_Enabled()) {
-                    std::cout << "[[InTCPtor: send() original count = " << count << ", adjusted to 2B sends and second send]]" << std::endl;
+                else {
+                    for (size_t i = 0; i < count; i += 2) {
+                        adjusted_send(i, 2);
+                    }
+                    if (config->Is_Log_Enabled()) {
+                        intcptor::Log(intcptor::NLog_Event::Send_Adjusted_2B, sockfd, static_cast<int64_t>(count));
+                    }
                 }
             }
-            else {
-                for (size_t i = 0; i < count; i += 2) {
-                    adjusted_send(i, 2);
+        }
+
+        if (!adjusted) {
+            fragments.push_back({ 0, count, 0 });
+
+            if (config->Is_Log_Enabled()) {
+                intcptor::Log(intcptor::NLog_Event::Send, sockfd, static_cast<int64_t>(count));
+            }
+        }
+
+        return fragments;
+    }
+
+    void Account_Send(int sockfd, size_t count, const std::vector<COutput_Timed_Queue::TFragment>& fragments) {
+
+        if (gStats && gStats->Is_Enabled()) {
+            gStats->Add(intcptor::NStat::Send_Calls, 1);
+            gStats->Add(intcptor::NStat::Send_Bytes, static_cast<uint64_t>(count));
+            gStats->Add(intcptor::NStat::Send_Fragments, fragments.size());
+            gStats->Add_Histogram(intcptor::NHistogram::Send_Fragments, fragments.size());
+            gStats->Add_Socket(sockfd, intcptor::NSocket_Stat::Send_Bytes, static_cast<uint64_t>(count));
+            gStats->Add_Socket(sockfd, intcptor::NSocket_Stat::Send_Fragments, fragments.size());
+            for (const auto& frag : fragments) {
+                gStats->Add_Histogram(intcptor::NHistogram::Send_Delay_Ms, frag.delay);
+                gStats->Add_Socket(sockfd, intcptor::NSocket_Stat::Send_Delay_Ms, frag.delay);
+            }
+        }
+
+        if (auto* state = intcptor::socket_table.Find(sockfd)) {
+            state->send_calls.fetch_add(1, std::memory_order_relaxed);
+            state->bytes_sent.fetch_add(static_cast<uint64_t>(count), std::memory_order_relaxed);
+        }
+    }
+
+    // queues the logical byte stream of all segments to the output queue; the fault decision is made once for the whole
+    // stream, regardless of how it is split to segments; this is the common implementation of send() and its variants
+    ssize_t Queue_Send(int sockfd, const struct iovec* iov, size_t iovcnt, int flags) {
+
+        const ssize_t admitted = Admit_Send(sockfd, Iov_Length(iov, iovcnt), flags);
+        if (admitted < 0) {
+            return -1;
+        }
+
+        const size_t count = static_cast<size_t>(admitted);
+
+        // the whole send is decided and accounted with one config (the wait for the queue space above is left out)
+        const auto config = gConfig.Acquire();
+
+        // all fragments of this call are pushed at once, so they are not interleaved with fragments of concurrent send() calls
+        const auto fragments = Plan_Fragments(sockfd, count);
+
+        gOutput_Timed_Queue->push(sockfd, iov, iovcnt, fragments);
+
+        Account_Send(sockfd, count, fragments);
+
+        return admitted;
+    }
+
+    // is the call a transfer from a regular file to a tracked socket, that can be queued as file fragments?
+    bool Is_File_Send(int out_fd, int in_fd, struct stat& st) {
+        return intcptor::socket_table.Is_Tracked(out_fd) && ::fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    // queues up to count bytes of a regular file (starting at *offset, or at the file position if offset is nullptr) to
+    // the output queue; the fragments are sent later with sendfile() from a private duplicate of the descriptor, so the
+    // data never pass through the user space (unless too many files are queued already; then they are copied like with
+    // send()); this is the common implementation of sendfile() and splice() from a file
+    ssize_t Queue_Send_File(int sockfd, int in_fd, int64_t* offset, size_t count, const struct stat& st) {
+
+        const int64_t start = offset ? *offset : static_cast<int64_t>(::lseek(in_fd, 0, SEEK_CUR));
+        if (start < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        // the fragments must not reach past the end of the file, like the original call would not
+        const int64_t file_left = std::max<int64_t>(0, static_cast<int64_t>(st.st_size) - start);
+        count = std::min(count, static_cast<size_t>(file_left));
+        if (count == 0) {
+            return 0;
+        }
+
+        const ssize_t admitted = Admit_Send(sockfd, count, 0);
+        if (admitted < 0) {
+            return -1;
+        }
+
+        count = static_cast<size_t>(admitted);
+
+        const auto config = gConfig.Acquire();
+
+        if (config->Is_Log_Enabled()) {
+            intcptor::Log(intcptor::NLog_Event::Sendfile_As_Send, sockfd, static_cast<int64_t>(count));
+        }
+
+        auto fragments = Plan_Fragments(sockfd, count);
+
+        if (!gOutput_Timed_Queue->push_file(sockfd, in_fd, st, static_cast<off_t>(start), fragments)) {
+            std::vector<char> buffer(count);
+            size_t read_total = 0;
+            ssize_t res = 0;
+            while (read_total < count) {
+                res = ::pread(in_fd, buffer.data() + read_total, count - read_total, static_cast<off_t>(start + static_cast<int64_t>(read_total)));
+                if (res < 0 && errno == EINTR) {
+                    continue;
                 }
-                if (gConfig->Is_Log_Enabled()) {
-                    std::cout << "[[InTCPtor: send() original count = " << count << ", adjusted to 2B sends]]" << std::endl;
+                if (res <= 0) {
+                    break;
                 }
+                read_total += static_cast<size_t>(res);
+            }
+
+            gOutput_Timed_Queue->cancel(sockfd, count - read_total);
+            if (read_total == 0) {
+                // the file was truncated meanwhile (zero), or it can't be read (-1 with errno of pread())
+                return res < 0 ? -1 : 0;
             }
+
+            // the file may have been truncated meanwhile, the fragments are cut to what was read
+            if (read_total < count) {
+                fragments.erase(std::remove_if(fragments.begin(), fragments.end(), [read_total](const auto& frag) { return frag.offset >= read_total; }), fragments.end());
+                for (auto& frag : fragments) {
+                    frag.len = std::min(frag.len, read_total - frag.offset);
+                }
+                count = read_total;
+            }
+
+            const struct iovec iov = { buffer.data(), count };
+            gOutput_Timed_Queue->push(sockfd, &iov, 1, fragments);
+        }
+
+        Account_Send(sockfd, count, fragments);
+
+        if (offset) {
+            *offset = start + static_cast<int64_t>(count);
+        }
+        else {
+            ::lseek(in_fd, static_cast<off_t>(start + static_cast<int64_t>(count)), SEEK_SET);
         }
+
+        return static_cast<ssize_t>(count);
     }
+}
 
-    if (!adjusted) {
-        gOutput_Timed_Queue->push(sockfd, 0, reinterpret_cast<const char*>(buf), count);
-        res = count;
+// override send() to simulate network trouble
+extern "C" ssize_t send(int sockfd, const void *buf, size_t count, int flags) {
 
-        if (gConfig->Is_Log_Enabled()) {
-            std::cout << "[[InTCPtor: overriden send() call, result = " << res << "]]" << std::endl;
+    // sockets we did not see created (socketpair(), dup(), inherited ones) go straight out; nobody would drain their
+    // queued data on close
+    if (!intcptor::socket_table.Is_Tracked(sockfd)) {
+        return orig::send(sockfd, buf, count, flags);
+    }
+
+    const struct iovec iov = { const_cast<void*>(buf), count };
+
+    return Queue_Send(sockfd, &iov, 1, flags);
+}
+
+// override sendto() to simulate network trouble on connection-oriented sockets
+extern "C" ssize_t sendto(int sockfd, const void *buf, size_t count, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) {
+
+    // datagrams with explicit destination can't be queued, as the queue always sends to the connected peer
+    if (dest_addr || !intcptor::socket_table.Is_Tracked(sockfd)) {
+        return orig::sendto(sockfd, buf, count, flags, dest_addr, addrlen);
+    }
+
+    if (gConfig->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Sendto_As_Send, sockfd);
+    }
+
+    const struct iovec iov = { const_cast<void*>(buf), count };
+
+    return Queue_Send(sockfd, &iov, 1, flags);
+}
+
+// override sendmsg() to simulate network trouble
+extern "C" ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+
+    // messages with explicit destination or with ancillary data (e.g., passed file descriptors) must go out right away
+    if (msg->msg_name || msg->msg_controllen > 0 || !intcptor::socket_table.Is_Tracked(sockfd)) {
+        return orig::sendmsg(sockfd, msg, flags);
+    }
+
+    if (gConfig->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Sendmsg_As_Send, sockfd, static_cast<int64_t>(msg->msg_iovlen));
+    }
+
+    return Queue_Send(sockfd, msg->msg_iov, msg->msg_iovlen, flags);
+}
+
+// override sendmmsg() to simulate network trouble
+extern "C" int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+
+    if (!intcptor::socket_table.Is_Tracked(sockfd)) {
+        return orig::sendmmsg(sockfd, msgvec, vlen, flags);
+    }
+
+    for (unsigned int i = 0; i < vlen; i++) {
+        if (msgvec[i].msg_hdr.msg_name || msgvec[i].msg_hdr.msg_controllen > 0) {
+            return orig::sendmmsg(sockfd, msgvec, vlen, flags);
         }
     }
 
-    // no longer needed
-    lock.unlock();
+    if (gConfig->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Sendmmsg_As_Send, sockfd, static_cast<int64_t>(vlen));
+    }
 
-    return res;
+    // like the original call - returns the number of messages sent, or an error if not even the first one was sent
+    for (unsigned int i = 0; i < vlen; i++) {
+        const ssize_t res = Queue_Send(sockfd, msgvec[i].msg_hdr.msg_iov, msgvec[i].msg_hdr.msg_iovlen, flags);
+        if (res < 0) {
+            return i > 0 ? static_cast<int>(i) : -1;
+        }
+
+        msgvec[i].msg_len = static_cast<unsigned int>(res);
+
+        // partially queued message (non-blocking call over budget); the rest of the messages would not fit either
+        if (static_cast<size_t>(res) < Iov_Length(msgvec[i].msg_hdr.msg_iov, msgvec[i].msg_hdr.msg_iovlen)) {
+            return static_cast<int>(i + 1);
+        }
+    }
+
+    return static_cast<int>(vlen);
 }
 
 // override read() to simulate network trouble
 extern "C" ssize_t read(int fd, void *buf, size_t count) {
 
-    std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
-
-    if (intcptor::managed_sockets.find(fd) == intcptor::managed_sockets.end() && intcptor::created_sockets.find(fd) == intcptor::created_sockets.end()) {
+    if (!intcptor::socket_table.Is_Tracked(fd)) {
         return orig::read(fd, buf, count);
     }
 
     if (gConfig->Is_Log_Enabled()) {
-        std::cout << "[[InTCPtor: override read() as recv() with flags = 0]]" << std::endl;
+        intcptor::Log(intcptor::NLog_Event::Read_As_Recv, fd);
     }
 
     return recv(fd, buf, count, 0);
 }
 
+// override readv() to simulate network trouble
+extern "C" ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+
+    if (iovcnt <= 0 || !Is_Stream(fd)) {
+        return orig::readv(fd, iov, iovcnt);
+    }
+
+    if (gConfig->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Readv_As_Recv, fd, iovcnt);
+    }
+
+    // the caller's array is const (it may be read-only or shared by other threads), so the trim is applied to a copy of
+    // the segment descriptors; the payload is not copied
+    size_t cnt = static_cast<size_t>(iovcnt);
+    struct iovec local_iov[Local_Vector_Count];
+    std::vector<struct iovec> heap_iov;
+    struct iovec* trimmed = local_iov;
+    if (cnt > Local_Vector_Count) {
+        heap_iov.resize(cnt);
+        trimmed = heap_iov.data();
+    }
+    std::copy(iov, iov + cnt, trimmed);
+
+    TIov_Trim trim;
+    trim.Apply(trimmed, cnt, Adjust_Recv_Count(fd, Iov_Length(iov, cnt)));
+
+    const ssize_t res = Is_Delayed(fd) ? gInput_Delay_Stage->receive(fd, trimmed, cnt, 0) : orig::readv(fd, trimmed, static_cast<int>(cnt));
+
+    Capture_Recv(fd, trimmed, cnt, res, 0);
+
+    Account_Recv(fd, res);
+
+    return res;
+}
+
 // override write() to simulate network trouble
 extern "C" ssize_t write(int fd, const void *buf, size_t count) {
 
-    std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
-
-    if (intcptor::managed_sockets.find(fd) == intcptor::managed_sockets.end() && intcptor::created_sockets.find(fd) == intcptor::created_sockets.end()) {
+    if (!intcptor::socket_table.Is_Tracked(fd)) {
         return orig::write(fd, buf, count);
     }
 
     if (gConfig->Is_Log_Enabled()) {
-        std::cout << "[[InTCPtor: override write() as send() with flags = 0]]" << std::endl;
+        intcptor::Log(intcptor::NLog_Event::Write_As_Send, fd);
     }
 
     return send(fd, buf, count, 0);
 }
 
+// override writev() to simulate network trouble
+extern "C" ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+
+    if (!intcptor::socket_table.Is_Tracked(fd)) {
+        return orig::writev(fd, iov, iovcnt);
+    }
+
+    if (gConfig->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Writev_As_Send, fd, iovcnt);
+    }
+
+    return Queue_Send(fd, iov, static_cast<size_t>(iovcnt), 0);
+}
+
+// override sendfile() to simulate network trouble; the file is sent in delayed fragments, each with its own sendfile()
+extern "C" ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+
+    struct stat st;
+    if (!Is_File_Send(out_fd, in_fd, st)) {
+        return orig::sendfile(out_fd, in_fd, offset, count);
+    }
+
+    int64_t start = offset ? static_cast<int64_t>(*offset) : 0;
+    const ssize_t res = Queue_Send_File(out_fd, in_fd, offset ? &start : nullptr, count, st);
+    if (offset && res >= 0) {
+        *offset = static_cast<off_t>(start);
+    }
+
+    return res;
+}
+
+// sendfile() of programs built with 64-bit file offsets
+extern "C" ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count) {
+
+    struct stat st;
+    if (!Is_File_Send(out_fd, in_fd, st)) {
+        return orig::sendfile64(out_fd, in_fd, offset, count);
+    }
+
+    int64_t start = offset ? static_cast<int64_t>(*offset) : 0;
+    const ssize_t res = Queue_Send_File(out_fd, in_fd, offset ? &start : nullptr, count, st);
+    if (offset && res >= 0) {
+        *offset = static_cast<off64_t>(start);
+    }
+
+    return res;
+}
+
+// override splice() to simulate network trouble on the socket end of the pipe
+extern "C" ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+
+    const bool to_socket = intcptor::socket_table.Is_Tracked(fd_out);
+    const bool from_socket = intcptor::socket_table.Is_Tracked(fd_in);
+
+    struct stat st;
+    if (to_socket && !from_socket && ::fstat(fd_in, &st) == 0) {
+
+        // from a file - the same as sendfile()
+        if (S_ISREG(st.st_mode)) {
+            int64_t start = off_in ? static_cast<int64_t>(*off_in) : 0;
+            const ssize_t res = Queue_Send_File(fd_out, fd_in, off_in ? &start : nullptr, len, st);
+            if (off_in && res >= 0) {
+                *off_in = static_cast<loff_t>(start);
+            }
+            return res;
+        }
+
+        // from a pipe - the pipe buffer cannot be referenced later, so the data are copied to the output queue
+        if (S_ISFIFO(st.st_mode)) {
+            const int nonblock_flags = (flags & SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0;
+
+            const int pipe_size = ::fcntl(fd_in, F_GETPIPE_SZ);
+            const ssize_t admitted = Admit_Send(fd_out, pipe_size > 0 ? std::min(len, static_cast<size_t>(pipe_size)) : len, nonblock_flags);
+            if (admitted <= 0) {
+                return admitted;
+            }
+
+            if (nonblock_flags) {
+                struct pollfd pfd = { fd_in, POLLIN, 0 };
+                if (orig::poll(&pfd, 1, 0) == 0) {
+                    gOutput_Timed_Queue->cancel(fd_out, static_cast<size_t>(admitted));
+                    errno = EAGAIN;
+                    return -1;
+                }
+            }
+
+            std::vector<char> buffer(static_cast<size_t>(admitted));
+            const ssize_t count = orig::read(fd_in, buffer.data(), buffer.size());
+            if (count <= 0) {
+                gOutput_Timed_Queue->cancel(fd_out, static_cast<size_t>(admitted));
+                return count;
+            }
+            gOutput_Timed_Queue->cancel(fd_out, static_cast<size_t>(admitted - count));
+
+            if (gConfig->Is_Log_Enabled()) {
+                intcptor::Log(intcptor::NLog_Event::Splice_As_Send, fd_out, count);
+            }
+
+            const auto fragments = Plan_Fragments(fd_out, static_cast<size_t>(count));
+
+            const struct iovec iov = { buffer.data(), static_cast<size_t>(count) };
+            gOutput_Timed_Queue->push(fd_out, &iov, 1, fragments);
+
+            Account_Send(fd_out, static_cast<size_t>(count), fragments);
+
+            return count;
+        }
+    }
+
+    if (!from_socket || to_socket) {
+        return orig::splice(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+
+    // from a socket to a pipe - subject to the short reads and to the input delay
+    size_t count = Adjust_Recv_Count(fd_in, len);
+
+    ssize_t res;
+    if (Is_Delayed(fd_in)) {
+        // like the original call - the pipe side does not block, if either the flag or the pipe itself says so
+        const bool nonblocking = (flags & SPLICE_F_NONBLOCK) || (::fcntl(fd_out, F_GETFL) & O_NONBLOCK);
+
+        // the released data are written to the pipe; only what the pipe can take right now is read from the socket
+        const int pipe_size = ::fcntl(fd_out, F_GETPIPE_SZ);
+        int pending = 0;
+        while (pipe_size > 0 && orig::ioctl(fd_out, FIONREAD, &pending) == 0 && pending >= pipe_size) {
+            if (nonblocking) {
+                errno = EAGAIN;
+                return -1;
+            }
+            struct pollfd pfd = { fd_out, POLLOUT, 0 };
+            if (orig::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
+            }
+        }
+        if (pipe_size > 0) {
+            count = std::min(count, static_cast<size_t>(pipe_size - pending));
+        }
+
+        // the data are only peeked at first, and just the part, that the pipe took, is consumed; nothing is lost, if the
+        // pipe gets full meanwhile (e.g., another thread writes to it)
+        std::vector<char> buffer(count);
+        const struct iovec iov = { buffer.data(), count };
+        res = gInput_Delay_Stage->receive(fd_in, &iov, 1, MSG_PEEK | ((flags & SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0));
+
+        ssize_t written = 0;
+        while (written < res) {
+            const ssize_t w = orig::write(fd_out, buffer.data() + written, static_cast<size_t>(res - written));
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN && !nonblocking) {
+                    struct pollfd pfd = { fd_out, POLLOUT, 0 };
+                    orig::poll(&pfd, 1, -1);
+                    continue;
+                }
+                break;
+            }
+            written += w;
+        }
+
+        if (res > 0) {
+            if (written == 0) {
+                // errno of the failed write
+                res = -1;
+            }
+            else {
+                const struct iovec taken = { buffer.data(), static_cast<size_t>(written) };
+                res = gInput_Delay_Stage->receive(fd_in, &taken, 1, MSG_DONTWAIT);
+                Capture_Recv(fd_in, &taken, 1, res, 0);
+            }
+        }
+    }
+    else {
+        // the data go straight to the pipe and never pass through the user space, so they are not captured
+        res = orig::splice(fd_in, off_in, fd_out, off_out, count, flags);
+    }
+
+    if (gConfig->Is_Log_Enabled()) {
+        intcptor::Log(intcptor::NLog_Event::Splice_As_Recv, fd_in, res);
+    }
+
+    Account_Recv(fd_in, res);
+
+    return res;
+}
+
 // override shutdown() to track closed sockets
 extern "C" int shutdown(int sockfd, int how) {
 
-    std::unique_lock<std::recursive_mutex> lock(intcptor::glob_mutex);
+    // NOTE: shutdown is only recorded in socket flags, as it is not always followed by close() call
+
+    const auto kind = intcptor::socket_table.Get_Kind(sockfd);
+
+    if (kind != intcptor::NSocket_Kind::None) {
+        // nothing can be sent after the write side is shut down; send what can be sent within the linger time first
+        if ((how == SHUT_WR || how == SHUT_RDWR) && gOutput_Timed_Queue) {
+            Drain_Output(sockfd);
+        }
 
-    // NOTE: we don't track shutdowns, as they are not always followed by close() calls
-    // furthermore, we should wait here until all sent data is actually sent, so we can't close the socket immediately
-    // this is a TODO for future work, but may not be actually needed
+        auto* state = intcptor::socket_table.Find(sockfd);
+        if (how == SHUT_RD || how == SHUT_RDWR) {
+            state->flags.fetch_or(intcptor::Shut_Rd, std::memory_order_relaxed);
+        }
+        if (how == SHUT_WR || how == SHUT_RDWR) {
+            state->flags.fetch_or(intcptor::Shut_Wr, std::memory_order_relaxed);
+        }
+    }
 
     if (gConfig->Is_Log_Enabled()) {
-        if (intcptor::created_sockets.find(sockfd) != intcptor::created_sockets.end()) {
-            std::cout << "[[InTCPtor: overriden shutdown() call for server socket fd = " << sockfd << "]]" << std::endl;
+        if (kind == intcptor::NSocket_Kind::Created) {
+            intcptor::Log(intcptor::NLog_Event::Shutdown_Created, sockfd);
         }
-        else if (intcptor::managed_sockets.find(sockfd) != intcptor::managed_sockets.end()) {
-            std::cout << "[[InTCPtor: overriden shutdown() call for client socket fd = " << sockfd << "]]" << std::endl;
+        else if (kind == intcptor::NSocket_Kind::Managed) {
+            intcptor::Log(intcptor::NLog_Event::Shutdown_Managed, sockfd);
         }
         else {
-            std::cout << "[[InTCPtor: overriden shutdown() call for non-managed fd = " << sockfd << "]]" << std::endl;
+            intcptor::Log(intcptor::NLog_Event::Shutdown_Unmanaged, sockfd);
         }
     }
 
     return orig::shutdown(sockfd, how);
 }
+
+namespace {
+
+    // does any of the descriptors need the virtualized readiness? (data held by the input delay stage, or writability
+    // masked by the output queue budget or by a handshake in progress)
+    bool Needs_Virtual_Readiness(int fd, bool input, bool output) {
+        if (!gInput_Delay_Stage || !intcptor::socket_table.Is_Tracked(fd)) {
+            return false;
+        }
+        return (input && gInput_Delay_Stage->Is_Delayed(fd)) || (output && (gOutput_Timed_Queue->is_blocked(fd) || intcptor::Is_Connecting(fd)));
+    }
+
+    bool Needs_Virtual_Readiness(const struct pollfd* fds, nfds_t nfds) {
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (Needs_Virtual_Readiness(fds[i].fd, fds[i].events & (POLLIN | POLLRDNORM | POLLRDHUP), fds[i].events & (POLLOUT | POLLWRNORM))) {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+// override poll() to report readiness of released data only
+extern "C" int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+
+    if (!Needs_Virtual_Readiness(fds, nfds)) {
+        return orig::poll(fds, nfds, timeout);
+    }
+
+    const struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+
+    return gInput_Delay_Stage->wait_poll(fds, nfds, timeout < 0 ? nullptr : &ts, nullptr);
+}
+
+// override ppoll() to report readiness of released data only
+extern "C" int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask) {
+
+    if (!Needs_Virtual_Readiness(fds, nfds)) {
+        return orig::ppoll(fds, nfds, timeout, sigmask);
+    }
+
+    return gInput_Delay_Stage->wait_poll(fds, nfds, timeout, sigmask);
+}
+
+// override select() to report readiness of released data only
+extern "C" int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+
+    bool needed = false;
+    for (int fd = 0; fd < nfds && !needed; fd++) {
+        needed = Needs_Virtual_Readiness(fd, readfds && FD_ISSET(fd, readfds), writefds && FD_ISSET(fd, writefds));
+    }
+
+    if (!needed) {
+        return orig::select(nfds, readfds, writefds, exceptfds, timeout);
+    }
+
+    return gInput_Delay_Stage->wait_select(nfds, readfds, writefds, exceptfds, timeout);
+}
+
+// override epoll_ctl() to keep track of registered sockets, whose readiness is virtualized
+extern "C" int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+
+    if (!gInput_Delay_Stage || !gInput_Delay_Stage->Is_Connected_Stream(fd)) {
+        return orig::epoll_ctl(epfd, op, fd, event);
+    }
+
+    if (!gInput_Delay_Stage->Is_Virtualized(fd)) {
+        return gInput_Delay_Stage->register_direct(epfd, op, fd, event);
+    }
+
+    return gInput_Delay_Stage->register_epoll(epfd, op, fd, event);
+}
+
+// override epoll_wait() to report readiness of released data only
+extern "C" int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+
+    if (!gInput_Delay_Stage) {
+        return orig::epoll_wait(epfd, events, maxevents, timeout);
+    }
+
+    return gInput_Delay_Stage->wait_epoll(epfd, events, maxevents, timeout, nullptr);
+}
+
+// override epoll_pwait() to report readiness of released data only
+extern "C" int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask) {
+
+    if (!gInput_Delay_Stage) {
+        return orig::epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+    }
+
+    return gInput_Delay_Stage->wait_epoll(epfd, events, maxevents, timeout, sigmask);
+}
+
+// override ioctl() to report the number of released bytes in FIONREAD
+extern "C" int ioctl(int fd, unsigned long request, ...) {
+
+    // all requests we may pass through take a single pointer-sized argument (or none)
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    if (request == FIONREAD && Is_Delayed(fd)) {
+        *static_cast<int*>(arg) = gInput_Delay_Stage->readable_bytes(fd);
+        return 0;
+    }
+
+    return orig::ioctl(fd, request, arg);
+}
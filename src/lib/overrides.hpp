@@ -8,31 +8,43 @@
 
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
 
 // original socket-related functions
 namespace orig {
     extern int (*socket)(int, int, int);
     extern int (*close)(int);
     extern int (*accept)(int, struct sockaddr*, socklen_t*);
+    extern int (*accept4)(int, struct sockaddr*, socklen_t*, int);
+    extern int (*connect)(int, const struct sockaddr*, socklen_t);
     extern ssize_t (*recv)(int, void*, size_t, int);
     extern ssize_t (*send)(int, const void*, size_t, int);
     extern ssize_t (*read)(int, void*, size_t);
     extern ssize_t (*write)(int, const void*, size_t);
     extern int (*shutdown)(int, int);
+    extern ssize_t (*writev)(int, const struct iovec*, int);
+    extern ssize_t (*sendto)(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
+    extern ssize_t (*sendmsg)(int, const struct msghdr*, int);
+    extern int (*sendmmsg)(int, struct mmsghdr*, unsigned int, int);
+    extern ssize_t (*readv)(int, const struct iovec*, int);
+    extern ssize_t (*recvmsg)(int, struct msghdr*, int);
+    extern int (*recvmmsg)(int, struct mmsghdr*, unsigned int, int, struct timespec*);
+    extern int (*listen)(int, int);
+    extern int (*poll)(struct pollfd*, nfds_t, int);
+    extern int (*ppoll)(struct pollfd*, nfds_t, const struct timespec*, const sigset_t*);
+    extern int (*select)(int, fd_set*, fd_set*, fd_set*, struct timeval*);
+    extern int (*epoll_ctl)(int, int, int, struct epoll_event*);
+    extern int (*epoll_wait)(int, struct epoll_event*, int, int);
+    extern int (*epoll_pwait)(int, struct epoll_event*, int, int, const sigset_t*);
+    extern int (*ioctl)(int, unsigned long, ...);
+    extern ssize_t (*sendfile)(int, int, off_t*, size_t);
+    extern ssize_t (*sendfile64)(int, int, off64_t*, size_t);
+    extern ssize_t (*splice)(int, loff_t*, int, loff_t*, size_t, unsigned int);
 }
 
-#include <set>
-#include <mutex>
-
-namespace intcptor {
-    // created sockets (via socket() call)
-    extern std::set<int> created_sockets;
-    // managed sockets (accepted sockets via accept() call)
-    extern std::set<int> managed_sockets;
-
-    // global mutex to prevent race conditions during simulated network trouble
-    // normally, the system handles this, but as we are simulating network trouble, we need to ensure that we don't have multiple threads interfering with each other
-    // the mutex is recursive, as we may call read() from recv(), but at the same time, other threads may call either of those functions directly, so we need to protect
-    // both of them with a mutex
-    extern std::recursive_mutex glob_mutex;
-}
+#include "socket_table.hpp"
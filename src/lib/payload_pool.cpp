@@ -0,0 +1,161 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the pool of reference-counted payload blocks used by the output queue.
+ */
+
+#include "payload_pool.hpp"
+
+#include <mutex>
+#include <new>
+
+namespace intcptor {
+
+    namespace {
+        std::mutex orphan_mutex;
+        CPayload_Pool* orphan_pools = nullptr;
+
+        size_t Class_Size(uint32_t cls) {
+            return size_t(1) << (cls + CPayload_Pool::Min_Class_Bits);
+        }
+
+        TPayload_Block* New_Block(size_t payload_size) {
+            void* mem = ::operator new(sizeof(TPayload_Block) + payload_size);
+            return new (mem) TPayload_Block();
+        }
+
+        void Delete_Block(TPayload_Block* block) {
+            block->~TPayload_Block();
+            ::operator delete(block);
+        }
+    }
+
+    // returns the pool of a thread to the orphan list when the thread exits
+    struct TPool_Holder {
+        CPayload_Pool* pool = nullptr;
+
+        ~TPool_Holder() {
+            if (pool) {
+                std::unique_lock<std::mutex> lock(orphan_mutex);
+                pool->_next_orphan = orphan_pools;
+                orphan_pools = pool;
+            }
+        }
+    };
+
+    CPayload_Pool* CPayload_Pool::Thread_Pool() {
+        thread_local TPool_Holder holder;
+
+        if (!holder.pool) {
+            {
+                std::unique_lock<std::mutex> lock(orphan_mutex);
+                if (orphan_pools) {
+                    holder.pool = orphan_pools;
+                    orphan_pools = orphan_pools->_next_orphan;
+                    holder.pool->_next_orphan = nullptr;
+                }
+            }
+            // NOTE: pools are never freed, as blocks allocated from them may outlive the thread
+            if (!holder.pool) {
+                holder.pool = new CPayload_Pool();
+            }
+        }
+
+        return holder.pool;
+    }
+
+    TPayload_Block* CPayload_Pool::Allocate(size_t size) {
+        uint32_t cls = 0;
+        while (cls < Class_Count && Class_Size(cls) < size) {
+            cls++;
+        }
+
+        TPayload_Block* block;
+        if (cls == Class_Count) {
+            block = New_Block(size);
+            block->size_class = Unpooled_Class;
+        }
+        else {
+            block = Thread_Pool()->Allocate_Class(cls);
+        }
+
+        block->refs.store(1, std::memory_order_relaxed);
+        return block;
+    }
+
+    void CPayload_Pool::Release(TPayload_Block* block) {
+        if (block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+
+        if (block->size_class == Unpooled_Class) {
+            Delete_Block(block);
+            return;
+        }
+
+        CPayload_Pool* pool = Thread_Pool();
+        if (pool == block->owner) {
+            pool->Free_Local(block);
+        }
+        else {
+            block->owner->Free_Remote(block);
+        }
+    }
+
+    TPayload_Block* CPayload_Pool::Allocate_Class(uint32_t cls) {
+        if (!_free[cls] && _remote_free.load(std::memory_order_relaxed)) {
+            // take over everything released by other threads at once; the exchange does not suffer from ABA problem
+            TPayload_Block* remote = _remote_free.exchange(nullptr, std::memory_order_acquire);
+            while (remote) {
+                TPayload_Block* next = remote->next;
+                _remote_bytes[remote->size_class].fetch_sub(Class_Size(remote->size_class), std::memory_order_relaxed);
+                Free_Local(remote);
+                remote = next;
+            }
+        }
+
+        if (TPayload_Block* block = _free[cls]) {
+            _free[cls] = block->next;
+            _free_count[cls]--;
+            block->next = nullptr;
+            return block;
+        }
+
+        TPayload_Block* block = New_Block(Class_Size(cls));
+        block->size_class = cls;
+        block->owner = this;
+        return block;
+    }
+
+    void CPayload_Pool::Free_Local(TPayload_Block* block) {
+        const uint32_t cls = block->size_class;
+
+        // do not let a burst of large transfers pin the memory forever
+        if ((_free_count[cls] + 1) * Class_Size(cls) > Max_Cached_Bytes_Per_Class && _free_count[cls] > 0) {
+            Delete_Block(block);
+            return;
+        }
+
+        block->next = _free[cls];
+        _free[cls] = block;
+        _free_count[cls]++;
+    }
+
+    void CPayload_Pool::Free_Remote(TPayload_Block* block) {
+        const uint32_t cls = block->size_class;
+        const size_t size = Class_Size(cls);
+
+        // the same limit as for the local free blocks; the counter may be a bit ahead of the stack, which only frees more
+        const size_t cached = _remote_bytes[cls].fetch_add(size, std::memory_order_relaxed);
+        if (cached > 0 && cached + size > Max_Cached_Bytes_Per_Class) {
+            _remote_bytes[cls].fetch_sub(size, std::memory_order_relaxed);
+            Delete_Block(block);
+            return;
+        }
+
+        TPayload_Block* head = _remote_free.load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!_remote_free.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+    }
+}
@@ -0,0 +1,140 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the pool of reference-counted payload blocks used by the output queue and the input delay stage.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace intcptor {
+
+    class CPayload_Pool;
+
+    // header of a payload block; the payload itself follows the header in the same allocation
+    struct TPayload_Block {
+        std::atomic<uint32_t> refs{ 0 };
+        // index of the size class, or Unpooled_Class for blocks allocated directly
+        uint32_t size_class = 0;
+        // pool the block was allocated from; the block is returned to this pool, no matter which thread releases it
+        CPayload_Pool* owner = nullptr;
+        // free list link
+        TPayload_Block* next = nullptr;
+
+        char* Data() {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    // per-thread pool of payload blocks, divided to power-of-two size classes
+    // blocks are allocated by the owning thread only; any thread may release a block, released blocks of other threads are
+    // pushed to a lock-free stack and taken over by the owning thread on its next allocation; both the local and the remote
+    // free blocks are limited per class
+    class CPayload_Pool final {
+        public:
+            static constexpr size_t Min_Class_Bits = 6;     // 64 B
+            static constexpr size_t Max_Class_Bits = 20;    // 1 MiB
+            static constexpr size_t Class_Count = Max_Class_Bits - Min_Class_Bits + 1;
+            static constexpr uint32_t Unpooled_Class = ~uint32_t(0);
+            // how many bytes of free blocks a single class may keep cached
+            static constexpr size_t Max_Cached_Bytes_Per_Class = size_t(1) << 20;
+
+            // allocates a block of at least given size with a single reference, using the pool of the calling thread
+            static TPayload_Block* Allocate(size_t size);
+
+            // drops a reference; the last reference returns the block to its pool
+            static void Release(TPayload_Block* block);
+
+        private:
+            CPayload_Pool() = default;
+
+            static CPayload_Pool* Thread_Pool();
+
+            TPayload_Block* Allocate_Class(uint32_t cls);
+            void Free_Local(TPayload_Block* block);
+            void Free_Remote(TPayload_Block* block);
+
+            TPayload_Block* _free[Class_Count] = {};
+            size_t _free_count[Class_Count] = {};
+            // blocks released by other threads
+            std::atomic<TPayload_Block*> _remote_free{ nullptr };
+            // bytes of the blocks in the remote stack, per class; the owner may not allocate for a long time (or ever)
+            std::atomic<size_t> _remote_bytes[Class_Count] = {};
+
+            // pools of exited threads are kept and adopted by new threads
+            CPayload_Pool* _next_orphan = nullptr;
+
+            friend struct TPool_Holder;
+    };
+
+    // reference to a part of a payload block
+    class CPayload_Slice final {
+        public:
+            CPayload_Slice() = default;
+
+            // takes over the reference held by the caller
+            CPayload_Slice(TPayload_Block* block, size_t offset, size_t len) : _block(block), _offset(offset), _len(len) {
+            }
+
+            // creates another slice of the same block; the block gets a new reference
+            CPayload_Slice Share(size_t offset, size_t len) const {
+                _block->refs.fetch_add(1, std::memory_order_relaxed);
+                return CPayload_Slice(_block, offset, len);
+            }
+
+            // another reference to the same part of the block
+            CPayload_Slice Share() const {
+                return Share(_offset, _len);
+            }
+
+            CPayload_Slice(const CPayload_Slice&) = delete;
+            CPayload_Slice& operator=(const CPayload_Slice&) = delete;
+
+            CPayload_Slice(CPayload_Slice&& other) noexcept : _block(std::exchange(other._block, nullptr)), _offset(other._offset), _len(other._len) {
+            }
+
+            CPayload_Slice& operator=(CPayload_Slice&& other) noexcept {
+                if (this != &other) {
+                    Reset();
+                    _block = std::exchange(other._block, nullptr);
+                    _offset = other._offset;
+                    _len = other._len;
+                }
+                return *this;
+            }
+
+            ~CPayload_Slice() {
+                Reset();
+            }
+
+            void Reset() {
+                if (_block) {
+                    CPayload_Pool::Release(_block);
+                    _block = nullptr;
+                }
+            }
+
+            const char* data() const {
+                return _block->Data() + _offset;
+            }
+
+            size_t size() const {
+                return _len;
+            }
+
+            // drops the first len bytes of the slice (e.g., those already sent)
+            void Advance(size_t len) {
+                _offset += len;
+                _len -= len;
+            }
+
+        private:
+            TPayload_Block* _block = nullptr;
+            size_t _offset = 0;
+            size_t _len = 0;
+    };
+}
@@ -0,0 +1,124 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains counter-based random streams used for fault decisions.
+ */
+
+#include "random.hpp"
+
+#include <atomic>
+#include <algorithm>
+
+#include "socket_table.hpp"
+#include "fault_trace.hpp"
+#include "delay_distribution.hpp"
+
+namespace intcptor {
+
+    namespace {
+        std::atomic<uint64_t> master_seed{ 0 };
+        // thread streams are numbered in order of their first use
+        std::atomic<uint64_t> thread_counter{ 0 };
+
+        // marks socket stream keys, so they never collide with thread stream keys
+        constexpr uint64_t Socket_Key_Tag = uint64_t(1) << 63;
+
+        uint64_t Socket_Key(int fd, const TSocket_State& state) {
+            const uint64_t id = Socket_Key_Tag | (static_cast<uint64_t>(state.generation.load(std::memory_order_relaxed)) << 32) | static_cast<uint32_t>(fd);
+            return CRandom_Stream::Derive_Key(master_seed.load(std::memory_order_relaxed), id);
+        }
+    }
+
+    void Set_Master_Seed(uint64_t seed) {
+        master_seed.store(seed, std::memory_order_relaxed);
+    }
+
+    uint64_t Get_Master_Seed() {
+        return master_seed.load(std::memory_order_relaxed);
+    }
+
+    CRandom_Stream& Thread_Random() {
+        thread_local CRandom_Stream stream(CRandom_Stream::Derive_Key(master_seed.load(std::memory_order_relaxed), thread_counter.fetch_add(1, std::memory_order_relaxed)));
+        return stream;
+    }
+
+    double Socket_Random_Unit(int fd, NDecision decision) {
+        TSocket_State* state = socket_table.Find(fd);
+        if (!state || state->kind.load(std::memory_order_relaxed) == NSocket_Kind::None) {
+            return Thread_Random().Next_Unit();
+        }
+
+        const uint64_t n = state->rand_counter.fetch_add(1, std::memory_order_relaxed);
+        const uint32_t generation = state->generation.load(std::memory_order_relaxed);
+
+        double value;
+        if (gFault_Trace && gFault_Trace->Is_Replaying() && gFault_Trace->Replay(fd, generation, n, decision, value)) {
+            return value;
+        }
+
+        value = CRandom_Stream::To_Unit(CRandom_Stream::Draw(Socket_Key(fd, *state), n));
+
+        if (gFault_Trace && gFault_Trace->Is_Recording()) {
+            gFault_Trace->Record(fd, generation, n, decision, value);
+        }
+
+        return value;
+    }
+
+    double Socket_Random_Normal(int fd, double mean, double sigma, NDecision decision) {
+        TSocket_State* state = socket_table.Find(fd);
+        if (!state || state->kind.load(std::memory_order_relaxed) == NSocket_Kind::None) {
+            return Thread_Random().Next_Normal(mean, sigma);
+        }
+
+        const uint64_t n = state->rand_counter.fetch_add(2, std::memory_order_relaxed);
+        const uint32_t generation = state->generation.load(std::memory_order_relaxed);
+
+        double value;
+        if (gFault_Trace && gFault_Trace->Is_Replaying() && gFault_Trace->Replay(fd, generation, n, decision, value)) {
+            return value;
+        }
+
+        const uint64_t key = Socket_Key(fd, *state);
+        value = CRandom_Stream::To_Normal(CRandom_Stream::Draw(key, n), CRandom_Stream::Draw(key, n + 1), mean, sigma);
+
+        if (gFault_Trace && gFault_Trace->Is_Recording()) {
+            gFault_Trace->Record(fd, generation, n, decision, value);
+        }
+
+        return value;
+    }
+
+    double Socket_Random_Delay(int fd, const CDelay_Distribution& distribution, NDecision decision) {
+        if (distribution.Is_Normal()) {
+            return std::max(0.0, Socket_Random_Normal(fd, distribution.Mean(), distribution.Sigma(), decision));
+        }
+
+        TSocket_State* state = socket_table.Find(fd);
+        if (!state || state->kind.load(std::memory_order_relaxed) == NSocket_Kind::None) {
+            CRandom_Stream& stream = Thread_Random();
+            const double u1 = stream.Next_Unit();
+            const double u2 = stream.Next_Unit();
+            return distribution.Sample(u1, u2, stream.Next_Unit());
+        }
+
+        // every sample takes the same number of values, so the positions of the following decisions do not depend on it
+        const uint64_t n = state->rand_counter.fetch_add(CDelay_Distribution::Draw_Count, std::memory_order_relaxed);
+        const uint32_t generation = state->generation.load(std::memory_order_relaxed);
+
+        double value;
+        if (gFault_Trace && gFault_Trace->Is_Replaying() && gFault_Trace->Replay(fd, generation, n, decision, value)) {
+            return value;
+        }
+
+        const uint64_t key = Socket_Key(fd, *state);
+        value = distribution.Sample(CRandom_Stream::To_Unit(CRandom_Stream::Draw(key, n)), CRandom_Stream::To_Unit(CRandom_Stream::Draw(key, n + 1)),
+                                    CRandom_Stream::To_Unit(CRandom_Stream::Draw(key, n + 2)));
+
+        if (gFault_Trace && gFault_Trace->Is_Recording()) {
+            gFault_Trace->Record(fd, generation, n, decision, value);
+        }
+
+        return value;
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains counter-based random streams used for fault decisions.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+namespace intcptor {
+
+    class CDelay_Distribution;
+
+    // what a random value drawn from a socket stream decides about; the value is stored in the fault trace (see
+    // fault_trace.hpp) together with its decision
+    enum class NDecision : uint8_t {
+        None = 0,       // marks an empty record of the trace
+        Send_Split = 1, // how the sent data are fragmented
+        Send_Delay = 2, // delay of a sent fragment
+        Recv_Trim = 3,  // how much less is received than requested
+        Recv_Delay = 4, // delay of received data
+        Drop_Delay = 5, // delay before the next random connection drop
+        Drop_Victim = 6,// the connection, that was dropped
+        Other = 7,
+        Connect_Delay = 8, // delay of the connection handshake
+        Drop_Lifetime = 9, // lifetime of an accepted connection, before it is dropped
+    };
+
+    // counter-based random stream: the n-th value of a stream depends only on the stream key and n, so there is no shared
+    // engine state and no lock is needed; streams with different keys are independent
+    class CRandom_Stream final {
+        public:
+            CRandom_Stream(uint64_t key = 0, uint64_t counter = 0) : _key(key), _counter(counter) {
+            }
+
+            // SplitMix64 finalizer
+            static constexpr uint64_t Mix(uint64_t z) {
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                return z ^ (z >> 31);
+            }
+
+            // derives a stream key from a seed and an arbitrary number of identifiers
+            static constexpr uint64_t Derive_Key(uint64_t seed, uint64_t id) {
+                return Mix(seed ^ Mix(id + 0x9E3779B97F4A7C15ull));
+            }
+
+            // n-th raw value of a stream with given key
+            static constexpr uint64_t Draw(uint64_t key, uint64_t counter) {
+                return Mix(key + (counter + 1) * 0x9E3779B97F4A7C15ull);
+            }
+
+            // converts raw value to a double in the [0, 1) interval
+            static constexpr double To_Unit(uint64_t value) {
+                return static_cast<double>(value >> 11) * 0x1.0p-53;
+            }
+
+            // normal distribution from two raw values (Box-Muller transform)
+            static double To_Normal(uint64_t v1, uint64_t v2, double mean, double sigma) {
+                const double u1 = 1.0 - To_Unit(v1); // (0, 1], so the logarithm is defined
+                const double u2 = To_Unit(v2);
+                return mean + sigma * std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * M_PI * u2);
+            }
+
+            uint64_t Next() {
+                return Draw(_key, _counter++);
+            }
+
+            double Next_Unit() {
+                return To_Unit(Next());
+            }
+
+            double Next_Normal(double mean, double sigma) {
+                const uint64_t v1 = Next();
+                const uint64_t v2 = Next();
+                return To_Normal(v1, v2, mean, sigma);
+            }
+
+        private:
+            uint64_t _key;
+            uint64_t _counter;
+    };
+
+    // sets the master seed all streams are derived from; must be called before any stream is used
+    void Set_Master_Seed(uint64_t seed);
+    uint64_t Get_Master_Seed();
+
+    // stream of the calling thread, used for decisions not bound to any socket
+    CRandom_Stream& Thread_Random();
+
+    // draws values from the stream of given socket; the stream is keyed by the master seed, fd and its generation,
+    // so the sequence of decisions on a socket is reproducible regardless of how threads interleave
+    // untracked file descriptors fall back to the stream of the calling thread
+    // when the fault trace is recorded, every value drawn for a tracked socket is stored with given decision; when the trace
+    // is replayed, the stored value is returned instead of drawing a new one
+    double Socket_Random_Unit(int fd, NDecision decision = NDecision::Other);
+    double Socket_Random_Normal(int fd, double mean, double sigma, NDecision decision = NDecision::Other);
+    // a delay drawn from given distribution; never negative
+    double Socket_Random_Delay(int fd, const CDelay_Distribution& distribution, NDecision decision);
+}
@@ -8,10 +8,14 @@
 
 #include "overrides.hpp"
 #include "config.hpp"
+#include "logger.hpp"
+#include "fault_trace.hpp"
+#include "stats.hpp"
 
 #include <iostream>
+#include <algorithm>
 
-CRandom_Socket_Closer::TPtr gRandom_Socket_Closer;
+CRandom_Socket_Closer* gRandom_Socket_Closer = nullptr;
 
 CRandom_Socket_Closer::CRandom_Socket_Closer() {
 
@@ -24,46 +28,249 @@ CRandom_Socket_Closer::CRandom_Socket_Closer() {
     }
 
     if (gConfig->Is_Log_Enabled()) {
-        std::cout << "[[InTCPtor: will randomly drop connections with delay between " << gConfig->GetDrop_Connection_Delay_Ms_Min() << " and " << gConfig->GetDrop_Connection_Delay_Ms_Max() << " ms]]" << std::endl;
+        if (gConfig->Is_Drop_Lifetime_Enabled()) {
+            std::cout << "[[InTCPtor: will drop connections after " << gConfig->GetDrop_Connection_Lifetime() << " lifetimes with mean of " << gConfig->GetDrop_Connection_Lifetime_Ms_Mean() << " ms]]" << std::endl;
+        }
+        else {
+            std::cout << "[[InTCPtor: will randomly drop connections with delay between " << gConfig->GetDrop_Connection_Delay_Ms_Min() << " and " << gConfig->GetDrop_Connection_Delay_Ms_Max() << " ms]]" << std::endl;
+        }
     }
     _running = true;
     _worker = std::thread(&CRandom_Socket_Closer::worker, this);
 }
 
 CRandom_Socket_Closer::~CRandom_Socket_Closer() {
-    _running = false;
+    Stop();
+}
+
+void CRandom_Socket_Closer::Stop() {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _running = false;
+        _cond.notify_all();
+    }
     if (_worker.joinable()) {
         _worker.join();
     }
 }
 
+void CRandom_Socket_Closer::add(int fd) {
+    const intcptor::TSocket_State* state = intcptor::socket_table.Find(fd);
+    if (!_running || !state) {
+        return;
+    }
+
+    const TCandidate candidate = { fd, state->generation.load(std::memory_order_relaxed) };
+
+    // drawn outside the lock; the value comes from the stream of the socket, so it is reproducible
+    const double lifetime_ms = gConfig->Generate_Connection_Lifetime(fd);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // the descriptor may still be here, if it was closed without our close()
+    auto itr = _candidate_index.find(fd);
+    if (itr != _candidate_index.end()) {
+        _candidates[itr->second] = candidate;
+    }
+    else {
+        _candidate_index.emplace(fd, _candidates.size());
+        _candidates.push_back(candidate);
+    }
+
+    if (lifetime_ms >= 0) {
+        const auto due = TClock::now() + std::chrono::duration_cast<TClock::duration>(std::chrono::duration<double, std::milli>(lifetime_ms));
+        _expiries.push({ due, candidate });
+
+        // the worker sleeps until the earliest deadline; wake it up only if this one is earlier
+        if (_expiries.top().due == due) {
+            _cond.notify_one();
+        }
+    }
+}
+
+void CRandom_Socket_Closer::remove(int fd) {
+    if (!_running) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto itr = _candidate_index.find(fd);
+    if (itr != _candidate_index.end()) {
+        Take(_candidates[itr->second]);
+    }
+}
+
+bool CRandom_Socket_Closer::Take(const TCandidate& candidate) {
+    auto itr = _candidate_index.find(candidate.fd);
+    if (itr == _candidate_index.end() || _candidates[itr->second].generation != candidate.generation) {
+        return false;
+    }
+
+    const size_t index = itr->second;
+    _candidate_index.erase(itr);
+
+    if (index + 1 != _candidates.size()) {
+        _candidates[index] = _candidates.back();
+        _candidate_index[_candidates[index].fd] = index;
+    }
+    _candidates.pop_back();
+
+    return true;
+}
+
+CRandom_Socket_Closer::TCandidate CRandom_Socket_Closer::Take_Random(double unit) {
+    while (!_candidates.empty()) {
+        const size_t index = std::min(static_cast<size_t>(unit * _candidates.size()), _candidates.size() - 1);
+        const TCandidate candidate = _candidates[index];
+        Take(candidate);
+
+        const intcptor::TSocket_State* state = intcptor::socket_table.Find(candidate.fd);
+        if (state && state->kind.load(std::memory_order_relaxed) == intcptor::NSocket_Kind::Managed && state->generation.load(std::memory_order_relaxed) == candidate.generation) {
+            return candidate;
+        }
+    }
+
+    return { -1, 0 };
+}
+
+void CRandom_Socket_Closer::Drop(const TCandidate& victim) {
+    // the socket may have been closed by the application in the meantime, and the descriptor may even belong to another
+    // connection now; untrack it only if it is still the same managed socket
+    intcptor::TSocket_State* state = intcptor::socket_table.Find(victim.fd);
+    if (!state || state->generation.load(std::memory_order_relaxed) != victim.generation) {
+        return;
+    }
+
+    if (intcptor::socket_table.Untrack_If(victim.fd, intcptor::NSocket_Kind::Managed)) {
+
+        if (gConfig->Is_Log_Enabled()) {
+            intcptor::Log(intcptor::NLog_Event::Random_Close, victim.fd);
+        }
+
+        intcptor::Stat(intcptor::NStat::Drops);
+        intcptor::Stat_Socket_Closed(victim.fd);
+
+        // the data queued for the connection are lost with it; a new generation makes the output queue discard them by
+        // itself, so the drop does not wait for the fragments being sent
+        state->generation.fetch_add(1, std::memory_order_relaxed);
+
+        // the connection is broken in both directions, but the descriptor still belongs to the application; it learns
+        // about the drop like about a reset connection, and closes the descriptor itself, so it never uses a descriptor
+        // number, that was reused for another connection; the socket is not tracked anymore, so its calls go straight to
+        // the kernel, which reports the end of the stream to recv() and EPIPE to send()
+        orig::shutdown(victim.fd, SHUT_RDWR);
+    }
+}
+
 void CRandom_Socket_Closer::worker() {
+    const bool recording = gFault_Trace && gFault_Trace->Is_Recording();
+    const bool replaying = gFault_Trace && gFault_Trace->Is_Replaying();
+
+    // sequence number of the drop in the fault trace
+    uint64_t drop_seq = 0;
+
+    // time of the next drop at random interval; max, if none is planned (the connections have lifetimes instead)
+    auto next_drop = TClock::time_point::max();
+    // when the recorded drops run out, no more connections are dropped at random intervals
+    bool replay_done = false;
+    // every drop is traced as a pair of records - the delay and the victim (fd -1, if there was no candidate)
+    intcptor::TTrace_Record delay_record, victim_record;
+
+    std::vector<TCandidate> victims;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
     while (_running) {
-        std::unique_lock<std::mutex> lock(_mutex);
 
-        auto delay = std::chrono::milliseconds(static_cast<int>(gConfig->GetDrop_Connection_Delay_Ms_Min() + gConfig->Generate_Base_Prob() * (gConfig->GetDrop_Connection_Delay_Ms_Max() - gConfig->GetDrop_Connection_Delay_Ms_Min())));
+        if (gConfig->Is_Drop_Lifetime_Enabled()) {
+            next_drop = TClock::time_point::max();
+        }
+        else if (next_drop == TClock::time_point::max() && !replay_done) {
+            size_t delay_ms;
 
-        // we actually don't care about spurious/stolen wakeups
-        _cond.wait_for(lock, std::chrono::milliseconds(delay));
+            if (replaying) {
+                if (!gFault_Trace->Next_Unbound(delay_record) || !gFault_Trace->Next_Unbound(victim_record)) {
+                    replay_done = true;
+                    continue;
+                }
+                delay_ms = static_cast<size_t>(delay_record.value);
+            }
+            else {
+                delay_ms = static_cast<size_t>(gConfig->GetDrop_Connection_Delay_Ms_Min() + gConfig->Generate_Base_Prob() * (gConfig->GetDrop_Connection_Delay_Ms_Max() - gConfig->GetDrop_Connection_Delay_Ms_Min()));
+                if (recording) {
+                    gFault_Trace->Record(-1, 0, drop_seq, intcptor::NDecision::Drop_Delay, static_cast<double>(delay_ms));
+                }
+            }
 
-        // randomly close only accepted client sockets
-        if (intcptor::managed_sockets.empty()) {
-            continue;
+            next_drop = TClock::now() + std::chrono::milliseconds(delay_ms);
+        }
+
+        const auto wake = _expiries.empty() ? next_drop : std::min(next_drop, _expiries.top().due);
+        if (wake == TClock::time_point::max()) {
+            _cond.wait(lock);
+        }
+        else {
+            _cond.wait_until(lock, wake);
+        }
+
+        if (!_running) {
+            break;
+        }
+
+        const auto now = TClock::now();
+
+        // connections at the end of their lifetime; none are dropped (they live on), if the drops were paused by a config
+        // reload
+        while (!_expiries.empty() && _expiries.top().due <= now) {
+            const TCandidate candidate = _expiries.top().candidate;
+            _expiries.pop();
+
+            if (gConfig->Should_Drop_Connections() && Take(candidate)) {
+                victims.push_back(candidate);
+            }
         }
 
-        auto it = intcptor::managed_sockets.begin();
-        std::advance(it, static_cast<int>(gConfig->Generate_Base_Prob() * intcptor::managed_sockets.size()));
+        if (next_drop <= now) {
+            next_drop = TClock::time_point::max();
+
+            TCandidate victim = { -1, 0 };
+
+            if (replaying) {
+                // drop the very same connection; if its descriptor was reused in the meantime, the replayed run diverged
+                const TCandidate recorded = { victim_record.fd, victim_record.generation };
+                if (Take(recorded)) {
+                    victim = recorded;
+                }
+            }
+            else {
+                // randomly close only accepted client sockets; none, if the drops were paused by a config reload
+                if (gConfig->Should_Drop_Connections()) {
+                    victim = Take_Random(gConfig->Generate_Base_Prob());
+                }
+
+                if (recording) {
+                    gFault_Trace->Record(victim.fd, victim.generation, drop_seq, intcptor::NDecision::Drop_Victim, 0.0);
+                }
+            }
 
-        if (it != intcptor::managed_sockets.end()) {
+            drop_seq++;
 
-            if (gConfig->Is_Log_Enabled()) {
-                std::cout << "[[InTCPtor: closing random client socket: " << *it << "]]" << std::endl;
+            if (victim.fd >= 0) {
+                victims.push_back(victim);
             }
+        }
+
+        if (victims.empty()) {
+            continue;
+        }
 
-            // it is important to call shutdown, to block further transmission on the socket
-            orig::shutdown(*it, SHUT_RDWR);
-            orig::close(*it);
-            intcptor::managed_sockets.erase(it);
+        // the drops take the locks of the output queue; the application threads must not wait for them
+        lock.unlock();
+        for (const auto& victim : victims) {
+            Drop(victim);
         }
+        victims.clear();
+        lock.lock();
     }
 }
@@ -10,23 +10,71 @@
 #include <chrono>
 #include <mutex>
 #include <condition_variable>
-#include <memory>
+#include <vector>
+#include <queue>
+#include <unordered_map>
 
 class CRandom_Socket_Closer {
     public:
-        using TPtr = std::unique_ptr<CRandom_Socket_Closer>;
+        using TClock = std::chrono::steady_clock;
 
         CRandom_Socket_Closer();
 
         virtual ~CRandom_Socket_Closer();
 
+        // stops dropping connections
+        void Stop();
+
+        bool Is_Enabled() const { return _running; }
+
+        // registers an accepted connection as a drop candidate; if lifetimes are configured, the connection is scheduled
+        // to be dropped when its lifetime runs out
+        void add(int fd);
+        // the application closed the connection, it is no longer a candidate
+        void remove(int fd);
+
     private:
+        // a drop candidate; the generation tells apart connections, that got the same descriptor number
+        struct TCandidate {
+            int fd;
+            uint32_t generation;
+        };
+
+        // end of the lifetime of a single connection
+        struct TExpiry {
+            TClock::time_point due;
+            TCandidate candidate;
+
+            bool operator>(const TExpiry& other) const {
+                return due > other.due;
+            }
+        };
+
         void worker();
 
+        // removes the candidate in O(1) by moving the last one to its place; returns false, if it is not a candidate
+        // (anymore); expects _mutex to be held
+        bool Take(const TCandidate& candidate);
+
+        // picks a random candidate and removes it; the candidates, whose descriptor was closed without our close() (e.g.,
+        // by fclose() of a stream) are removed on the way; returns fd -1, if there is none; expects _mutex to be held
+        TCandidate Take_Random(double unit);
+
+        // shuts down and closes the connection, if it is still managed
+        void Drop(const TCandidate& victim);
+
         std::thread _worker;
         std::mutex _mutex;
         std::condition_variable _cond;
         bool _running = true;
+
+        // dense array of the candidates, so the random pick and the removal are O(1), and the index of every candidate
+        // within the array
+        std::vector<TCandidate> _candidates;
+        std::unordered_map<int, size_t> _candidate_index;
+
+        // min-heap of lifetime deadlines; entries of the connections closed meanwhile are skipped, when they come due
+        std::priority_queue<TExpiry, std::vector<TExpiry>, std::greater<TExpiry>> _expiries;
 };
 
-extern CRandom_Socket_Closer::TPtr gRandom_Socket_Closer;
+extern CRandom_Socket_Closer* gRandom_Socket_Closer;
@@ -0,0 +1,102 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the table of per-socket state records, indexed by file descriptor.
+ */
+
+#include "socket_table.hpp"
+
+namespace intcptor {
+
+    // NOTE: the chunks are intentionally never freed, as intercepted calls may still come from other threads or from destructors
+    //       of other libraries during process teardown
+    CSocket_Table socket_table;
+
+    TSocket_State* CSocket_Table::Get(int fd) {
+        TSocket_State* state = Find(fd);
+        if (state || fd < 0 || static_cast<size_t>(fd) >= Max_Fds) {
+            return state;
+        }
+
+        auto& slot = _chunks[static_cast<size_t>(fd) >> Chunk_Bits];
+
+        TSocket_State* chunk = new TSocket_State[Chunk_Size];
+        TSocket_State* expected = nullptr;
+
+        // another thread may have allocated the same chunk in the meantime; in that case, use its chunk
+        if (!slot.compare_exchange_strong(expected, chunk, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            delete[] chunk;
+            chunk = expected;
+        }
+
+        return &chunk[static_cast<size_t>(fd) & (Chunk_Size - 1)];
+    }
+
+    TSocket_State* CSocket_Table::Track(int fd, NSocket_Kind kind, uint32_t flags) {
+        TSocket_State* state = Get(fd);
+        if (!state) {
+            return nullptr;
+        }
+
+        state->flags.store(flags, std::memory_order_relaxed);
+        state->profile.store(0, std::memory_order_relaxed);
+        state->connect_ready_ns.store(0, std::memory_order_relaxed);
+        state->recv_calls.store(0, std::memory_order_relaxed);
+        state->send_calls.store(0, std::memory_order_relaxed);
+        state->bytes_received.store(0, std::memory_order_relaxed);
+        state->bytes_sent.store(0, std::memory_order_relaxed);
+        state->rand_counter.store(0, std::memory_order_relaxed);
+        state->shaper_state.store(0, std::memory_order_relaxed);
+        state->generation.fetch_add(1, std::memory_order_relaxed);
+        state->kind.store(kind, std::memory_order_release);
+        Set_Tracked_Bit(fd, kind != NSocket_Kind::None);
+
+        int high = _high_water_fd.load(std::memory_order_relaxed);
+        while (fd > high && !_high_water_fd.compare_exchange_weak(high, fd, std::memory_order_relaxed)) {
+            // retry, "high" was updated by compare_exchange_weak
+        }
+
+        return state;
+    }
+
+    NSocket_Kind CSocket_Table::Untrack(int fd) {
+        TSocket_State* state = Find(fd);
+        if (!state) {
+            return NSocket_Kind::None;
+        }
+
+        const NSocket_Kind prev = state->kind.exchange(NSocket_Kind::None, std::memory_order_acq_rel);
+        if (prev != NSocket_Kind::None) {
+            Set_Tracked_Bit(fd, false);
+        }
+
+        return prev;
+    }
+
+    bool CSocket_Table::Untrack_If(int fd, NSocket_Kind kind) {
+        TSocket_State* state = Find(fd);
+        if (!state) {
+            return false;
+        }
+
+        if (!state->kind.compare_exchange_strong(kind, NSocket_Kind::None, std::memory_order_acq_rel)) {
+            return false;
+        }
+
+        Set_Tracked_Bit(fd, false);
+
+        return true;
+    }
+
+    void CSocket_Table::Set_Tracked_Bit(int fd, bool tracked) {
+        const uint64_t mask = uint64_t(1) << (static_cast<size_t>(fd) % 64);
+        auto& word = _tracked_bits[static_cast<size_t>(fd) / 64];
+
+        if (tracked) {
+            word.fetch_or(mask, std::memory_order_relaxed);
+        }
+        else {
+            word.fetch_and(~mask, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,185 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the table of per-socket state records, indexed by file descriptor.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace intcptor {
+
+    // kind of a tracked file descriptor
+    enum class NSocket_Kind : uint8_t {
+        None = 0,       // not a socket we know about
+        Created = 1,    // created via socket() call
+        Managed = 2,    // accepted via accept() call
+    };
+
+    // per-socket flags
+    enum NSocket_Flags : uint32_t {
+        Shut_Rd = 1 << 0,       // shutdown(SHUT_RD) or shutdown(SHUT_RDWR) was called
+        Shut_Wr = 1 << 1,       // shutdown(SHUT_WR) or shutdown(SHUT_RDWR) was called
+        Stream = 1 << 2,        // connection-oriented socket (SOCK_STREAM)
+        Listening = 1 << 3,     // listen() was called
+        Send_Blocked = 1 << 4,  // a non-blocking send was cut short by the output queue budget and the queue did not drain yet
+        Output_Virtualized = 1 << 5,    // the writability was masked at least once (see CInput_Delay_Stage::virtualize_output)
+    };
+
+    // see input_delay_stage.hpp
+    struct TInput_Buffer;
+
+    // state record of a single file descriptor; all fields are atomic, so the record can be read and updated without locks
+    // the record is padded to a cache line, so the sockets handled by different threads do not share a line
+    struct alignas(64) TSocket_State {
+        std::atomic<NSocket_Kind> kind{ NSocket_Kind::None };
+        // incremented every time a new socket is tracked under this file descriptor number
+        std::atomic<uint32_t> generation{ 0 };
+        std::atomic<uint32_t> flags{ 0 };
+        // fault profile bound to the socket, as encoded by the config (see CConfig::Profile_Of); zero = not resolved yet
+        std::atomic<uint32_t> profile{ 0 };
+
+        std::atomic<uint64_t> recv_calls{ 0 };
+        std::atomic<uint64_t> send_calls{ 0 };
+        std::atomic<uint64_t> bytes_received{ 0 };
+        std::atomic<uint64_t> bytes_sent{ 0 };
+
+        // time (steady clock, in ns), when the simulated handshake of a non-blocking connect() completes; the socket is not
+        // reported writable before; zero = no handshake was simulated
+        std::atomic<int64_t> connect_ready_ns{ 0 };
+
+        // position in the random stream of this socket (see random.hpp)
+        std::atomic<uint64_t> rand_counter{ 0 };
+
+        // bytes reserved in the output queue and not sent yet; not reset when a new socket is tracked, as the queue may still
+        // hold data pushed to this fd number before
+        std::atomic<uint64_t> queued_bytes{ 0 };
+
+        // state of the bandwidth token bucket of this socket (see token_bucket.hpp); updated only by the worker of the output
+        // queue shard, the socket belongs to; reset when a new socket is tracked, so it does not pay for the data of its
+        // predecessor (those are discarded by generation, and never sent)
+        std::atomic<int64_t> shaper_state{ 0 };
+
+        // received data held by the input delay stage; created on the first use, released on close()
+        std::atomic<TInput_Buffer*> input_buffer{ nullptr };
+
+        // IPv4 endpoints of the connection in the capture (see CCapture_Writer), looked up by the first capture of every
+        // generation, while the connection still has its peer: local << 32 | remote address, and local << 16 | remote port;
+        // valid only if capture_generation equals generation
+        std::atomic<uint64_t> capture_addrs{ 0 };
+        std::atomic<uint32_t> capture_ports{ 0 };
+        std::atomic<uint32_t> capture_generation{ 0 };
+    };
+
+    // dense table of socket states, indexed by file descriptor
+    // the table consists of fixed-size chunks, that are allocated on demand and never freed nor moved; this way, a reader
+    // may hold a reference to a record without any lock, and the table may grow while other threads read it
+    class CSocket_Table final {
+        public:
+            static constexpr size_t Chunk_Bits = 10;
+            static constexpr size_t Chunk_Size = size_t(1) << Chunk_Bits;
+            static constexpr size_t Max_Chunks = 1024;
+            static constexpr size_t Max_Fds = Chunk_Size * Max_Chunks;
+
+            constexpr CSocket_Table() = default;
+
+            // retrieves the record of given fd, if it was ever allocated; returns nullptr otherwise
+            TSocket_State* Find(int fd) const {
+                if (fd < 0 || static_cast<size_t>(fd) >= Max_Fds) {
+                    return nullptr;
+                }
+                TSocket_State* chunk = _chunks[static_cast<size_t>(fd) >> Chunk_Bits].load(std::memory_order_acquire);
+                if (!chunk) {
+                    return nullptr;
+                }
+                return &chunk[static_cast<size_t>(fd) & (Chunk_Size - 1)];
+            }
+
+            // retrieves the record of given fd, allocates the chunk if needed; returns nullptr if the fd is out of range
+            TSocket_State* Get(int fd);
+
+            NSocket_Kind Get_Kind(int fd) const {
+                const TSocket_State* state = Find(fd);
+                return state ? state->kind.load(std::memory_order_relaxed) : NSocket_Kind::None;
+            }
+
+            // fast check used by calls, that are mostly made on non-socket descriptors (read, write, ...)
+            // this is a single relaxed load from a statically allocated bitmap, no chunk lookup is involved
+            bool Is_Tracked(int fd) const {
+                if (static_cast<unsigned int>(fd) >= Max_Fds) {
+                    return false;
+                }
+                return (_tracked_bits[static_cast<size_t>(fd) / 64].load(std::memory_order_relaxed) >> (static_cast<size_t>(fd) % 64)) & 1;
+            }
+
+            // starts tracking the fd as a socket of given kind; sets flags, resets counters and starts a new generation
+            TSocket_State* Track(int fd, NSocket_Kind kind, uint32_t flags = 0);
+
+            // stops tracking the fd; returns the kind it was tracked as
+            NSocket_Kind Untrack(int fd);
+
+            // stops tracking the fd only if it is tracked as the given kind; returns true if this call untracked it
+            bool Untrack_If(int fd, NSocket_Kind kind);
+
+            // the highest fd ever tracked (or -1), so the iteration does not need to go through the whole table
+            int Get_High_Water_Fd() const {
+                return _high_water_fd.load(std::memory_order_relaxed);
+            }
+
+            // calls func(fd, state) for every fd currently tracked as given kind
+            template<typename TFunc>
+            void For_Each(NSocket_Kind kind, TFunc&& func) const {
+                const int high = Get_High_Water_Fd();
+                for (int fd = 0; fd <= high; fd++) {
+                    TSocket_State* state = Find(fd);
+                    if (!state) {
+                        // skip the whole unallocated chunk
+                        fd |= static_cast<int>(Chunk_Size - 1);
+                        continue;
+                    }
+                    if (state->kind.load(std::memory_order_relaxed) == kind) {
+                        func(fd, *state);
+                    }
+                }
+            }
+
+        private:
+            void Set_Tracked_Bit(int fd, bool tracked);
+
+            std::atomic<TSocket_State*> _chunks[Max_Chunks] = {};
+            // one bit per fd, set if the fd is tracked as any kind; the bitmap lives in zero-initialized storage, so only
+            // pages covering the used fd range are ever touched
+            std::atomic<uint64_t> _tracked_bits[Max_Fds / 64] = {};
+            std::atomic<int> _high_water_fd{ -1 };
+    };
+
+    // the table is constant-initialized, so it is usable even before the startup guard runs
+    extern CSocket_Table socket_table;
+
+    // is the simulated handshake of the socket still in progress? if so, returns the time it completes in ready
+    inline bool Is_Connecting(int fd, std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point* ready = nullptr) {
+        if (!socket_table.Is_Tracked(fd)) {
+            return false;
+        }
+        const int64_t ready_ns = socket_table.Find(fd)->connect_ready_ns.load(std::memory_order_acquire);
+        if (ready_ns == 0 || ready_ns <= std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count()) {
+            return false;
+        }
+        if (ready) {
+            *ready = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(ready_ns));
+        }
+        return true;
+    }
+
+    // the same, for callers, that don't need the time otherwise; the clock is read only if a handshake was simulated
+    inline bool Is_Connecting(int fd, std::chrono::steady_clock::time_point* ready = nullptr) {
+        if (!socket_table.Is_Tracked(fd) || socket_table.Find(fd)->connect_ready_ns.load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+        return Is_Connecting(fd, std::chrono::steady_clock::now(), ready);
+    }
+}
@@ -7,12 +7,19 @@
 #include "startup.hpp"
 
 #include <iostream>
+#include <utility>
 #include <dlfcn.h>
 
 #include "overrides.hpp"
 #include "config.hpp"
+#include "config_watcher.hpp"
 #include "output_timed_queue.hpp"
+#include "input_delay_stage.hpp"
 #include "random_socket_closer.hpp"
+#include "fault_trace.hpp"
+#include "capture_writer.hpp"
+#include "stats.hpp"
+#include "logger.hpp"
 
 CStartup_Guard gStartup_Guard;
 
@@ -20,11 +27,31 @@ CStartup_Guard::CStartup_Guard() {
     orig::socket = reinterpret_cast<int (*)(int, int, int)>(dlsym(RTLD_NEXT, "socket"));
     orig::close = reinterpret_cast<int (*)(int)>(dlsym(RTLD_NEXT, "close"));
     orig::accept = reinterpret_cast<int (*)(int, struct sockaddr*, socklen_t*)>(dlsym(RTLD_NEXT, "accept"));
+    orig::accept4 = reinterpret_cast<int (*)(int, struct sockaddr*, socklen_t*, int)>(dlsym(RTLD_NEXT, "accept4"));
+    orig::connect = reinterpret_cast<int (*)(int, const struct sockaddr*, socklen_t)>(dlsym(RTLD_NEXT, "connect"));
     orig::recv = reinterpret_cast<ssize_t (*)(int, void*, size_t, int)>(dlsym(RTLD_NEXT, "recv"));
     orig::send = reinterpret_cast<ssize_t (*)(int, const void*, size_t, int)>(dlsym(RTLD_NEXT, "send"));
     orig::read = reinterpret_cast<ssize_t (*)(int, void*, size_t)>(dlsym(RTLD_NEXT, "read"));
     orig::write = reinterpret_cast<ssize_t (*)(int, const void*, size_t)>(dlsym(RTLD_NEXT, "write"));
     orig::shutdown = reinterpret_cast<int (*)(int, int)>(dlsym(RTLD_NEXT, "shutdown"));
+    orig::writev = reinterpret_cast<ssize_t (*)(int, const struct iovec*, int)>(dlsym(RTLD_NEXT, "writev"));
+    orig::sendto = reinterpret_cast<ssize_t (*)(int, const void*, size_t, int, const struct sockaddr*, socklen_t)>(dlsym(RTLD_NEXT, "sendto"));
+    orig::sendmsg = reinterpret_cast<ssize_t (*)(int, const struct msghdr*, int)>(dlsym(RTLD_NEXT, "sendmsg"));
+    orig::sendmmsg = reinterpret_cast<int (*)(int, struct mmsghdr*, unsigned int, int)>(dlsym(RTLD_NEXT, "sendmmsg"));
+    orig::readv = reinterpret_cast<ssize_t (*)(int, const struct iovec*, int)>(dlsym(RTLD_NEXT, "readv"));
+    orig::recvmsg = reinterpret_cast<ssize_t (*)(int, struct msghdr*, int)>(dlsym(RTLD_NEXT, "recvmsg"));
+    orig::recvmmsg = reinterpret_cast<int (*)(int, struct mmsghdr*, unsigned int, int, struct timespec*)>(dlsym(RTLD_NEXT, "recvmmsg"));
+    orig::listen = reinterpret_cast<int (*)(int, int)>(dlsym(RTLD_NEXT, "listen"));
+    orig::poll = reinterpret_cast<int (*)(struct pollfd*, nfds_t, int)>(dlsym(RTLD_NEXT, "poll"));
+    orig::ppoll = reinterpret_cast<int (*)(struct pollfd*, nfds_t, const struct timespec*, const sigset_t*)>(dlsym(RTLD_NEXT, "ppoll"));
+    orig::select = reinterpret_cast<int (*)(int, fd_set*, fd_set*, fd_set*, struct timeval*)>(dlsym(RTLD_NEXT, "select"));
+    orig::epoll_ctl = reinterpret_cast<int (*)(int, int, int, struct epoll_event*)>(dlsym(RTLD_NEXT, "epoll_ctl"));
+    orig::epoll_wait = reinterpret_cast<int (*)(int, struct epoll_event*, int, int)>(dlsym(RTLD_NEXT, "epoll_wait"));
+    orig::epoll_pwait = reinterpret_cast<int (*)(int, struct epoll_event*, int, int, const sigset_t*)>(dlsym(RTLD_NEXT, "epoll_pwait"));
+    orig::ioctl = reinterpret_cast<int (*)(int, unsigned long, ...)>(dlsym(RTLD_NEXT, "ioctl"));
+    orig::sendfile = reinterpret_cast<ssize_t (*)(int, int, off_t*, size_t)>(dlsym(RTLD_NEXT, "sendfile"));
+    orig::sendfile64 = reinterpret_cast<ssize_t (*)(int, int, off64_t*, size_t)>(dlsym(RTLD_NEXT, "sendfile64"));
+    orig::splice = reinterpret_cast<ssize_t (*)(int, loff_t*, int, loff_t*, size_t, unsigned int)>(dlsym(RTLD_NEXT, "splice"));
 
     if (!orig::socket) {
         std::cerr << "[[InTCPtor: failed to find original socket() function]]" << std::endl;
@@ -35,6 +62,12 @@ CStartup_Guard::CStartup_Guard() {
     if (!orig::accept) {
         std::cerr << "[[InTCPtor: failed to find original accept() function]]" << std::endl;
     }
+    if (!orig::accept4) {
+        std::cerr << "[[InTCPtor: failed to find original accept4() function]]" << std::endl;
+    }
+    if (!orig::connect) {
+        std::cerr << "[[InTCPtor: failed to find original connect() function]]" << std::endl;
+    }
     if (!orig::recv) {
         std::cerr << "[[InTCPtor: failed to find original recv() function]]" << std::endl;
     }
@@ -50,19 +83,99 @@ CStartup_Guard::CStartup_Guard() {
     if (!orig::shutdown) {
         std::cerr << "[[InTCPtor: failed to find original shutdown() function]]" << std::endl;
     }
+    if (!orig::writev) {
+        std::cerr << "[[InTCPtor: failed to find original writev() function]]" << std::endl;
+    }
+    if (!orig::sendto) {
+        std::cerr << "[[InTCPtor: failed to find original sendto() function]]" << std::endl;
+    }
+    if (!orig::sendmsg) {
+        std::cerr << "[[InTCPtor: failed to find original sendmsg() function]]" << std::endl;
+    }
+    if (!orig::sendmmsg) {
+        std::cerr << "[[InTCPtor: failed to find original sendmmsg() function]]" << std::endl;
+    }
+    if (!orig::readv) {
+        std::cerr << "[[InTCPtor: failed to find original readv() function]]" << std::endl;
+    }
+    if (!orig::recvmsg) {
+        std::cerr << "[[InTCPtor: failed to find original recvmsg() function]]" << std::endl;
+    }
+    if (!orig::recvmmsg) {
+        std::cerr << "[[InTCPtor: failed to find original recvmmsg() function]]" << std::endl;
+    }
+    if (!orig::listen) {
+        std::cerr << "[[InTCPtor: failed to find original listen() function]]" << std::endl;
+    }
+    if (!orig::poll) {
+        std::cerr << "[[InTCPtor: failed to find original poll() function]]" << std::endl;
+    }
+    if (!orig::ppoll) {
+        std::cerr << "[[InTCPtor: failed to find original ppoll() function]]" << std::endl;
+    }
+    if (!orig::select) {
+        std::cerr << "[[InTCPtor: failed to find original select() function]]" << std::endl;
+    }
+    if (!orig::epoll_ctl) {
+        std::cerr << "[[InTCPtor: failed to find original epoll_ctl() function]]" << std::endl;
+    }
+    if (!orig::epoll_wait) {
+        std::cerr << "[[InTCPtor: failed to find original epoll_wait() function]]" << std::endl;
+    }
+    if (!orig::epoll_pwait) {
+        std::cerr << "[[InTCPtor: failed to find original epoll_pwait() function]]" << std::endl;
+    }
+    if (!orig::ioctl) {
+        std::cerr << "[[InTCPtor: failed to find original ioctl() function]]" << std::endl;
+    }
+    if (!orig::sendfile) {
+        std::cerr << "[[InTCPtor: failed to find original sendfile() function]]" << std::endl;
+    }
+    if (!orig::sendfile64) {
+        std::cerr << "[[InTCPtor: failed to find original sendfile64() function]]" << std::endl;
+    }
+    if (!orig::splice) {
+        std::cerr << "[[InTCPtor: failed to find original splice() function]]" << std::endl;
+    }
 
     // this log is excluded from the conditional, because we always want to know if the library is loaded
     std::cout << "[[InTCPtor: intercepting socket calls]]" << std::endl;
 
-    // initialize all other globals
+    // initialize all other globals; they are plain pointers (or constant-initialized objects) without static destructors,
+    // so they are created and torn down only here, no matter in which order the sources are linked
 
     // always initialize config first
-    gConfig = std::make_unique<CConfig>();
+    gConfig.Exchange(std::make_unique<CConfig>());
+
+    // logger goes right after config, as all other components may log
+    gLogger = new CLogger();
+    // statistics are published before any socket is intercepted, so the counters cover the whole run
+    gStats = new CStats();
+
+    // the trace must be ready before the first fault decision is made
+    gFault_Trace = new CFault_Trace();
+    gCapture_Writer = new CCapture_Writer();
 
-    gOutput_Timed_Queue = std::make_unique<COutput_Timed_Queue>();
-    gRandom_Socket_Closer = std::make_unique<CRandom_Socket_Closer>();
+    gOutput_Timed_Queue = new COutput_Timed_Queue();
+    gInput_Delay_Stage = new CInput_Delay_Stage();
+    gRandom_Socket_Closer = new CRandom_Socket_Closer();
+
+    // the reloads start only when all components run with the initial config
+    gConfig_Watcher = new CConfig_Watcher();
 }
 
 CStartup_Guard::~CStartup_Guard() {
+    // nothing but the startup guard uses the config watcher
+    delete std::exchange(gConfig_Watcher, nullptr);
+
+    // the other components are only stopped, in reverse order of their creation, so the logger is still there when they
+    // finish; they are never freed, as other threads may still be inside the intercepted calls
+    gRandom_Socket_Closer->Stop();
+    gOutput_Timed_Queue->Stop();
+    gCapture_Writer->Stop();
+    gFault_Trace->Stop();
+    gStats->Unpublish();
+    gLogger->Stop();
+
     std::cout << "[[InTCPtor: stopping intercepting socket calls]]" << std::endl;
 }
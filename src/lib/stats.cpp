@@ -0,0 +1,100 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the statistics publisher, that exposes live counters in a shared memory segment.
+ */
+
+#include "stats.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "overrides.hpp"
+#include "config.hpp"
+
+CStats* gStats = nullptr;
+
+CStats::CStats() {
+    if (!gConfig->Is_Stats_Enabled()) {
+        return;
+    }
+
+    const std::string name = intcptor::Stats_Segment_Name(::getpid());
+
+    const int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        std::cerr << "[[InTCPtor: failed to create statistics segment " << name << "]]" << std::endl;
+        return;
+    }
+
+    // the segment is zero-filled, so all counters start at zero
+    void* mem = MAP_FAILED;
+    if (::ftruncate(fd, sizeof(intcptor::TStats_Segment)) == 0) {
+        mem = ::mmap(nullptr, sizeof(intcptor::TStats_Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    // the mapping stays valid without the descriptor; it is not kept, so it does not shift descriptors of the application
+    orig::close(fd);
+
+    if (mem == MAP_FAILED) {
+        std::cerr << "[[InTCPtor: failed to map statistics segment " << name << "]]" << std::endl;
+        ::shm_unlink(name.c_str());
+        return;
+    }
+
+    auto* segment = static_cast<intcptor::TStats_Segment*>(mem);
+    segment->version = intcptor::Stats_Version;
+    segment->pid = ::getpid();
+    segment->start_time_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    // the magic goes last, the reader does not touch the segment until it is set
+    __atomic_store_n(&segment->magic, intcptor::Stats_Magic, __ATOMIC_RELEASE);
+
+    _segment = segment;
+
+    if (gConfig->Is_Log_Enabled()) {
+        std::cout << "[[InTCPtor: publishing statistics to shared memory " << name << "]]" << std::endl;
+    }
+}
+
+CStats::~CStats() {
+    Unpublish();
+
+    if (_segment) {
+        ::munmap(_segment, sizeof(intcptor::TStats_Segment));
+        _segment = nullptr;
+    }
+}
+
+void CStats::Unpublish() {
+    if (_segment && !_unpublished.exchange(true)) {
+        ::shm_unlink(intcptor::Stats_Segment_Name(::getpid()).c_str());
+    }
+}
+
+void CStats::Socket_Opened(int fd) {
+    Add(intcptor::NStat::Sockets_Opened, 1);
+
+    if (static_cast<unsigned int>(fd) >= intcptor::Stats_Max_Sockets) {
+        return;
+    }
+
+    auto& slot = _segment->sockets[fd];
+    for (auto& counter : slot.counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    slot.generation.fetch_add(1, std::memory_order_relaxed);
+    slot.open.store(1, std::memory_order_release);
+}
+
+void CStats::Socket_Closed(int fd) {
+    Add(intcptor::NStat::Sockets_Closed, 1);
+
+    if (static_cast<unsigned int>(fd) < intcptor::Stats_Max_Sockets) {
+        _segment->sockets[fd].open.store(0, std::memory_order_release);
+    }
+}
@@ -0,0 +1,92 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the statistics publisher, that exposes live counters in a shared memory segment.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include "stats_segment.hpp"
+
+class CStats {
+    public:
+        CStats();
+
+        virtual ~CStats();
+
+        // removes the segment name, so the viewer sees the process is gone; the segment stays mapped, the application
+        // threads may still update the counters
+        void Unpublish();
+
+        bool Is_Enabled() const { return _segment != nullptr; }
+
+        void Add(intcptor::NStat stat, uint64_t value) {
+            Stripe().counters[static_cast<size_t>(stat)].fetch_add(value, std::memory_order_relaxed);
+        }
+
+        void Add_Histogram(intcptor::NHistogram histogram, uint64_t value) {
+            Stripe().histograms[static_cast<size_t>(histogram)][intcptor::Stats_Bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Add_Socket(int fd, intcptor::NSocket_Stat stat, uint64_t value) {
+            if (static_cast<unsigned int>(fd) < intcptor::Stats_Max_Sockets) {
+                _segment->sockets[fd].counters[static_cast<size_t>(stat)].fetch_add(value, std::memory_order_relaxed);
+            }
+        }
+
+        // starts a new socket slot; the counters of the previous socket with the same descriptor are cleared
+        void Socket_Opened(int fd);
+        void Socket_Closed(int fd);
+
+    private:
+        // stripe of the calling thread; threads are assigned to the stripes round-robin on their first use
+        intcptor::TStats_Stripe& Stripe() {
+            thread_local const size_t index = _next_stripe.fetch_add(1, std::memory_order_relaxed) % intcptor::Stats_Stripes;
+            return _segment->stripes[index];
+        }
+
+        intcptor::TStats_Segment* _segment = nullptr;
+        std::atomic<size_t> _next_stripe{ 0 };
+        std::atomic<bool> _unpublished{ false };
+};
+
+// NOTE: the statistics are never freed (nor unmapped), the application threads may update them until the very end
+//       of the process
+extern CStats* gStats;
+
+namespace intcptor {
+    // convenience functions to update the statistics, if they are published
+    inline void Stat(NStat stat, uint64_t value = 1) {
+        if (gStats && gStats->Is_Enabled()) {
+            gStats->Add(stat, value);
+        }
+    }
+
+    inline void Stat_Histogram(NHistogram histogram, uint64_t value) {
+        if (gStats && gStats->Is_Enabled()) {
+            gStats->Add_Histogram(histogram, value);
+        }
+    }
+
+    inline void Stat_Socket(int fd, NSocket_Stat stat, uint64_t value = 1) {
+        if (gStats && gStats->Is_Enabled()) {
+            gStats->Add_Socket(fd, stat, value);
+        }
+    }
+
+    inline void Stat_Socket_Opened(int fd) {
+        if (gStats && gStats->Is_Enabled()) {
+            gStats->Socket_Opened(fd);
+        }
+    }
+
+    inline void Stat_Socket_Closed(int fd) {
+        if (gStats && gStats->Is_Enabled()) {
+            gStats->Socket_Closed(fd);
+        }
+    }
+}
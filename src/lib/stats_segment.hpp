@@ -0,0 +1,113 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the layout of the shared memory segment with live statistics. It is shared by the library (that
+ * publishes the statistics) and the runner (that reads them), so it must not depend on anything else in the library.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace intcptor {
+
+    constexpr uint32_t Stats_Magic = 0x54534349; // "ICST"
+    constexpr uint32_t Stats_Version = 2;
+
+    // process-wide counters are split to this many stripes; every thread updates its own stripe, and the reader sums them
+    constexpr size_t Stats_Stripes = 16;
+    // sockets with higher descriptor numbers are counted only in the process-wide counters
+    constexpr size_t Stats_Max_Sockets = 4096;
+    // histograms have logarithmic buckets: 0, 1, 2-3, 4-7, ..., the last bucket holds everything above
+    constexpr size_t Stats_Histogram_Buckets = 16;
+
+    // process-wide counters; all of them only grow, the current levels (e.g., the queue depth) are differences of two
+    enum class NStat : uint32_t {
+        Send_Calls,             // intercepted sending calls
+        Send_Bytes,             // bytes accepted from the application to the output queue
+        Send_Fragments,         // fragments the accepted data were split to
+        Send_Blocked,           // sending calls cut short (or failed with EAGAIN) because of the queue limits
+        Sent_Fragments,         // fragments actually sent by the output queue
+        Sent_Bytes,             // bytes actually sent by the output queue
+        Send_Throttled,         // times a socket queue was stopped by the bandwidth limits
+        Recv_Calls,             // intercepted receiving calls
+        Recv_Bytes,             // bytes returned to the application
+        Recv_Short,             // receiving calls shortened on purpose
+        Held_Bytes,             // bytes taken to the input delay stage
+        Released_Bytes,         // bytes released from the input delay stage to the application
+        Sockets_Opened,
+        Sockets_Closed,
+        Drops,                  // connections dropped by the random socket closer
+        Discarded_Bytes,        // queued bytes never sent, as their socket was closed before they were due
+
+        Count
+    };
+
+    enum class NHistogram : uint32_t {
+        Send_Delay_Ms,          // delay of every sent fragment
+        Recv_Delay_Ms,          // delay of every received chunk
+        Send_Fragments,         // number of fragments of every sending call
+
+        Count
+    };
+
+    // per-socket counters
+    enum class NSocket_Stat : uint32_t {
+        Send_Bytes,
+        Sent_Bytes,
+        Recv_Bytes,
+        Send_Fragments,
+        Recv_Short,
+        Send_Delay_Ms,          // sum of delays of all fragments, for the average
+
+        Count
+    };
+
+    // a single stripe of process-wide counters; aligned to cache lines, so the stripes of different threads never share one
+    struct alignas(64) TStats_Stripe {
+        std::atomic<uint64_t> counters[static_cast<size_t>(NStat::Count)];
+        std::atomic<uint64_t> histograms[static_cast<size_t>(NHistogram::Count)][Stats_Histogram_Buckets];
+    };
+
+    // counters of the socket with the descriptor number equal to the index of the slot
+    struct alignas(64) TStats_Socket {
+        // incremented every time a new socket gets this descriptor number, so the reader can tell reused slots apart;
+        // zero means the slot was never used
+        std::atomic<uint32_t> generation;
+        // nonzero while the socket is open
+        std::atomic<uint32_t> open;
+        std::atomic<uint64_t> counters[static_cast<size_t>(NSocket_Stat::Count)];
+    };
+
+    static_assert(sizeof(TStats_Socket) == 64, "socket slot must fit a single cache line");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "counters must be lock-free to be shared between processes");
+
+    struct TStats_Segment {
+        uint32_t magic;
+        uint32_t version;
+        int32_t pid;
+        uint32_t reserved;
+        // wall clock time of the library startup
+        uint64_t start_time_ns;
+
+        TStats_Stripe stripes[Stats_Stripes];
+        TStats_Socket sockets[Stats_Max_Sockets];
+    };
+
+    // name of the POSIX shared memory object of given process
+    inline std::string Stats_Segment_Name(int pid) {
+        return "/intcptor-" + std::to_string(pid);
+    }
+
+    // histogram bucket of given value
+    inline size_t Stats_Bucket(uint64_t value) {
+        if (value == 0) {
+            return 0;
+        }
+        const size_t bits = 64 - static_cast<size_t>(__builtin_clzll(value));
+        return bits < Stats_Histogram_Buckets ? bits : Stats_Histogram_Buckets - 1;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the token bucket used to shape the bandwidth of sent data.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace intcptor {
+
+    // token bucket in the "virtual scheduling" form - instead of the number of tokens, the state of the bucket is a single
+    // time point (in nanoseconds), at which the bucket would be completely full again; this way, the state fits to a single
+    // atomic and may be shared by several workers without a lock
+    // the parameters (rate and burst) are immutable, the state is kept by the caller, so one bucket serves many sockets
+    class CToken_Bucket final {
+        public:
+            // rate in kilobits per second (0 = unlimited), burst in bytes
+            CToken_Bucket(uint64_t rate_kbit, size_t burst)
+                : _ns_per_byte(rate_kbit > 0 ? 8.0e6 / static_cast<double>(rate_kbit) : 0.0),
+                  _burst_ns(static_cast<int64_t>(_ns_per_byte * static_cast<double>(burst))) {
+            }
+
+            bool Is_Enabled() const {
+                return _ns_per_byte > 0.0;
+            }
+
+            // the time, at which the bucket with given state lets the next data through
+            int64_t Ready_At(const std::atomic<int64_t>& state) const {
+                return state.load(std::memory_order_relaxed) - _burst_ns;
+            }
+
+            // lets len bytes through at time now, if the bucket allows; otherwise returns false and leaves the state as is
+            // the data may be larger than the burst, the bucket then stays empty for correspondingly longer time
+            bool Try_Consume(std::atomic<int64_t>& state, size_t len, int64_t now) const {
+                int64_t tat = state.load(std::memory_order_relaxed);
+                int64_t next;
+                do {
+                    if (tat - _burst_ns > now) {
+                        return false;
+                    }
+                    next = std::max(tat, now) + static_cast<int64_t>(_ns_per_byte * static_cast<double>(len));
+                } while (!state.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+
+                return true;
+            }
+
+        private:
+            double _ns_per_byte;
+            int64_t _burst_ns;
+    };
+}
@@ -9,6 +9,9 @@
 #include <unistd.h>
 #include <cstring>
 #include <cerrno>
+#include <cstdlib>
+
+#include "stats_viewer.hpp"
 
 int main(int argc, char** argv) {
 
@@ -16,9 +19,21 @@ int main(int argc, char** argv) {
 
 	if (argc < 2) {
 		std::cerr << "[[InTCPtor Runner: usage: " << argv[0] << " <path to the binary to run> [<optional arguments>] ]]" << std::endl;
+		std::cerr << "[[InTCPtor Runner: usage: " << argv[0] << " --stats <pid> [<interval in ms>] ]]" << std::endl;
 		return 1;
 	}
 
+	// attach to a running process instead of starting a new one
+	if (std::strcmp(argv[1], "--stats") == 0) {
+		const int pid = argc > 2 ? std::atoi(argv[2]) : 0;
+		const int interval_ms = argc > 3 ? std::atoi(argv[3]) : 1000;
+		if (pid <= 0 || interval_ms <= 0) {
+			std::cerr << "[[InTCPtor Runner: usage: " << argv[0] << " --stats <pid> [<interval in ms>] ]]" << std::endl;
+			return 1;
+		}
+		return Run_Stats_Viewer(pid, interval_ms);
+	}
+
 	std::cout << "[[InTCPtor Runner: executing " << argv[1] << "]]" << std::endl;
 	if (argc > 2) {
 		std::cout << "[[InTCPtor Runner: arguments: ";
@@ -0,0 +1,277 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the statistics viewer of the runner, that attaches to the shared memory segment of a running process.
+ */
+
+#include "stats_viewer.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../lib/stats_segment.hpp"
+
+namespace {
+
+	// number of the most active sockets listed every interval
+	constexpr size_t Top_Sockets = 5;
+
+	// a copy of all counters at one point in time
+	struct TSnapshot {
+		uint64_t counters[static_cast<size_t>(intcptor::NStat::Count)] = {};
+		uint64_t histograms[static_cast<size_t>(intcptor::NHistogram::Count)][intcptor::Stats_Histogram_Buckets] = {};
+		uint32_t generations[intcptor::Stats_Max_Sockets] = {};
+		uint64_t sockets[intcptor::Stats_Max_Sockets][static_cast<size_t>(intcptor::NSocket_Stat::Count)] = {};
+		std::chrono::steady_clock::time_point taken;
+	};
+
+	void Take_Snapshot(const intcptor::TStats_Segment& segment, TSnapshot& snapshot) {
+		snapshot = {};
+		snapshot.taken = std::chrono::steady_clock::now();
+
+		for (const auto& stripe : segment.stripes) {
+			for (size_t i = 0; i < static_cast<size_t>(intcptor::NStat::Count); i++) {
+				snapshot.counters[i] += stripe.counters[i].load(std::memory_order_relaxed);
+			}
+			for (size_t h = 0; h < static_cast<size_t>(intcptor::NHistogram::Count); h++) {
+				for (size_t b = 0; b < intcptor::Stats_Histogram_Buckets; b++) {
+					snapshot.histograms[h][b] += stripe.histograms[h][b].load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		for (size_t fd = 0; fd < intcptor::Stats_Max_Sockets; fd++) {
+			const auto& slot = segment.sockets[fd];
+			// closed sockets are not listed; a zero generation marks them in the snapshot
+			if (slot.open.load(std::memory_order_acquire) == 0) {
+				continue;
+			}
+			snapshot.generations[fd] = slot.generation.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < static_cast<size_t>(intcptor::NSocket_Stat::Count); i++) {
+				snapshot.sockets[fd][i] = slot.counters[i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	uint64_t Counter(const TSnapshot& snapshot, intcptor::NStat stat) {
+		return snapshot.counters[static_cast<size_t>(stat)];
+	}
+
+	uint64_t Socket_Counter(const TSnapshot& snapshot, size_t fd, intcptor::NSocket_Stat stat) {
+		return snapshot.sockets[fd][static_cast<size_t>(stat)];
+	}
+
+	// upper bound of the bucket, that contains given percentile of the values added between the snapshots; -1 if there are none
+	int64_t Percentile(const TSnapshot& prev, const TSnapshot& cur, intcptor::NHistogram histogram, double percentile) {
+		const size_t h = static_cast<size_t>(histogram);
+
+		uint64_t deltas[intcptor::Stats_Histogram_Buckets];
+		uint64_t total = 0;
+		for (size_t b = 0; b < intcptor::Stats_Histogram_Buckets; b++) {
+			deltas[b] = cur.histograms[h][b] - prev.histograms[h][b];
+			total += deltas[b];
+		}
+
+		if (total == 0) {
+			return -1;
+		}
+
+		const uint64_t rank = static_cast<uint64_t>(percentile * static_cast<double>(total - 1));
+		uint64_t seen = 0;
+		for (size_t b = 0; b < intcptor::Stats_Histogram_Buckets; b++) {
+			seen += deltas[b];
+			if (seen > rank) {
+				return b == 0 ? 0 : (int64_t{ 1 } << b) - 1;
+			}
+		}
+
+		return (int64_t{ 1 } << (intcptor::Stats_Histogram_Buckets - 1)) - 1;
+	}
+
+	std::string Format_Bytes(double bytes) {
+		std::ostringstream oss;
+		oss << std::fixed << std::setprecision(1);
+		if (bytes >= 1024.0 * 1024.0) {
+			oss << bytes / (1024.0 * 1024.0) << " MB";
+		}
+		else if (bytes >= 1024.0) {
+			oss << bytes / 1024.0 << " kB";
+		}
+		else {
+			oss << bytes << " B";
+		}
+		return oss.str();
+	}
+
+	std::string Format_Percentiles(const TSnapshot& prev, const TSnapshot& cur, intcptor::NHistogram histogram) {
+		const int64_t p50 = Percentile(prev, cur, histogram, 0.5);
+		const int64_t p99 = Percentile(prev, cur, histogram, 0.99);
+		if (p50 < 0) {
+			return "-";
+		}
+		return "<=" + std::to_string(p50) + "/<=" + std::to_string(p99);
+	}
+
+	void Print_Interval(const TSnapshot& prev, const TSnapshot& cur, const TSnapshot& first) {
+		using intcptor::NStat;
+
+		const double seconds = std::max(1e-3, std::chrono::duration<double>(cur.taken - prev.taken).count());
+		const double elapsed = std::chrono::duration<double>(cur.taken - first.taken).count();
+		auto rate = [&](NStat stat) {
+			return static_cast<double>(Counter(cur, stat) - Counter(prev, stat)) / seconds;
+		};
+
+		const uint64_t send_calls = Counter(cur, NStat::Send_Calls) - Counter(prev, NStat::Send_Calls);
+		const uint64_t send_fragments = Counter(cur, NStat::Send_Fragments) - Counter(prev, NStat::Send_Fragments);
+		// the levels are differences of two growing counters; they are read at slightly different times, so guard the sign
+		const uint64_t queued = Counter(cur, NStat::Send_Bytes) - std::min(Counter(cur, NStat::Send_Bytes), Counter(cur, NStat::Sent_Bytes) + Counter(cur, NStat::Discarded_Bytes));
+		const uint64_t held = Counter(cur, NStat::Held_Bytes) - std::min(Counter(cur, NStat::Held_Bytes), Counter(cur, NStat::Released_Bytes));
+
+		std::cout << std::fixed << std::setprecision(1)
+			<< "[[InTCPtor Stats: " << elapsed << " s"
+			<< " | send " << rate(NStat::Send_Calls) << "/s in " << Format_Bytes(rate(NStat::Send_Bytes)) << "/s out " << Format_Bytes(rate(NStat::Sent_Bytes)) << "/s"
+			<< " | frag/send " << std::setprecision(2) << (send_calls > 0 ? static_cast<double>(send_fragments) / static_cast<double>(send_calls) : 0.0) << std::setprecision(1)
+			<< " | queued " << Format_Bytes(static_cast<double>(queued))
+			<< " | held " << Format_Bytes(static_cast<double>(held))
+			<< " | recv " << rate(NStat::Recv_Calls) << "/s " << Format_Bytes(rate(NStat::Recv_Bytes)) << "/s short " << rate(NStat::Recv_Short) << "/s"
+			<< " | blocked " << rate(NStat::Send_Blocked) << "/s throttled " << rate(NStat::Send_Throttled) << "/s"
+			<< " | sockets " << (Counter(cur, NStat::Sockets_Opened) - Counter(cur, NStat::Sockets_Closed)) << " drops " << Counter(cur, NStat::Drops) << " discarded " << Format_Bytes(static_cast<double>(Counter(cur, NStat::Discarded_Bytes)))
+			<< " | delay ms p50/p99 send " << Format_Percentiles(prev, cur, intcptor::NHistogram::Send_Delay_Ms) << " recv " << Format_Percentiles(prev, cur, intcptor::NHistogram::Recv_Delay_Ms)
+			<< "]]" << std::endl;
+
+		// the most active sockets of the interval; a socket, that reused the slot of another one, is compared to zero
+		struct TActivity {
+			size_t fd;
+			uint64_t bytes;
+		};
+		std::vector<TActivity> active;
+		for (size_t fd = 0; fd < intcptor::Stats_Max_Sockets; fd++) {
+			if (cur.generations[fd] == 0) {
+				continue;
+			}
+			const bool same = prev.generations[fd] == cur.generations[fd];
+			uint64_t bytes = 0;
+			for (auto stat : { intcptor::NSocket_Stat::Send_Bytes, intcptor::NSocket_Stat::Recv_Bytes }) {
+				bytes += Socket_Counter(cur, fd, stat) - (same ? Socket_Counter(prev, fd, stat) : 0);
+			}
+			if (bytes > 0) {
+				active.push_back({ fd, bytes });
+			}
+		}
+
+		const size_t listed = std::min(active.size(), Top_Sockets);
+		std::partial_sort(active.begin(), active.begin() + listed, active.end(), [](const TActivity& a, const TActivity& b) { return a.bytes > b.bytes; });
+
+		for (size_t i = 0; i < listed; i++) {
+			const size_t fd = active[i].fd;
+			const uint64_t fragments = Socket_Counter(cur, fd, intcptor::NSocket_Stat::Send_Fragments);
+			const uint64_t queued_socket = Socket_Counter(cur, fd, intcptor::NSocket_Stat::Send_Bytes) - std::min(Socket_Counter(cur, fd, intcptor::NSocket_Stat::Send_Bytes), Socket_Counter(cur, fd, intcptor::NSocket_Stat::Sent_Bytes));
+
+			std::cout << "[[InTCPtor Stats:   socket " << fd
+				<< " | " << Format_Bytes(static_cast<double>(active[i].bytes) / seconds) << "/s"
+				<< " | sent " << Format_Bytes(static_cast<double>(Socket_Counter(cur, fd, intcptor::NSocket_Stat::Sent_Bytes)))
+				<< " queued " << Format_Bytes(static_cast<double>(queued_socket))
+				<< " received " << Format_Bytes(static_cast<double>(Socket_Counter(cur, fd, intcptor::NSocket_Stat::Recv_Bytes)))
+				<< " | fragments " << fragments
+				<< " avg delay " << (fragments > 0 ? static_cast<double>(Socket_Counter(cur, fd, intcptor::NSocket_Stat::Send_Delay_Ms)) / static_cast<double>(fragments) : 0.0) << " ms"
+				<< " | short recv " << Socket_Counter(cur, fd, intcptor::NSocket_Stat::Recv_Short)
+				<< "]]" << std::endl;
+		}
+	}
+
+	bool Is_Running(int pid) {
+		return ::kill(pid, 0) == 0 || errno == EPERM;
+	}
+}
+
+int Run_Stats_Viewer(int pid, int interval_ms) {
+
+	const std::string name = intcptor::Stats_Segment_Name(pid);
+
+	// the process may have just been started, give the library a moment to publish the segment; the object is created
+	// empty and sized afterwards, mapping it before that would end with SIGBUS on the first access
+	constexpr int Max_Attempts = 50;
+	int attempt = 0;
+	int fd = -1;
+	bool found = false;
+	for (; attempt < Max_Attempts && fd < 0; attempt++) {
+		fd = ::shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+		if (fd >= 0) {
+			found = true;
+			struct stat st {};
+			if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(intcptor::TStats_Segment))) {
+				::close(fd);
+				fd = -1;
+			}
+		}
+		if (fd < 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+
+	if (fd < 0) {
+		if (found) {
+			std::cerr << "[[InTCPtor Runner: error: statistics segment " << name << " was not initialized in time]]" << std::endl;
+		}
+		else {
+			std::cerr << "[[InTCPtor Runner: error: no statistics of process " << pid << " found (is it running with Stats_Enabled = true?)]]" << std::endl;
+		}
+		return 1;
+	}
+
+	void* mem = ::mmap(nullptr, sizeof(intcptor::TStats_Segment), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (mem == MAP_FAILED) {
+		std::cerr << "[[InTCPtor Runner: error: cannot map statistics segment " << name << ", errno = " << errno << "]]" << std::endl;
+		return 1;
+	}
+
+	const auto* segment = static_cast<const intcptor::TStats_Segment*>(mem);
+
+	// the magic is stored last, once the library has filled in the header
+	for (; attempt < Max_Attempts && __atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) == 0; attempt++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != intcptor::Stats_Magic || segment->version != intcptor::Stats_Version) {
+		std::cerr << "[[InTCPtor Runner: error: statistics segment " << name << " has unknown format]]" << std::endl;
+		::munmap(mem, sizeof(intcptor::TStats_Segment));
+		return 1;
+	}
+
+	std::cout << "[[InTCPtor Runner: watching statistics of process " << pid << " every " << interval_ms << " ms]]" << std::endl;
+
+	// the snapshots are large (per-socket counters), keep them off the stack
+	auto first = std::make_unique<TSnapshot>();
+	auto prev = std::make_unique<TSnapshot>();
+	auto cur = std::make_unique<TSnapshot>();
+
+	Take_Snapshot(*segment, *first);
+	*prev = *first;
+
+	while (Is_Running(pid)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+
+		Take_Snapshot(*segment, *cur);
+		Print_Interval(*prev, *cur, *first);
+		std::swap(prev, cur);
+	}
+
+	std::cout << "[[InTCPtor Runner: process " << pid << " exited]]" << std::endl;
+
+	::munmap(mem, sizeof(intcptor::TStats_Segment));
+	return 0;
+}
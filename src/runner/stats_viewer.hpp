@@ -0,0 +1,11 @@
+/*
+ * InTCPtor - a library to simulate network trouble by intercepting socket calls
+ *
+ * This file contains the statistics viewer of the runner, that attaches to the shared memory segment of a running process.
+ */
+
+#pragma once
+
+// prints live statistics of the process with given pid every interval_ms milliseconds, until the process exits;
+// returns the exit code of the runner
+int Run_Stats_Viewer(int pid, int interval_ms);
@@ -0,0 +1,677 @@
+/*
+ * InTCPtor - interception overhead microbenchmark
+ *
+ * This file contains a microbenchmark measuring the cost of calls, that are intercepted by the InTCPtor library.
+ * Run it once directly and once through intcptor-run (or with LD_PRELOAD set) and compare the results, or let it do both
+ * with the --compare option.
+ *
+ * Measured calls:
+ *  - socket() and close() of a TCP socket
+ *  - accept() of a pending loopback connection
+ *  - send(), recv(), read() and write() of small buffers on an accepted loopback connection
+ *  - read() and write() of a single byte on a regular file (this must stay as close to the native call as possible)
+ *
+ * Every call is measured with 1, 2, 4, ... threads up to the requested maximum; every thread works on its own sockets and
+ * files, so the threads contend only inside the library (and the kernel). The results are printed as CSV.
+ *
+ * The library starts its own worker threads, and glibc takes a slower (cancellation-aware) path for syscalls in multi-threaded
+ * processes. To measure only the interception overhead, the benchmark always starts an idle thread on its own.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+constexpr size_t Default_Iterations = 2'000'000;
+constexpr size_t File_Size = 4096;
+// sockets are created (and connections accepted) in batches, so the process does not run out of descriptors
+constexpr size_t Socket_Batch = 256;
+constexpr size_t Accept_Batch = 32;
+// size of a single send()/recv() in the socket benchmarks
+constexpr size_t Message_Size = 64;
+// the receiving benchmarks read this much data, that is prepared in the socket before the measured loop
+constexpr size_t Recv_Fill = 32 * 1024;
+
+using TClock = std::chrono::steady_clock;
+
+// lets all threads of a measurement start the measured loop at the same time, after they prepared their sockets and files
+class CStart_Gate {
+	public:
+		explicit CStart_Gate(size_t threads) : mWaiting(threads) {
+		}
+
+		void Wait() {
+			std::unique_lock<std::mutex> lock(mMutex);
+			if (--mWaiting == 0) {
+				mCond.notify_all();
+			}
+			else {
+				mCond.wait(lock, [this]() { return mWaiting == 0; });
+			}
+		}
+
+	private:
+		std::mutex mMutex;
+		std::condition_variable mCond;
+		size_t mWaiting;
+};
+
+double Ns_Per_Call(TClock::duration elapsed, size_t calls) {
+	return std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(calls);
+}
+
+// creates an unlinked temporary file filled with File_Size bytes
+int Create_Temp_File() {
+
+	char path[] = "/tmp/intcptor-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		std::cerr << "Could not create temporary file" << std::endl;
+		return -1;
+	}
+	unlink(path);
+
+	std::vector<char> content(File_Size, 'x');
+	if (pwrite(fd, content.data(), content.size(), 0) != static_cast<ssize_t>(content.size())) {
+		std::cerr << "Could not fill temporary file" << std::endl;
+		close(fd);
+		return -1;
+	}
+	lseek(fd, 0, SEEK_SET);
+
+	return fd;
+}
+
+// creates a listening socket on a free loopback port
+int Create_Listener(sockaddr_in& addr) {
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	socklen_t len = sizeof(addr);
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 1024) != 0 || getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// connects a loopback client and accepts it; the accepted socket is the one the library manages (as in a server)
+bool Create_Connection(int& accepted, int& client) {
+
+	sockaddr_in addr;
+	const int listener = Create_Listener(addr);
+	if (listener < 0) {
+		return false;
+	}
+
+	client = socket(AF_INET, SOCK_STREAM, 0);
+	if (client < 0 || connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		close(listener);
+		return false;
+	}
+
+	accepted = accept(listener, nullptr, nullptr);
+	close(listener);
+
+	return accepted >= 0;
+}
+
+// measures ns per read() call on a regular file; the file offset is rewound only when the end is reached, so the measured
+// loop consists almost purely of read() calls
+double Bench_Read_File(size_t iterations, CStart_Gate& gate) {
+
+	const int fd = Create_Temp_File();
+	gate.Wait();
+	if (fd < 0) {
+		return -1;
+	}
+
+	char c;
+
+	const auto start = TClock::now();
+
+	for (size_t i = 0; i < iterations; i++) {
+		if (read(fd, &c, 1) != 1) {
+			lseek(fd, 0, SEEK_SET);
+		}
+	}
+
+	const auto end = TClock::now();
+
+	close(fd);
+
+	return Ns_Per_Call(end - start, iterations);
+}
+
+// measures ns per write() call on a regular file; the file is rewritten from the start, so it does not grow
+double Bench_Write_File(size_t iterations, CStart_Gate& gate) {
+
+	const int fd = Create_Temp_File();
+	gate.Wait();
+	if (fd < 0) {
+		return -1;
+	}
+
+	const char c = 'y';
+	size_t written = 0;
+
+	const auto start = TClock::now();
+
+	for (size_t i = 0; i < iterations; i++) {
+		if (write(fd, &c, 1) != 1 || ++written == File_Size) {
+			lseek(fd, 0, SEEK_SET);
+			written = 0;
+		}
+	}
+
+	const auto end = TClock::now();
+
+	close(fd);
+
+	return Ns_Per_Call(end - start, iterations);
+}
+
+// measures ns per socket() call; the sockets are closed outside of the measured sections
+double Bench_Socket(size_t iterations, CStart_Gate& gate) {
+
+	gate.Wait();
+
+	std::vector<int> fds(Socket_Batch);
+	TClock::duration elapsed{};
+
+	for (size_t done = 0; done < iterations; done += Socket_Batch) {
+		const auto start = TClock::now();
+		for (auto& fd : fds) {
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+		}
+		elapsed += TClock::now() - start;
+
+		for (const int fd : fds) {
+			if (fd < 0) {
+				return -1;
+			}
+			close(fd);
+		}
+	}
+
+	return Ns_Per_Call(elapsed, (iterations + Socket_Batch - 1) / Socket_Batch * Socket_Batch);
+}
+
+// measures ns per close() call of a socket; the sockets are created outside of the measured sections
+double Bench_Close(size_t iterations, CStart_Gate& gate) {
+
+	gate.Wait();
+
+	std::vector<int> fds(Socket_Batch);
+	TClock::duration elapsed{};
+
+	for (size_t done = 0; done < iterations; done += Socket_Batch) {
+		for (auto& fd : fds) {
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (fd < 0) {
+				return -1;
+			}
+		}
+
+		const auto start = TClock::now();
+		for (const int fd : fds) {
+			close(fd);
+		}
+		elapsed += TClock::now() - start;
+	}
+
+	return Ns_Per_Call(elapsed, (iterations + Socket_Batch - 1) / Socket_Batch * Socket_Batch);
+}
+
+// measures ns per accept() call; the connections are established (and closed) outside of the measured sections, so every
+// accept() finds a pending connection
+double Bench_Accept(size_t iterations, CStart_Gate& gate) {
+
+	sockaddr_in addr;
+	const int listener = Create_Listener(addr);
+	gate.Wait();
+	if (listener < 0) {
+		return -1;
+	}
+
+	std::vector<int> clients(Accept_Batch);
+	std::vector<int> accepted(Accept_Batch);
+	TClock::duration elapsed{};
+	bool failed = false;
+
+	for (size_t done = 0; done < iterations && !failed; done += Accept_Batch) {
+		for (auto& fd : clients) {
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+				failed = true;
+			}
+		}
+
+		const auto start = TClock::now();
+		for (auto& fd : accepted) {
+			fd = failed ? -1 : accept(listener, nullptr, nullptr);
+		}
+		elapsed += TClock::now() - start;
+
+		for (size_t i = 0; i < Accept_Batch; i++) {
+			failed = failed || accepted[i] < 0;
+			if (accepted[i] >= 0) {
+				close(accepted[i]);
+			}
+			if (clients[i] >= 0) {
+				close(clients[i]);
+			}
+		}
+	}
+
+	close(listener);
+
+	if (failed) {
+		return -1;
+	}
+
+	return Ns_Per_Call(elapsed, (iterations + Accept_Batch - 1) / Accept_Batch * Accept_Batch);
+}
+
+// measures ns per sending call on an accepted connection; the peer is drained by another thread, so the sender never waits
+// for the receiver for long
+template<typename TSend>
+double Bench_Socket_Send(size_t iterations, CStart_Gate& gate, TSend send_fn) {
+
+	int accepted = -1, client = -1;
+	const bool connected = Create_Connection(accepted, client);
+	gate.Wait();
+	if (!connected) {
+		return -1;
+	}
+
+	std::thread drain([client]() {
+		std::vector<char> buf(64 * 1024);
+		while (recv(client, buf.data(), buf.size(), 0) > 0) {
+		}
+	});
+
+	const char msg[Message_Size] = {};
+
+	const auto start = TClock::now();
+
+	for (size_t i = 0; i < iterations; i++) {
+		send_fn(accepted, msg, sizeof(msg));
+	}
+
+	const auto end = TClock::now();
+
+	// the drain thread stops once the connection is closed (and the queued data, if any, are flushed)
+	close(accepted);
+	drain.join();
+	close(client);
+
+	return Ns_Per_Call(end - start, iterations);
+}
+
+// measures ns per receiving call on an accepted connection; the data are sent by the peer and waited for outside of the
+// measured sections, so every call returns right away
+template<typename TRecv>
+double Bench_Socket_Recv(size_t iterations, CStart_Gate& gate, TRecv recv_fn) {
+
+	int accepted = -1, client = -1;
+	const bool connected = Create_Connection(accepted, client);
+	gate.Wait();
+	if (!connected) {
+		return -1;
+	}
+
+	std::vector<char> fill(Recv_Fill, 'z');
+	char msg[Message_Size];
+	TClock::duration elapsed{};
+	size_t calls = 0;
+
+	while (calls < iterations) {
+		if (send(client, fill.data(), fill.size(), 0) != static_cast<ssize_t>(fill.size())) {
+			break;
+		}
+
+		// the library may send the data asynchronously; wait until all of them arrive
+		int available = 0;
+		while (ioctl(accepted, FIONREAD, &available) == 0 && static_cast<size_t>(available) < Recv_Fill) {
+			std::this_thread::yield();
+		}
+
+		// the library may shorten the reads, so count the calls rather than the bytes
+		size_t received = 0;
+		const auto start = TClock::now();
+		while (received < Recv_Fill) {
+			const ssize_t res = recv_fn(accepted, msg, sizeof(msg));
+			if (res <= 0) {
+				break;
+			}
+			received += static_cast<size_t>(res);
+			calls++;
+		}
+		elapsed += TClock::now() - start;
+
+		if (received < Recv_Fill) {
+			break;
+		}
+	}
+
+	close(accepted);
+	close(client);
+
+	if (calls < iterations) {
+		return -1;
+	}
+
+	return Ns_Per_Call(elapsed, calls);
+}
+
+double Bench_Send(size_t iterations, CStart_Gate& gate) {
+	return Bench_Socket_Send(iterations, gate, [](int fd, const char* buf, size_t len) { return send(fd, buf, len, 0); });
+}
+
+double Bench_Write_Socket(size_t iterations, CStart_Gate& gate) {
+	return Bench_Socket_Send(iterations, gate, [](int fd, const char* buf, size_t len) { return write(fd, buf, len); });
+}
+
+double Bench_Recv(size_t iterations, CStart_Gate& gate) {
+	return Bench_Socket_Recv(iterations, gate, [](int fd, char* buf, size_t len) { return recv(fd, buf, len, 0); });
+}
+
+double Bench_Read_Socket(size_t iterations, CStart_Gate& gate) {
+	return Bench_Socket_Recv(iterations, gate, [](int fd, char* buf, size_t len) { return read(fd, buf, len); });
+}
+
+struct TBenchmark {
+	const char* call;
+	const char* target;
+	// the iteration count is divided by this, so the slow calls do not take forever
+	size_t divisor;
+	double (*run)(size_t iterations, CStart_Gate& gate);
+};
+
+const TBenchmark Benchmarks[] = {
+	{ "socket", "socket", 20, Bench_Socket },
+	{ "close", "socket", 20, Bench_Close },
+	{ "accept", "socket", 200, Bench_Accept },
+	{ "send", "socket", 20, Bench_Send },
+	{ "recv", "socket", 20, Bench_Recv },
+	{ "read", "socket", 20, Bench_Read_Socket },
+	{ "write", "socket", 20, Bench_Write_Socket },
+	{ "read", "file", 1, Bench_Read_File },
+	{ "write", "file", 1, Bench_Write_File },
+};
+
+// runs the benchmark in given number of threads at once; returns the average ns per call of the threads, or a negative
+// number on failure
+double Run_Threads(const TBenchmark& bench, size_t iterations, size_t threads) {
+
+	CStart_Gate gate(threads);
+	std::vector<double> results(threads, 0);
+	std::vector<std::thread> workers;
+
+	for (size_t t = 0; t < threads; t++) {
+		workers.emplace_back([&, t]() {
+			results[t] = bench.run(iterations, gate);
+		});
+	}
+
+	double sum = 0;
+	bool failed = false;
+	for (size_t t = 0; t < threads; t++) {
+		workers[t].join();
+		failed = failed || results[t] < 0;
+		sum += results[t];
+	}
+
+	return failed ? -1 : sum / static_cast<double>(threads);
+}
+
+// key of a single result row
+using TResult_Key = std::tuple<std::string, std::string, size_t>;
+
+// runs all benchmarks with 1, 2, 4, ... max_threads threads
+std::map<TResult_Key, double> Run_All(size_t iterations, size_t max_threads) {
+
+	std::map<TResult_Key, double> results;
+
+	std::vector<size_t> thread_counts;
+	for (size_t t = 1; t < max_threads; t *= 2) {
+		thread_counts.push_back(t);
+	}
+	thread_counts.push_back(max_threads);
+
+	for (const auto& bench : Benchmarks) {
+		const size_t bench_iterations = std::max<size_t>(1, iterations / bench.divisor);
+
+		// warm up caches and the page cache
+		Run_Threads(bench, bench_iterations / 10 + 1, 1);
+
+		for (const size_t threads : thread_counts) {
+			results[{ bench.call, bench.target, threads }] = Run_Threads(bench, bench_iterations, threads);
+		}
+	}
+
+	return results;
+}
+
+void Write_Results(std::ostream& os, const std::string& mode, const std::map<TResult_Key, double>& results) {
+	os << std::fixed << std::setprecision(2);
+	os << "mode,call,target,threads,ns_per_call" << std::endl;
+	for (const auto& [key, ns] : results) {
+		os << mode << "," << std::get<0>(key) << "," << std::get<1>(key) << "," << std::get<2>(key) << "," << ns << std::endl;
+	}
+}
+
+std::map<TResult_Key, double> Read_Results(std::istream& is) {
+	std::map<TResult_Key, double> results;
+	std::string line;
+	std::getline(is, line); // header
+	while (std::getline(is, line)) {
+		std::istringstream row(line);
+		std::string mode, call, target, threads, ns;
+		if (std::getline(row, mode, ',') && std::getline(row, call, ',') && std::getline(row, target, ',') && std::getline(row, threads, ',') && std::getline(row, ns)) {
+			results[{ call, target, std::strtoull(threads.c_str(), nullptr, 10) }] = std::strtod(ns.c_str(), nullptr);
+		}
+	}
+	return results;
+}
+
+// runs this benchmark again with the library preloaded and fault probabilities set to zero; returns its results
+bool Run_Preloaded(size_t iterations, size_t max_threads, std::map<TResult_Key, double>& results) {
+
+	std::string buf(1024, '\0');
+	const ssize_t len = readlink("/proc/self/exe", buf.data(), buf.size() - 1);
+	if (len <= 0) {
+		std::cerr << "Could not determine path of the benchmark" << std::endl;
+		return false;
+	}
+	buf.resize(static_cast<size_t>(len));
+
+	const std::string self = buf;
+	const std::string lib_path = std::filesystem::path(self).parent_path().string() + "/libintcptor-overrides.so";
+	if (!std::filesystem::exists(lib_path)) {
+		std::cerr << "Could not find " << lib_path << std::endl;
+		return false;
+	}
+
+	// the library reads its config from the working directory; the preloaded run gets its own one
+	char dir[] = "/tmp/intcptor-bench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		std::cerr << "Could not create temporary directory" << std::endl;
+		return false;
+	}
+
+	const std::string config_path = std::string(dir) + "/intcptor_config.cfg";
+	const std::string output_path = std::string(dir) + "/results.csv";
+	{
+		std::ofstream config(config_path);
+		config << "Send__1B_Sends 0\nSend__2B_Sends 0\nSend__2_Separate_Sends 0\nSend__2B_Sends_And_Second_Send 0\n"
+			<< "Recv__1B_Less 0\nRecv__2B_Less 0\nRecv__Half 0\nRecv__2B 0\n"
+			<< "Send_Delay_Ms_Mean 0\nSend_Delay_Ms_Sigma 0\nRecv_Delay_Ms_Mean 0\nRecv_Delay_Ms_Sigma 0\n"
+			<< "Drop_Connections 0\nLog_Enabled 0\n";
+	}
+
+	std::cerr << "Running preloaded benchmark..." << std::endl;
+
+	const pid_t pid = fork();
+	if (pid == 0) {
+		// the library prints its banner to stdout, keep it out of the results
+		const int devnull = open("/dev/null", O_WRONLY);
+		if (devnull >= 0) {
+			dup2(devnull, STDOUT_FILENO);
+		}
+		if (chdir(dir) != 0) {
+			_exit(1);
+		}
+		setenv("LD_PRELOAD", lib_path.c_str(), 1);
+
+		const std::string iterations_arg = std::to_string(iterations);
+		const std::string threads_arg = std::to_string(max_threads);
+		execl(self.c_str(), self.c_str(), "--iterations", iterations_arg.c_str(), "--threads", threads_arg.c_str(), "--output", output_path.c_str(), static_cast<char*>(nullptr));
+		_exit(1);
+	}
+
+	int status = 0;
+	const bool ok = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	if (ok) {
+		std::ifstream output(output_path);
+		results = Read_Results(output);
+	}
+	else {
+		std::cerr << "Preloaded benchmark failed" << std::endl;
+	}
+
+	std::filesystem::remove_all(dir);
+
+	return ok;
+}
+
+void Print_Usage(const char* name) {
+	std::cerr << "Usage: " << name << " [--iterations <n>] [--threads <max threads>] [--compare] [--output <csv file>]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+	size_t iterations = Default_Iterations;
+	size_t max_threads = 1;
+	bool compare = false;
+	std::string output_path;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (arg == "--iterations" && i + 1 < argc) {
+			iterations = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--threads" && i + 1 < argc) {
+			max_threads = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--compare") {
+			compare = true;
+		}
+		else if (arg == "--output" && i + 1 < argc) {
+			output_path = argv[++i];
+		}
+		else {
+			Print_Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (iterations == 0 || max_threads == 0) {
+		Print_Usage(argv[0]);
+		return 1;
+	}
+
+	const char* preload = getenv("LD_PRELOAD");
+	const bool preloaded = preload && std::strstr(preload, "intcptor") != nullptr;
+
+	if (compare && preloaded) {
+		std::cerr << "The comparison must be started without the library preloaded" << std::endl;
+		return 1;
+	}
+
+	// keep the process multi-threaded in both native and preloaded runs (see above)
+	std::mutex idle_mutex;
+	std::condition_variable idle_cond;
+	bool finished = false;
+	std::thread idle([&]() {
+		std::unique_lock<std::mutex> lock(idle_mutex);
+		idle_cond.wait(lock, [&]() { return finished; });
+	});
+
+	std::cerr << "InTCPtor bench: " << (preloaded ? "with preload" : "native") << ", " << iterations << " iterations, up to " << max_threads << " threads" << std::endl;
+
+	const auto results = Run_All(iterations, max_threads);
+
+	{
+		std::unique_lock<std::mutex> lock(idle_mutex);
+		finished = true;
+		idle_cond.notify_all();
+	}
+	idle.join();
+
+	if (!output_path.empty()) {
+		std::ofstream output(output_path);
+		Write_Results(output, preloaded ? "preload" : "native", results);
+		if (!output) {
+			std::cerr << "Could not write " << output_path << std::endl;
+			return 2;
+		}
+	}
+	else if (!compare) {
+		Write_Results(std::cout, preloaded ? "preload" : "native", results);
+	}
+
+	if (compare) {
+		std::map<TResult_Key, double> preload_results;
+		if (!Run_Preloaded(iterations, max_threads, preload_results)) {
+			return 2;
+		}
+
+		std::cout << std::fixed << std::setprecision(2);
+		std::cout << "call,target,threads,native_ns,preload_ns,overhead_ns" << std::endl;
+		for (const auto& [key, native_ns] : results) {
+			const auto itr = preload_results.find(key);
+			const double preload_ns = itr != preload_results.end() ? itr->second : -1;
+			std::cout << std::get<0>(key) << "," << std::get<1>(key) << "," << std::get<2>(key) << "," << native_ns << "," << preload_ns << "," << (native_ns >= 0 && preload_ns >= 0 ? preload_ns - native_ns : 0.0) << std::endl;
+		}
+	}
+
+	for (const auto& entry : results) {
+		if (entry.second < 0) {
+			return 2;
+		}
+	}
+
+	return 0;
+}
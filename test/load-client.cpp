@@ -0,0 +1,388 @@
+/*
+ * InTCPtor - epoll load generator
+ *
+ * This file contains a load generator for the InTCPtor library. It opens many concurrent connections to a server, that
+ * echoes messages of the simple protocol (messages start with "ABCD" and end with "\n"; see the load server and the simple
+ * server), keeps a fixed number of messages in flight on every connection and measures the time from sending a message to
+ * receiving its echo. At the end, it reports the throughput and latency percentiles.
+ *
+ * Connections closed by the server (e.g., dropped by the library) are reconnected; the messages in flight are counted as lost.
+ *
+ * Usage: intcptor-test-load-client [--host <address>] [--port <port>] [--connections <n>] [--threads <n>]
+ *                                  [--duration <seconds>] [--size <payload bytes>] [--depth <messages in flight>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+const std::string Hdr_Magic{ "ABCD" };
+
+constexpr int Max_Events = 256;
+
+using TClock = std::chrono::steady_clock;
+
+struct TOptions {
+	sockaddr_in address{};
+	size_t connections = 1000;
+	size_t threads = 1;
+	double duration_s = 10.0;
+	size_t size = 32;
+	size_t depth = 1;
+};
+
+struct TConnection {
+	int fd = -1;
+	bool connecting = false;
+	// the socket is registered for EPOLLOUT as well
+	bool waiting_out = false;
+	std::vector<char> in;
+	std::vector<char> out;
+	size_t out_pos = 0;
+	// send times of the messages in flight; the server echoes them in order
+	std::deque<TClock::time_point> sent_at;
+};
+
+// results of a single thread
+struct TThread_Result {
+	std::vector<uint32_t> latencies_us;
+	uint64_t bytes = 0;
+	uint64_t connects = 0;
+	uint64_t failures = 0;
+	uint64_t lost = 0;
+};
+
+bool Set_Nonblocking(int fd) {
+	const int flags = fcntl(fd, F_GETFL, 0);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// thousands of connections do not fit the default limit of open descriptors
+void Raise_Descriptor_Limit() {
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+}
+
+class CLoad_Thread {
+	public:
+		CLoad_Thread(const TOptions& options, size_t connections, TClock::time_point deadline)
+			: mOptions(options), mDeadline(deadline), mConnections(connections) {
+
+			mMessage = Hdr_Magic;
+			for (size_t i = 0; i < options.size; i++) {
+				mMessage.push_back(static_cast<char>('a' + i % 26));
+			}
+			mMessage.push_back('\n');
+		}
+
+		void Run() {
+			mEpoll = epoll_create1(0);
+
+			for (auto& conn : mConnections) {
+				Connect(conn);
+			}
+
+			struct epoll_event events[Max_Events];
+			char buf[16 * 1024];
+
+			while (TClock::now() < mDeadline) {
+				const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(mDeadline - TClock::now()).count();
+				const int n = epoll_wait(mEpoll, events, Max_Events, static_cast<int>(std::max<int64_t>(1, std::min<int64_t>(left, 100))));
+
+				for (int i = 0; i < n; i++) {
+					auto& conn = mConnections[events[i].data.u64];
+					Handle(conn, events[i].events, buf, sizeof(buf));
+				}
+			}
+
+			for (auto& conn : mConnections) {
+				if (conn.fd >= 0) {
+					close(conn.fd);
+				}
+			}
+			close(mEpoll);
+		}
+
+		TThread_Result& Result() {
+			return mResult;
+		}
+
+	private:
+		void Connect(TConnection& conn) {
+			conn = TConnection{};
+			conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (conn.fd < 0) {
+				mResult.failures++;
+				return;
+			}
+
+			Set_Nonblocking(conn.fd);
+			int opt = 1;
+			setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+			if (connect(conn.fd, reinterpret_cast<const sockaddr*>(&mOptions.address), sizeof(mOptions.address)) != 0 && errno != EINPROGRESS) {
+				mResult.failures++;
+				close(conn.fd);
+				conn.fd = -1;
+				return;
+			}
+
+			conn.connecting = true;
+			conn.waiting_out = true;
+
+			struct epoll_event ev{};
+			ev.events = EPOLLIN | EPOLLOUT;
+			ev.data.u64 = static_cast<uint64_t>(&conn - mConnections.data());
+			epoll_ctl(mEpoll, EPOLL_CTL_ADD, conn.fd, &ev);
+		}
+
+		// the connection failed or was closed by the server; it is opened again
+		void Reconnect(TConnection& conn) {
+			mResult.failures++;
+			mResult.lost += conn.sent_at.size();
+			close(conn.fd);
+			Connect(conn);
+		}
+
+		void Send_Message(TConnection& conn) {
+			conn.out.insert(conn.out.end(), mMessage.begin(), mMessage.end());
+			conn.sent_at.push_back(TClock::now());
+		}
+
+		// tries to send the pending messages; returns false if the connection failed
+		bool Flush(TConnection& conn) {
+			while (conn.out_pos < conn.out.size()) {
+				const ssize_t res = send(conn.fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+				if (res < 0) {
+					return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+				}
+				conn.out_pos += static_cast<size_t>(res);
+			}
+
+			conn.out.clear();
+			conn.out_pos = 0;
+			return true;
+		}
+
+		// matches received echoes to the messages in flight and sends a new message for each; returns false on invalid data
+		bool Process(TConnection& conn, TClock::time_point now) {
+			size_t pos = 0;
+			while (true) {
+				const char* nl = static_cast<const char*>(std::memchr(conn.in.data() + pos, '\n', conn.in.size() - pos));
+				if (!nl) {
+					break;
+				}
+
+				const size_t end = static_cast<size_t>(nl - conn.in.data()) + 1;
+				if (end - pos != mMessage.size() || conn.sent_at.empty() || std::memcmp(conn.in.data() + pos, mMessage.data(), mMessage.size()) != 0) {
+					return false;
+				}
+
+				const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(now - conn.sent_at.front()).count();
+				mResult.latencies_us.push_back(static_cast<uint32_t>(std::clamp<int64_t>(latency, 0, UINT32_MAX)));
+				mResult.bytes += mMessage.size();
+				conn.sent_at.pop_front();
+				pos = end;
+
+				Send_Message(conn);
+			}
+
+			conn.in.erase(conn.in.begin(), conn.in.begin() + static_cast<std::ptrdiff_t>(pos));
+			return true;
+		}
+
+		void Handle(TConnection& conn, uint32_t events, char* buf, size_t buf_size) {
+
+			if (conn.connecting) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				if ((events & EPOLLERR) || getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+					Reconnect(conn);
+					return;
+				}
+				if (!(events & EPOLLOUT)) {
+					return;
+				}
+
+				conn.connecting = false;
+				mResult.connects++;
+				for (size_t i = 0; i < mOptions.depth; i++) {
+					Send_Message(conn);
+				}
+			}
+
+			if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				bool alive = true;
+				while (true) {
+					const ssize_t res = recv(conn.fd, buf, buf_size, 0);
+					if (res > 0) {
+						conn.in.insert(conn.in.end(), buf, buf + res);
+						continue;
+					}
+					if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+						alive = false;
+					}
+					break;
+				}
+
+				if (!Process(conn, TClock::now())) {
+					std::cerr << "Invalid echo received" << std::endl;
+					alive = false;
+				}
+
+				if (!alive) {
+					Reconnect(conn);
+					return;
+				}
+			}
+
+			if (!Flush(conn)) {
+				Reconnect(conn);
+				return;
+			}
+
+			// wait for the socket to become writable only while there are pending data
+			if (conn.waiting_out == conn.out.empty()) {
+				conn.waiting_out = !conn.out.empty();
+				struct epoll_event ev{};
+				ev.events = EPOLLIN | (conn.waiting_out ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+				ev.data.u64 = static_cast<uint64_t>(&conn - mConnections.data());
+				epoll_ctl(mEpoll, EPOLL_CTL_MOD, conn.fd, &ev);
+			}
+		}
+
+		const TOptions& mOptions;
+		const TClock::time_point mDeadline;
+		std::string mMessage;
+		int mEpoll = -1;
+		std::vector<TConnection> mConnections;
+		TThread_Result mResult;
+};
+
+void Print_Usage(const char* name) {
+	std::cerr << "Usage: " << name << " [--host <address>] [--port <port>] [--connections <n>] [--threads <n>] [--duration <seconds>] [--size <payload bytes>] [--depth <messages in flight>]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+	TOptions options;
+	std::string host = "127.0.0.1";
+	int port = 10000;
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		const std::string arg = argv[i];
+		const char* value = argv[i + 1];
+		if (arg == "--host") {
+			host = value;
+		}
+		else if (arg == "--port") {
+			port = atoi(value);
+		}
+		else if (arg == "--connections") {
+			options.connections = std::strtoull(value, nullptr, 10);
+		}
+		else if (arg == "--threads") {
+			options.threads = std::strtoull(value, nullptr, 10);
+		}
+		else if (arg == "--duration") {
+			options.duration_s = std::strtod(value, nullptr);
+		}
+		else if (arg == "--size") {
+			options.size = std::strtoull(value, nullptr, 10);
+		}
+		else if (arg == "--depth") {
+			options.depth = std::strtoull(value, nullptr, 10);
+		}
+		else {
+			Print_Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc % 2 == 0 || port <= 0 || port > 65535 || options.connections == 0 || options.threads == 0 || options.duration_s <= 0 || options.depth == 0) {
+		Print_Usage(argv[0]);
+		return 1;
+	}
+
+	options.threads = std::min(options.threads, options.connections);
+
+	options.address.sin_family = AF_INET;
+	options.address.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &options.address.sin_addr) != 1) {
+		std::cerr << "Invalid IP address" << std::endl;
+		return 1;
+	}
+
+	Raise_Descriptor_Limit();
+
+	std::cout << "Running " << options.connections << " connections to " << host << ":" << port << " in " << options.threads << " threads for " << options.duration_s << " s, "
+		<< options.size << " B payload, " << options.depth << " messages in flight per connection" << std::endl;
+
+	const auto start = TClock::now();
+	const auto deadline = start + std::chrono::duration_cast<TClock::duration>(std::chrono::duration<double>(options.duration_s));
+
+	std::vector<std::unique_ptr<CLoad_Thread>> load_threads;
+	for (size_t i = 0; i < options.threads; i++) {
+		// spread the connections evenly
+		const size_t count = options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+		load_threads.push_back(std::make_unique<CLoad_Thread>(options, count, deadline));
+	}
+
+	std::vector<std::thread> workers;
+	for (auto& load_thread : load_threads) {
+		workers.emplace_back(&CLoad_Thread::Run, load_thread.get());
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+
+	const double elapsed = std::chrono::duration<double>(TClock::now() - start).count();
+
+	TThread_Result total;
+	for (auto& load_thread : load_threads) {
+		auto& result = load_thread->Result();
+		total.latencies_us.insert(total.latencies_us.end(), result.latencies_us.begin(), result.latencies_us.end());
+		total.bytes += result.bytes;
+		total.connects += result.connects;
+		total.failures += result.failures;
+		total.lost += result.lost;
+	}
+
+	std::sort(total.latencies_us.begin(), total.latencies_us.end());
+	auto percentile = [&](double p) -> uint32_t {
+		if (total.latencies_us.empty()) {
+			return 0;
+		}
+		return total.latencies_us[std::min(total.latencies_us.size() - 1, static_cast<size_t>(p * static_cast<double>(total.latencies_us.size())))];
+	};
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "Messages: " << total.latencies_us.size() << " (" << static_cast<double>(total.latencies_us.size()) / elapsed << " msg/s, "
+		<< static_cast<double>(total.bytes) / elapsed / (1024.0 * 1024.0) << " MB/s echoed)" << std::endl;
+	std::cout << "Latency us: p50 " << percentile(0.5) << ", p99 " << percentile(0.99) << ", p99.9 " << percentile(0.999)
+		<< ", max " << (total.latencies_us.empty() ? 0 : total.latencies_us.back()) << std::endl;
+	std::cout << "Connections: " << total.connects << " established, " << total.failures << " failed or closed, " << total.lost << " messages lost" << std::endl;
+
+	return total.latencies_us.empty() ? 2 : 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * InTCPtor - multi-threaded epoll reference server
+ *
+ * This file contains a reference TCP server for load tests of the InTCPtor library. It speaks the same protocol as the
+ * simple server - messages start with "ABCD" and end with "\n" - and echoes every message back as soon as it is received
+ * whole. Every thread has its own listening socket (bound with SO_REUSEPORT, so the kernel spreads the connections) and its
+ * own epoll instance, so the threads never share a connection.
+ *
+ * Usage: intcptor-test-load-server [<address> [<port> [<threads>]]]
+ */
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+const std::string Hdr_Magic{ "ABCD" };
+
+// messages longer than this are considered broken, and the connection is closed
+constexpr size_t Max_Message_Size = 64 * 1024;
+constexpr int Max_Events = 256;
+
+struct TConnection {
+	std::vector<char> in;
+	// echoed data, that could not be sent right away
+	std::vector<char> out;
+	size_t out_pos = 0;
+};
+
+std::atomic<uint64_t> gConnections{ 0 };
+std::atomic<uint64_t> gMessages{ 0 };
+
+bool Set_Nonblocking(int fd) {
+	const int flags = fcntl(fd, F_GETFL, 0);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// thousands of connections do not fit the default limit of open descriptors
+void Raise_Descriptor_Limit() {
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+}
+
+int Create_Listener(const sockaddr_in& address) {
+
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int opt = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+	if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, 4096) < 0 || !Set_Nonblocking(fd)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// tries to send the pending echoed data; returns false if the connection failed
+bool Flush(int fd, TConnection& conn) {
+	while (conn.out_pos < conn.out.size()) {
+		const ssize_t res = send(fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+		if (res < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		conn.out_pos += static_cast<size_t>(res);
+	}
+
+	conn.out.clear();
+	conn.out_pos = 0;
+	return true;
+}
+
+// extracts whole messages from the received data and echoes them; returns false if the data are not valid messages
+bool Process(TConnection& conn) {
+
+	size_t pos = 0;
+	while (true) {
+		const char* nl = static_cast<const char*>(std::memchr(conn.in.data() + pos, '\n', conn.in.size() - pos));
+		if (!nl) {
+			break;
+		}
+
+		const size_t end = static_cast<size_t>(nl - conn.in.data()) + 1;
+		if (end - pos < Hdr_Magic.size() + 1 || std::string_view(conn.in.data() + pos, Hdr_Magic.size()) != Hdr_Magic) {
+			return false;
+		}
+
+		conn.out.insert(conn.out.end(), conn.in.begin() + static_cast<std::ptrdiff_t>(pos), conn.in.begin() + static_cast<std::ptrdiff_t>(end));
+		gMessages.fetch_add(1, std::memory_order_relaxed);
+		pos = end;
+	}
+
+	conn.in.erase(conn.in.begin(), conn.in.begin() + static_cast<std::ptrdiff_t>(pos));
+
+	return conn.in.size() <= Max_Message_Size;
+}
+
+void Serve(const sockaddr_in address) {
+
+	const int listener = Create_Listener(address);
+	if (listener < 0) {
+		std::cerr << "Could not listen on " << inet_ntoa(address.sin_addr) << ":" << ntohs(address.sin_port) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	const int epfd = epoll_create1(0);
+	struct epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = listener;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+
+	std::unordered_map<int, TConnection> connections;
+	struct epoll_event events[Max_Events];
+	char buf[16 * 1024];
+
+	while (true) {
+		const int n = epoll_wait(epfd, events, Max_Events, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::cerr << "epoll_wait reported an error: " << errno << std::endl;
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < n; i++) {
+			const int fd = events[i].data.fd;
+
+			if (fd == listener) {
+				int client;
+				while ((client = accept(listener, nullptr, nullptr)) >= 0) {
+					Set_Nonblocking(client);
+					int opt = 1;
+					setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+					struct epoll_event cev{};
+					cev.events = EPOLLIN;
+					cev.data.fd = client;
+					epoll_ctl(epfd, EPOLL_CTL_ADD, client, &cev);
+					connections[client];
+					gConnections.fetch_add(1, std::memory_order_relaxed);
+				}
+				continue;
+			}
+
+			auto itr = connections.find(fd);
+			if (itr == connections.end()) {
+				continue;
+			}
+			auto& conn = itr->second;
+			const bool had_pending = !conn.out.empty();
+
+			bool alive = !(events[i].events & EPOLLERR);
+
+			if (alive && (events[i].events & (EPOLLIN | EPOLLHUP))) {
+				while (true) {
+					const ssize_t res = recv(fd, buf, sizeof(buf), 0);
+					if (res > 0) {
+						conn.in.insert(conn.in.end(), buf, buf + res);
+						continue;
+					}
+					if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+						alive = false;
+					}
+					break;
+				}
+
+				if (!Process(conn)) {
+					std::cerr << "Invalid message format" << std::endl;
+					alive = false;
+				}
+			}
+
+			alive = alive && Flush(fd, conn);
+
+			if (!alive) {
+				close(fd);
+				connections.erase(itr);
+				continue;
+			}
+
+			// wait for the socket to become writable only while there are pending data
+			if (had_pending != !conn.out.empty()) {
+				struct epoll_event cev{};
+				cev.events = EPOLLIN | (conn.out.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+				cev.data.fd = fd;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &cev);
+			}
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+
+	std::string server_bind_addr = "127.0.0.1";
+	if (argc > 1) {
+		server_bind_addr = argv[1];
+	}
+
+	int port = 10000;
+	if (argc > 2) {
+		port = atoi(argv[2]);
+	}
+
+	if (port < 0 || port > 65535) {
+		std::cerr << "Invalid port number" << std::endl;
+		return 1;
+	}
+
+	size_t threads = std::thread::hardware_concurrency();
+	if (argc > 3) {
+		threads = std::strtoull(argv[3], nullptr, 10);
+	}
+	if (threads == 0) {
+		threads = 1;
+	}
+
+	struct sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	if (inet_pton(AF_INET, server_bind_addr.c_str(), &address.sin_addr) != 1) {
+		std::cerr << "Invalid IP address" << std::endl;
+		return 1;
+	}
+
+	Raise_Descriptor_Limit();
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < threads; i++) {
+		workers.emplace_back(Serve, address);
+	}
+
+	std::cout << "Listening on " << server_bind_addr << ":" << port << " with " << threads << " threads" << std::endl;
+
+	// report the load every few seconds, so a long test can be watched
+	uint64_t last_messages = 0;
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::seconds(5));
+		const uint64_t messages = gMessages.load(std::memory_order_relaxed);
+		std::cout << "Connections accepted: " << gConnections.load(std::memory_order_relaxed) << ", messages: " << messages << " (" << (messages - last_messages) / 5 << "/s)" << std::endl;
+		last_messages = messages;
+	}
+
+	return 0;
+}
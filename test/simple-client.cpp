@@ -19,10 +19,48 @@
 
 #include <thread>
 #include <chrono>
+#include <cstring>
 
 const std::string Default_Addr = "127.0.0.1";
 const int Default_Port = 10000;
 
+// sockets the library did not see created (socketpair() ends, duplicates made by dup()) are passed through untouched;
+// the data sent through them must arrive
+bool Check_Passthrough() {
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+		return false;
+	}
+
+	// do not wait forever, if the data got lost
+	struct timeval timeout = { 2, 0 };
+	setsockopt(pair[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	const int dup_fd = dup(pair[0]);
+
+	bool ok = send(pair[0], "pair", 4, 0) == 4 && send(dup_fd, "dup!", 4, 0) == 4;
+
+	char buf[8];
+	size_t pos = 0;
+	while (ok && pos < sizeof(buf)) {
+		const ssize_t res = recv(pair[1], buf + pos, sizeof(buf) - pos, 0);
+		if (res <= 0) {
+			ok = false;
+			break;
+		}
+		pos += static_cast<size_t>(res);
+	}
+
+	ok = ok && std::memcmp(buf, "pairdup!", sizeof(buf)) == 0;
+
+	close(dup_fd);
+	close(pair[0]);
+	close(pair[1]);
+
+	return ok;
+}
+
 int main(int argc, char** argv) {
 
 	int client_socket;
@@ -48,6 +86,11 @@ int main(int argc, char** argv) {
 		return 2;
 	}
 
+	if (!Check_Passthrough()) {
+		std::cerr << "Data sent through socketpair() or dup() sockets did not arrive" << std::endl;
+		return 3;
+	}
+
 	for (size_t ii = 0; ii < 10; ii++) {
 
 		// send some messages starting with expected header and ending with newline